@@ -7,6 +7,7 @@ import logging
 
 from ..engine import SimEngineBase
 from ...state_plugins.inspect import BP_AFTER, BP_BEFORE, NO_OVERRIDE
+from ...state_plugins.unicorn_engine import vex_lift_lock
 from ...misc.ux import once
 from ...errors import SimEngineError, SimTranslationError, SimError
 from ... import sim_options as o
@@ -226,17 +227,19 @@ class VEXLifter(SimEngineBase):
         try:
             for subphase in range(2):
 
-                irsb = pyvex.lift(buff, addr + thumb, arch,
-                                  max_bytes=size,
-                                  max_inst=num_inst,
-                                  bytes_offset=thumb,
-                                  traceflags=traceflags,
-                                  opt_level=opt_level,
-                                  strict_block_end=strict_block_end,
-                                  skip_stmts=skip_stmts,
-                                  collect_data_refs=collect_data_refs,
-                                  cross_insn_opt=cross_insn_opt
-                                  )
+                # native runs on other threads lift with the same libVEX
+                with vex_lift_lock():
+                    irsb = pyvex.lift(buff, addr + thumb, arch,
+                                      max_bytes=size,
+                                      max_inst=num_inst,
+                                      bytes_offset=thumb,
+                                      traceflags=traceflags,
+                                      opt_level=opt_level,
+                                      strict_block_end=strict_block_end,
+                                      skip_stmts=skip_stmts,
+                                      collect_data_refs=collect_data_refs,
+                                      cross_insn_opt=cross_insn_opt
+                                      )
 
                 if subphase == 0 and irsb.statements is not None:
                     # check for possible stop points
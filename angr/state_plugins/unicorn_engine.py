@@ -9,7 +9,9 @@ import logging
 import pyvex
 import claripy
 import time
+import struct
 import binascii
+import contextlib
 
 from ..sim_options import UNICORN_HANDLE_TRANSMIT_SYSCALL
 from ..errors import SimValueError, SimUnicornUnsupport, SimSegfaultError, SimMemoryError, SimMemoryMissingError, SimUnicornError
@@ -33,6 +35,19 @@ MEM_PATCH._fields_ = [
         ('next', ctypes.POINTER(MEM_PATCH))
     ]
 
+class SYNC_HEADER(ctypes.Structure): # sync_header_t
+    _fields_ = [
+        ('count', ctypes.c_uint64),
+        ('size', ctypes.c_uint64)
+    ]
+
+class SYNC_RANGE(ctypes.Structure): # sync_range_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('length', ctypes.c_uint64),
+        ('offset', ctypes.c_uint64)
+    ]
+
 class TRANSMIT_RECORD(ctypes.Structure): # transmit_record_t
     pass
 
@@ -63,6 +78,63 @@ class STOP:  # stop_t
                 return item
         raise ValueError(num)
 
+class PROFILE_BLOCK(ctypes.Structure): # profile_block_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('executions', ctypes.c_uint64),
+        ('instructions', ctypes.c_uint64),
+        ('stops', ctypes.c_uint64 * (STOP.STOP_HLT + 1))
+    ]
+
+class STATS(ctypes.Structure): # stats_t
+    _fields_ = [
+        ('blocks', ctypes.c_uint64),
+        ('mem_reads', ctypes.c_uint64),
+        ('mem_writes', ctypes.c_uint64),
+        ('taint_lookups', ctypes.c_uint64),
+        ('rollbacks', ctypes.c_uint64),
+        ('block_cache_hits', ctypes.c_uint64),
+        ('block_cache_misses', ctypes.c_uint64),
+        ('speculative_hits', ctypes.c_uint64),
+        ('lifts', ctypes.c_uint64),
+        ('lift_ns', ctypes.c_uint64),
+        ('page_cache_hits', ctypes.c_uint64),
+        ('page_cache_misses', ctypes.c_uint64),
+        ('sync_ranges', ctypes.c_uint64),
+        ('sync_bytes', ctypes.c_uint64),
+        ('trace_chunks_dropped', ctypes.c_uint64),
+        ('stops', ctypes.c_uint64 * (STOP.STOP_HLT + 1))
+    ]
+
+    def as_dict(self):
+        d = { name: getattr(self, name) for name, _ in self._fields_ if name != 'stops' }
+        d['stops'] = { STOP.name_stop(reason): count for reason, count in enumerate(self.stops) if count }
+        return d
+
+class BATCH:  # batch_status_t
+    BATCH_PENDING       = 0
+    BATCH_FINISHED      = 1
+    BATCH_CANCELLED     = 2
+
+class BATCH_RUN(ctypes.Structure): # batch_run_t
+    _fields_ = [
+        ('state', ctypes.c_void_p),
+        ('pc', ctypes.c_uint64),
+        ('step', ctypes.c_uint64),
+        ('err', ctypes.c_int),
+        ('status', ctypes.c_int)
+    ]
+
+class TRACE:  # trace_mode_t
+    TRACE_FULL          = 0
+    TRACE_RING          = 1
+    TRACE_COMPRESSED    = 2
+
+class TRACE_EVENT:  # trace_event_t
+    TRACE_EVENT_BLOCK   = 0
+    TRACE_EVENT_STACK   = 1
+    TRACE_EVENT_PAGE    = 2
+
 #
 # Memory mapping errors - only used internally
 #
@@ -105,6 +177,8 @@ class Uniwrapper(unicorn.Uc if unicorn is not None else object):
         self.cache_key = cache_key
         self.wrapped_mapped = set()
         self.wrapped_hooks = set()
+        self.loaded_snapshots = set()
+        self.stop_points = None # what the native stop point index of this engine holds, if known
         self.id = None
         unicorn.Uc.__init__(self, arch.uc_arch, arch.uc_mode)
 
@@ -151,6 +225,14 @@ class Uniwrapper(unicorn.Uc if unicorn is not None else object):
         #self.hook_reset()
         #l.debug("Reset complete.")
 
+    def __del__(self):
+        # the native side keeps some things per engine, which must go before unicorn can reuse its address
+        if _UC_NATIVE is not None and getattr(self, '_uch', None):
+            _UC_NATIVE.engine_closed(self._uch)
+        close = getattr(unicorn.Uc, '__del__', None)
+        if close is not None:
+            close(self)
+
 _unicorn_tls = threading.local()
 _unicorn_tls.uc = None
 
@@ -202,23 +284,41 @@ def _load_native():
             getattr(handle, func).restype = restype
             getattr(handle, func).argtypes = argtypes
 
-        #_setup_prototype_explicit(h, 'logSetLogLevel', None, ctypes.c_uint64)
+        if hasattr(h, 'logSetLogLevel'): # not built on windows
+            _setup_prototype_explicit(h, 'logSetLogLevel', None, ctypes.c_int)
         _setup_prototype(h, 'alloc', state_t, uc_engine_t, ctypes.c_uint64)
         _setup_prototype(h, 'dealloc', None, state_t)
+        _setup_prototype(h, 'engine_closed', None, uc_engine_t)
+        _setup_prototype(h, 'fork', state_t, state_t, uc_engine_t)
+        _setup_prototype(h, 'run_batch', ctypes.c_int64, ctypes.POINTER(BATCH_RUN), ctypes.c_uint64, ctypes.c_uint64,
+                ctypes.c_uint64)
         _setup_prototype(h, 'hook', None, state_t)
         _setup_prototype(h, 'unhook', None, state_t)
         _setup_prototype(h, 'start', uc_err, state_t, ctypes.c_uint64, ctypes.c_uint64)
         _setup_prototype(h, 'stop', None, state_t, stop_t)
+        _setup_prototype(h, 'start_async', ctypes.c_bool, state_t, ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'wait', ctypes.c_bool, state_t, ctypes.c_int64, ctypes.POINTER(uc_err))
+        _setup_prototype(h, 'cancel', None, state_t)
         _setup_prototype(h, 'sync', ctypes.POINTER(MEM_PATCH), state_t)
+        _setup_prototype(h, 'sync_into', ctypes.c_uint64, state_t, ctypes.c_void_p, ctypes.c_uint64)
+        _setup_prototype(h, 'sync_export', ctypes.c_void_p, state_t, ctypes.POINTER(ctypes.c_uint64))
         _setup_prototype(h, 'bbl_addrs', ctypes.POINTER(ctypes.c_uint64), state_t)
         _setup_prototype(h, 'stack_pointers', ctypes.POINTER(ctypes.c_uint64), state_t)
         _setup_prototype(h, 'bbl_addr_count', ctypes.c_uint64, state_t)
+        _setup_prototype(h, 'stack_pointer_count', ctypes.c_uint64, state_t)
+        _setup_prototype(h, 'set_trace_mode', None, state_t, ctypes.c_int, ctypes.c_uint64)
+        _setup_prototype(h, 'set_coverage_map', None, state_t, ctypes.c_void_p, ctypes.c_uint64)
+        _setup_prototype(h, 'trace_decode', ctypes.c_uint64, state_t, ctypes.c_bool, ctypes.POINTER(ctypes.c_uint64), ctypes.c_uint64)
+        _setup_prototype(h, 'get_stats', None, state_t, ctypes.POINTER(STATS))
         _setup_prototype(h, 'syscall_count', ctypes.c_uint64, state_t)
+        _setup_prototype(h, 'smc_count', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'destroy', None, ctypes.POINTER(MEM_PATCH))
         _setup_prototype(h, 'step', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'stop_reason', stop_t, state_t)
         _setup_prototype(h, 'activate', None, state_t, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_char_p)
         _setup_prototype(h, 'set_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'add_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'remove_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
         _setup_prototype(h, 'cache_page', ctypes.c_bool, state_t, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_uint64)
         _setup_prototype(h, 'uncache_pages_touching_region', None, state_t, ctypes.c_uint64, ctypes.c_uint64)
         _setup_prototype(h, 'clear_page_cache', None, state_t)
@@ -234,6 +334,20 @@ def _load_native():
         _setup_prototype(h, 'set_tracking', None, state_t, ctypes.c_bool, ctypes.c_bool)
         _setup_prototype(h, 'executed_pages', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'in_cache', ctypes.c_bool, state_t, ctypes.c_uint64)
+        _setup_prototype(h, 'set_block_cache_file', ctypes.c_bool, ctypes.c_char_p)
+        _setup_prototype(h, 'set_speculative_lifting', None, ctypes.c_bool)
+        _setup_prototype(h, 'lift_lock', None)
+        _setup_prototype(h, 'lift_unlock', None)
+        _setup_prototype(h, 'set_trace_file', ctypes.c_bool, ctypes.c_char_p)
+        _setup_prototype(h, 'set_profiling', None, ctypes.c_bool)
+        _setup_prototype(h, 'reset_profile', None)
+        _setup_prototype(h, 'profile_size', ctypes.c_uint64)
+        _setup_prototype(h, 'profile_dump', ctypes.c_uint64, ctypes.POINTER(PROFILE_BLOCK), ctypes.c_uint64)
+        _setup_prototype(h, 'save_page_cache', ctypes.c_bool, ctypes.c_uint64, ctypes.c_char_p)
+        _setup_prototype(h, 'load_page_cache', ctypes.c_bool, state_t, ctypes.c_char_p)
+        _setup_prototype(h, 'record_run', ctypes.c_bool, state_t, ctypes.c_char_p)
+        _setup_prototype(h, 'load_run', state_t, ctypes.c_char_p, ctypes.POINTER(uc_engine_t), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'unload_run', None, state_t)
 
         l.info('native plugin is enabled')
 
@@ -248,6 +362,347 @@ try:
 except ImportError:
     _UC_NATIVE = None
 
+def set_block_cache_file(path):
+    """
+    Persist the native engine's block feasibility checks in a file, so that later processes using the same file
+    do not lift blocks they have already seen. The file may be shared by several processes at once.
+
+    :param path:    Path of the cache file, created if needed, or None to stop using one.
+    :return:        True if the file could be opened.
+    :rtype:         bool
+    """
+    if _UC_NATIVE is None:
+        return False
+    return _UC_NATIVE.set_block_cache_file(None if path is None else path.encode())
+
+
+def set_speculative_lifting(enable):
+    """
+    Turn on or off lifting, on a background thread, the blocks that freshly lifted blocks jump to. It is off by
+    default, and only matters when symbolic registers are tracked.
+
+    :param enable:  Whether to lift ahead of time.
+    """
+    if _UC_NATIVE is not None:
+        _UC_NATIVE.set_speculative_lifting(enable)
+
+
+@contextlib.contextmanager
+def vex_lift_lock():
+    """
+    Hold the lock native code lifts with. libVEX keeps the blocks it lifts in one global arena, which pyvex and the
+    native threads of run_batch, start_async and speculative lifting share, so every pyvex lift and every use of its
+    result straight out of libVEX must happen with this held. The VEX lifter takes it around each lift; code calling
+    pyvex.lift itself while native runs are going on must take it as well. Nothing in the native library may be called
+    while holding it.
+    """
+    if _UC_NATIVE is None:
+        yield
+        return
+    _UC_NATIVE.lift_lock()
+    try:
+        yield
+    finally:
+        _UC_NATIVE.lift_unlock()
+
+
+def set_trace_file(path):
+    """
+    Stream the block addresses, stack pointers and newly executed pages of every native run from now on to a file,
+    which read_trace_file can read back. Runs still going when the file is replaced or closed finish their traces in
+    it first. Runs don't wait for a writer that falls behind; the events they can't hand over are dropped, and counted
+    in the trace_chunks_dropped stat.
+
+    :param path:    Path of the trace file, overwritten if it exists, or None to stop tracing.
+    :return:        True if the file could be created.
+    :rtype:         bool
+    """
+    if _UC_NATIVE is None:
+        return False
+    return _UC_NATIVE.set_trace_file(None if path is None else path.encode())
+
+
+_TRACE_FILE_HEADER = struct.Struct('<IIII')  # trace_file_header_t
+_TRACE_CHUNK_HEADER = struct.Struct('<IIQII')  # trace_chunk_header_t
+_TRACE_FILE_MAGIC = 0x31465453
+_TRACE_FILE_VERSION = 1
+
+def read_trace_file(path):
+    """
+    Read back a file written after set_trace_file. Events of one run come in the order they happened, but the events
+    of runs on different threads may be interleaved. A chunk cut short, by a crash for example, ends the trace.
+
+    :param path:    Path of the trace file.
+    :return:        A generator of (run, kind, value) tuples, where kind is one of TRACE_EVENT. A TRACE_EVENT_BLOCK is
+                    followed by the stack pointer at the start of its block, and a TRACE_EVENT_PAGE comes right before
+                    the first block of a run on that page.
+    """
+    with open(path, 'rb') as f:
+        header = f.read(_TRACE_FILE_HEADER.size)
+        if len(header) != _TRACE_FILE_HEADER.size:
+            raise ValueError("%s is not a trace file" % path)
+        magic, version, _, _ = _TRACE_FILE_HEADER.unpack(header)
+        if magic != _TRACE_FILE_MAGIC or version != _TRACE_FILE_VERSION:
+            raise ValueError("%s is not a trace file" % path)
+
+        while True:
+            header = f.read(_TRACE_CHUNK_HEADER.size)
+            if len(header) != _TRACE_CHUNK_HEADER.size:
+                return
+            size, events, run, _, _ = _TRACE_CHUNK_HEADER.unpack(header)
+            payload = f.read(size)
+            if len(payload) != size:
+                return
+
+            # each event is a zigzag varint of the difference from the last event of its kind in the chunk, with the
+            # kind in the low two bits of its first byte
+            last = [0, 0, 0, 0]
+            pos = 0
+            for _ in range(events):
+                byte = payload[pos]
+                pos += 1
+                kind = byte & 3
+                zigzag = (byte >> 2) & 0x1f
+                shift = 5
+                while byte & 0x80:
+                    byte = payload[pos]
+                    pos += 1
+                    zigzag |= (byte & 0x7f) << shift
+                    shift += 7
+                delta = (zigzag >> 1) ^ -(zigzag & 1)
+                last[kind] = (last[kind] + delta) & 0xffffffffffffffff
+                yield run, kind, last[kind]
+
+
+def set_native_log_level(level):
+    """
+    Set which messages of the native engine are logged to stderr. Debug messages cover every block and memory access,
+    and are cheap enough to turn on in production: they are formatted and written on a background thread.
+
+    :param level:   A level of the logging module. Messages less severe are dropped.
+    """
+    if _UC_NATIVE is None or not hasattr(_UC_NATIVE, 'logSetLogLevel'):
+        return
+    # enum llevel_t counts up from FATAL to DEBUG
+    for native_level, python_level in enumerate((logging.CRITICAL, logging.ERROR, logging.WARNING, logging.INFO)):
+        if level >= python_level:
+            _UC_NATIVE.logSetLogLevel(native_level)
+            return
+    _UC_NATIVE.logSetLogLevel(4)
+
+
+def set_profiling(enable):
+    """
+    Turn on or off counting, for every native run started from then on, how often each block runs and which blocks
+    runs stop in. Counts add up until reset_profile is called.
+
+    :param enable:  Whether to profile.
+    """
+    if _UC_NATIVE is not None:
+        _UC_NATIVE.set_profiling(enable)
+
+
+def reset_profile():
+    """
+    Forget everything profiled so far.
+    """
+    if _UC_NATIVE is not None:
+        _UC_NATIVE.reset_profile()
+
+
+def get_profile():
+    """
+    Get the counts collected since profiling was turned on.
+
+    :return:    A dict from block address to a dict with the number of 'executions' of the block, the number of
+                'instructions' they made up (0 if they could not be counted), and 'stops', a dict from the name of
+                each stop reason that ended runs in the block to the number of such runs.
+    """
+    if _UC_NATIVE is None:
+        return { }
+    size = _UC_NATIVE.profile_size()
+    blocks = (PROFILE_BLOCK * size)()
+    size = _UC_NATIVE.profile_dump(blocks, size)
+    profile = { }
+    for block in blocks[:size]:
+        stops = { STOP.name_stop(reason): count for reason, count in enumerate(block.stops) if count }
+        profile[block.address] = {
+            'executions': block.executions,
+            'instructions': block.instructions,
+            'stops': stops,
+        }
+    return profile
+
+
+def _profile_frames(project, addr):
+    if project is None:
+        return [ '%#x' % addr ]
+    frames = [ ]
+    obj = project.loader.find_object_containing(addr)
+    if obj is not None:
+        frames.append(os.path.basename(obj.binary) if obj.binary else str(obj))
+    sym = project.loader.find_symbol(addr, fuzzy=True)
+    if sym is not None:
+        frames.append(sym.name)
+    frames.append('%#x' % addr)
+    # ';' separates frames in the collapsed format
+    return [ frame.replace(';', ':') for frame in frames ]
+
+
+def write_profile(path, project=None, weight='instructions'):
+    """
+    Write the profile (see get_profile) in the collapsed stack format that flamegraph.pl, speedscope and friends read:
+    one line per block, made of the binary, symbol and address of the block, separated by semicolons, then a space
+    and the count.
+
+    :param path:        Path of the file to write.
+    :param project:     The project whose loader names the blocks. Without it, blocks are only named by address.
+    :param weight:      What to count: 'instructions' or 'executions' of each block, or 'stops', which adds the stop
+                        reason as the innermost frame and counts runs that ended there. Blocks whose instructions
+                        could not be counted are weighed by their executions instead.
+    """
+    if weight not in ('instructions', 'executions', 'stops'):
+        raise ValueError("Unknown profile weight %s" % weight)
+    with open(path, 'w') as f:
+        for addr, counts in sorted(get_profile().items()):
+            frames = ';'.join(_profile_frames(project, addr))
+            if weight == 'stops':
+                for reason, count in sorted(counts['stops'].items()):
+                    f.write('%s;%s %d\n' % (frames, reason, count))
+                continue
+            count = counts[weight] or counts['executions']
+            if count:
+                f.write('%s %d\n' % (frames, count))
+
+
+def get_stats():
+    """
+    Get the native engine's counters, summed over the runs finished on this thread since reset_stats. The counters of
+    the last run of a state are in its unicorn plugin's stats.
+
+    :return:    A dict from counter name (see stats_t in sim_unicorn.cpp) to its value. 'stops' is a dict from stop
+                reason name to the number of runs that stopped for it.
+    """
+    totals = getattr(_unicorn_tls, 'stats', None)
+    if totals is None:
+        return { }
+    d = dict(totals)
+    d['stops'] = dict(totals['stops'])
+    return d
+
+
+def reset_stats():
+    """
+    Set the counters returned by get_stats back to zero.
+    """
+    _unicorn_tls.stats = None
+
+
+def _add_stats(stats):
+    totals = getattr(_unicorn_tls, 'stats', None)
+    if totals is None:
+        totals = _unicorn_tls.stats = { name: 0 for name in stats }
+        totals['stops'] = { }
+    for name, value in stats.items():
+        if name == 'stops':
+            for reason, count in value.items():
+                totals['stops'][reason] = totals['stops'].get(reason, 0) + count
+        else:
+            totals[name] += value
+
+
+def replay_snapshot(path, step=None):
+    """
+    Run a snapshot written by dump_snapshot again, as `native/replay` does: on an engine of its own, without Python.
+
+    :param path:    Path of the snapshot file.
+    :param step:    How many steps to run for, the number the run was recorded with if None.
+    :return:        The number of steps the replay took and the STOP it stopped for.
+    """
+    uc = ctypes.c_void_p()
+    pc = ctypes.c_uint64()
+    recorded_step = ctypes.c_uint64()
+    state = _UC_NATIVE.load_run(path.encode(), ctypes.byref(uc), ctypes.byref(pc), ctypes.byref(recorded_step))
+    if not state:
+        raise SimUnicornError("cannot load the run snapshot %s" % path)
+    try:
+        _UC_NATIVE.start(state, pc, recorded_step if step is None else step)
+        return _UC_NATIVE.step(state), _UC_NATIVE.stop_reason(state)
+    finally:
+        _UC_NATIVE.unload_run(state)
+
+def run_batch(plugins, threads=0, timeout=None, step=None):
+    """
+    Do what start() does for several states at once, on a pool of native threads and with the GIL released, instead of
+    one state after another. Every plugin must have been set up on an engine of its own; engines are per thread, so
+    set them up on different threads. Call finish() on each plugin that ran, as after start(). Other Python threads may
+    go on stepping states meanwhile; their lifts wait for native ones through vex_lift_lock.
+
+    :param plugins: The unicorn plugins of the states to run.
+    :param threads: How many native threads to run them on, one per CPU if 0.
+    :param timeout: Seconds after which runs still going stop at their next block, as if they had run out of steps,
+                    and runs not started yet are left alone. None waits for every run.
+    :param step:    How many steps to run each state for, its plugin's max_steps if None.
+    :return:        A BATCH status for each plugin, in order. Plugins left BATCH_PENDING did not run.
+    """
+    runs = (BATCH_RUN * len(plugins))()
+    for run, plugin in zip(runs, plugins):
+        run.state = plugin._uc_state
+        run.pc, run.step = plugin._prepare_start(step)
+
+    start_time = time.time()
+    finished = _UC_NATIVE.run_batch(runs, len(plugins), threads, 0 if timeout is None else max(int(timeout * 1000), 1))
+    elapsed = time.time() - start_time
+    if finished < 0:
+        raise ValueError("every state in a batch needs an engine of its own")
+
+    for run, plugin in zip(runs, plugins):
+        plugin.errno = run.err
+        plugin.time = elapsed
+    return [ run.status for run in runs ]
+
+
+class AsyncRun(object):
+    """
+    A native run started by Unicorn.start_async, going on in the background.
+    """
+
+    def __init__(self, plugin):
+        self.plugin = plugin
+        self.done = False
+        self._start_time = time.time()
+
+    def poll(self):
+        """
+        :return:    Whether the run is over.
+        """
+        return self.wait(0)
+
+    def wait(self, timeout=None):
+        """
+        Wait for the run to end. Once it has, the plugin's errno and time are set as start() sets them, and finish() can
+        be called.
+
+        :param timeout: Seconds to wait at most, forever if None.
+        :return:        Whether the run is over.
+        """
+        if self.done:
+            return True
+        err = ctypes.c_int()
+        if not _UC_NATIVE.wait(self.plugin._uc_state, -1 if timeout is None else int(timeout * 1000), ctypes.byref(err)):
+            return False
+        self.done = True
+        self.plugin.errno = err.value
+        self.plugin.time = time.time() - self._start_time
+        return True
+
+    def stop(self):
+        """
+        Ask the run to stop at its next block, as if it had run out of steps. It may take a moment; wait for it.
+        """
+        if not self.done:
+            _UC_NATIVE.cancel(self.plugin._uc_state)
+
 
 class Unicorn(SimStatePlugin):
     '''
@@ -309,6 +764,8 @@ class Unicorn(SimStatePlugin):
         self.max_steps = max_steps
 
         self.steps = 0
+        self.stats = None # the native engine's counters for the last run, see get_stats
+        self.smc_count = 0 # guest writes in the last run that invalidated lifted blocks
         self._mapped = 0
         self._uncache_regions = []
         self.gdt = None
@@ -319,6 +776,8 @@ class Unicorn(SimStatePlugin):
 
         # native state in libsimunicorn
         self._uc_state = None
+        # the ctypes view of coverage_map that the native state counts into, kept until the state is deallocated
+        self._coverage_view = None
         self.stop_reason = None
 
         # this is the counter for the unicorn count
@@ -352,6 +811,29 @@ class Unicorn(SimStatePlugin):
         # the address to use for concrete transmits
         self.transmit_addr = None
 
+        # a page cache snapshot (see save_page_cache) to map into the engine up front
+        self.page_cache_snapshot = None
+
+        # how block addresses and stack pointers are recorded when tracked. TRACE_RING keeps the last trace_ring_size
+        # of them, TRACE_COMPRESSED keeps all of them in a fraction of the memory. with TRACE_RING, a run longer than
+        # the ring leaves only its last blocks in history.recent_bbl_addrs, while history.recent_block_count still
+        # counts all of its steps
+        self.trace_mode = TRACE.TRACE_FULL
+        self.trace_ring_size = 0
+
+        # a writable buffer (a bytearray, or an mmap of shared memory) that native runs count afl-style edge coverage
+        # into. its size should be a power of two. it is never cleared here, and is shared by copies of this plugin
+        self.coverage_map = None
+
+        # where to write a snapshot of the next native run to, for native/replay. see dump_snapshot. a list holding
+        # the path, shared with copies, that the first of them to run empties
+        self.run_snapshot = None
+
+        # run on an engine of this plugin's own instead of the one its thread shares, so that run_batch can run it next
+        # to other states. each copy that runs makes a new engine, which destroy() lets go of
+        self.own_engine = False
+        self._own_uc = None
+
         self.time = None
 
     @SimStatePlugin.memo
@@ -379,6 +861,12 @@ class Unicorn(SimStatePlugin):
         u.countdown_symbolic_memory = self.countdown_symbolic_memory
         u.countdown_stop_point = self.countdown_stop_point
         u.transmit_addr = self.transmit_addr
+        u.page_cache_snapshot = self.page_cache_snapshot
+        u.trace_mode = self.trace_mode
+        u.trace_ring_size = self.trace_ring_size
+        u.coverage_map = self.coverage_map
+        u.run_snapshot = self.run_snapshot
+        u.own_engine = self.own_engine
         u._uncache_regions = list(self._uncache_regions)
         u.gdt = self.gdt
         return u
@@ -455,6 +943,9 @@ class Unicorn(SimStatePlugin):
         del d['_uc_state']
         del d['cache_key']
         del d['_unicount']
+        d['coverage_map'] = None
+        d['_coverage_view'] = None
+        d['_own_uc'] = None
         return d
 
     def __setstate__(self, s):
@@ -475,6 +966,11 @@ class Unicorn(SimStatePlugin):
 
     @property
     def uc(self):
+        if self.own_engine:
+            if self._own_uc is None:
+                self._own_uc = Uniwrapper(self.state.arch, self.cache_key)
+            return self._own_uc
+
         new_id = next(_unicounter)
 
         if (
@@ -519,13 +1015,42 @@ class Unicorn(SimStatePlugin):
             raise SimUnicornUnsupport("unsupported architecture %r" % self.state.arch)
 
     def set_stops(self, stop_points):
-        _UC_NATIVE.set_stops(self._uc_state,
+        # the native stop points outlive the native state, so only send what changed since the last run on this engine
+        stop_points = set(stop_points)
+        previous = self.uc.stop_points
+        if previous is None or len(previous ^ stop_points) > len(stop_points):
+            self._send_stops(_UC_NATIVE.set_stops, stop_points)
+        else:
+            added = stop_points - previous
+            removed = previous - stop_points
+            if added:
+                self._send_stops(_UC_NATIVE.add_stops, added)
+            if removed:
+                self._send_stops(_UC_NATIVE.remove_stops, removed)
+        self.uc.stop_points = stop_points
+
+    def _send_stops(self, function, stop_points):
+        function(self._uc_state,
             ctypes.c_uint64(len(stop_points)),
             (ctypes.c_uint64 * len(stop_points))(*map(ctypes.c_uint64, stop_points))
         )
 
+    def _read_trace(self, stack, count):
+        """
+        Copy the first count block addresses (or stack pointers, if stack) of the last run out of the native state.
+        """
+        if self.trace_mode == TRACE.TRACE_FULL:
+            entries = _UC_NATIVE.stack_pointers(self._uc_state) if stack else _UC_NATIVE.bbl_addrs(self._uc_state)
+            return entries[:count]
+        # the other modes keep no flat array to slice, so decode straight into ours
+        entries = (ctypes.c_uint64 * count)()
+        count = _UC_NATIVE.trace_decode(self._uc_state, stack, entries, count)
+        return entries[:count]
+
     def set_tracking(self, track_bbls, track_stack):
         _UC_NATIVE.set_tracking(self._uc_state, track_bbls, track_stack)
+        if self.trace_mode != TRACE.TRACE_FULL:
+            _UC_NATIVE.set_trace_mode(self._uc_state, self.trace_mode, self.trace_ring_size)
 
     def hook(self):
         #l.debug('adding native hooks')
@@ -879,6 +1404,30 @@ class Unicorn(SimStatePlugin):
         self._uncache_regions = [] # this is no longer needed, everything has been uncached
         _UC_NATIVE.clear_page_cache()
 
+    def save_page_cache(self, path):
+        """
+        Save the pages the native engine has cached for this state's cache_key to a snapshot file. Setting
+        `page_cache_snapshot` to the same path on a state in a later process maps those pages into unicorn
+        directly, instead of faulting each of them in through Python.
+
+        :param path:    Path of the snapshot file, replaced if it exists.
+        :return:        True if the snapshot was written.
+        :rtype:         bool
+        """
+        return _UC_NATIVE.save_page_cache(self.cache_key, path.encode())
+
+    def dump_snapshot(self, path):
+        """
+        Record the next native run of this state to a snapshot file: its registers, memory and taint, page cache, stop
+        points, symbolic registers and entry point. `native/replay` runs it again from the file without Python, to
+        profile the native emulation on its own. Memory that Python maps during the run is in the snapshot from the
+        start, so the replay never leaves native code. Copies of the state made before the run, as stepping makes,
+        share the request, and only the first of them to run records it.
+
+        :param path:    Path of the snapshot file, replaced once the run is over.
+        """
+        self.run_snapshot = [ path ]
+
     @property
     def _is_mips32(self):
         """
@@ -907,6 +1456,12 @@ class Unicorn(SimStatePlugin):
         # tricky: using unicorn handle from unicorn.Uc object
         self._uc_state = _UC_NATIVE.alloc(self.uc._uch, self.cache_key)
 
+        # the thread-local engine keeps cached pages mapped between runs, so a snapshot only needs loading once
+        if self.page_cache_snapshot is not None and self.page_cache_snapshot not in self.uc.loaded_snapshots:
+            if not _UC_NATIVE.load_page_cache(self._uc_state, self.page_cache_snapshot.encode()):
+                l.warning("Failed to load page cache snapshot %s", self.page_cache_snapshot)
+            self.uc.loaded_snapshots.add(self.page_cache_snapshot)
+
         # set (cgc, for now) transmit syscall handler
         if UNICORN_HANDLE_TRANSMIT_SYSCALL in self.state.options and self.state.has_plugin('cgc'):
             if self.transmit_addr is None:
@@ -914,11 +1469,64 @@ class Unicorn(SimStatePlugin):
                 self.transmit_addr = 0
             _UC_NATIVE.set_transmit_sysno(self._uc_state, 2, self.transmit_addr)
 
+        if self.coverage_map is not None:
+            self._coverage_view = (ctypes.c_uint8 * len(self.coverage_map)).from_buffer(self.coverage_map)
+            _UC_NATIVE.set_coverage_map(self._uc_state, ctypes.addressof(self._coverage_view), len(self.coverage_map))
+
         # activate gdt page, which was written/mapped during set_regs
         if self.gdt is not None:
             _UC_NATIVE.activate(self._uc_state, self.gdt.addr, self.gdt.limit, None)
 
+    def setup_from(self, parent):
+        """
+        Set up like setup(), but by forking the native state of parent instead of building one from the state. That is
+        only right if this plugin's state is a copy of parent's that has not changed since parent was set up or last
+        finished running, and it saves going through memory page by page. This plugin must use own_engine, and still
+        needs set_stops(), set_tracking() and hook() before it runs.
+
+        :param parent:  The unicorn plugin to fork. It must be set up and not running.
+        """
+        if not self.own_engine:
+            raise SimUnicornError("setup_from needs own_engine")
+        self._setup_unicorn()
+        self._uc_state = _UC_NATIVE.fork(parent._uc_state, self.uc._uch)
+        if not self._uc_state:
+            raise SimUnicornError("could not fork the native state")
+        self.uc.loaded_snapshots = set(parent.uc.loaded_snapshots)
+        # and counts coverage into the parent's map
+        self._coverage_view = parent._coverage_view
+        # the fork took over the stop points too
+        if parent.uc.stop_points is not None:
+            self.uc.stop_points = set(parent.uc.stop_points)
+
     def start(self, step=None):
+        addr, step = self._prepare_start(step)
+        self.time = time.time()
+        self.errno = _UC_NATIVE.start(self._uc_state, addr, step)
+        self.time = time.time() - self.time
+
+    def start_async(self, step=None):
+        """
+        Like start(), but run the emulation on a native thread and return right away, so that this thread can get on
+        with something else meanwhile, such as stepping the next state. Hooks into Python still run, on the native
+        thread. The state must use own_engine, or setting up the next state would reset the engine under the run.
+
+        :param step:    How many steps to run for, max_steps if None.
+        :return:        An AsyncRun to wait for before calling finish().
+        :rtype:         AsyncRun
+        """
+        if not self.own_engine:
+            raise SimUnicornError("start_async needs own_engine")
+        addr, step = self._prepare_start(step)
+        run = AsyncRun(self)
+        if not _UC_NATIVE.start_async(self._uc_state, addr, step):
+            raise SimUnicornError("the last native run of this state is still going")
+        return run
+
+    def _prepare_start(self, step=None):
+        """
+        Get the native state ready to run, and return the address and the number of steps to run it with.
+        """
         self.jumpkind = 'Ijk_Boring'
         self.countdown_nonunicorn_blocks = self.cooldown_nonunicorn_blocks
 
@@ -969,10 +1577,14 @@ class Unicorn(SimStatePlugin):
                 _UC_NATIVE.symbolic_register_data(self._uc_state, 0, None)
 
         addr = self.state.solver.eval(self.state.ip)
-        l.info('started emulation at %#x (%d steps)', addr, self.max_steps if step is None else step)
-        self.time = time.time()
-        self.errno = _UC_NATIVE.start(self._uc_state, addr, self.max_steps if step is None else step)
-        self.time = time.time() - self.time
+        step = self.max_steps if step is None else step
+        l.info('started emulation at %#x (%d steps)', addr, step)
+        if self.run_snapshot:
+            path = self.run_snapshot.pop()
+            if not _UC_NATIVE.record_run(self._uc_state, path.encode()):
+                l.warning("Failed to record the run to %s", path)
+        self.run_snapshot = None
+        return addr, step
 
     def finish(self):
         # do the superficial synchronization
@@ -1001,22 +1613,21 @@ class Unicorn(SimStatePlugin):
         # should this be in destroy?
         _UC_NATIVE.disable_symbolic_reg_tracking(self._uc_state)
 
-        # syncronize memory contents - head is a linked list of memory updates
-        head = _UC_NATIVE.sync(self._uc_state)
-        p_update = head
-        while bool(p_update):
-            update = p_update.contents
+        # syncronize memory contents - one native buffer holds every changed range along with its bytes
+        size = ctypes.c_uint64()
+        buf = _UC_NATIVE.sync_export(self._uc_state, ctypes.byref(size))
+        header = SYNC_HEADER.from_address(buf)
+        updates = (SYNC_RANGE * header.count).from_address(buf + ctypes.sizeof(SYNC_HEADER))
+        contents = memoryview((ctypes.c_ubyte * size.value).from_address(buf)).cast('B')
+        for update in updates:
             address, length = update.address, update.length
             if self.gdt is not None and self.gdt.addr <= address < self.gdt.addr + self.gdt.limit:
                 l.warning("Emulation touched fake GDT at %#x, discarding changes" % self.gdt.addr)
             else:
-                s = bytes(self.uc.mem_read(address, int(length)))
+                s = contents[update.offset:update.offset + length].tobytes()
                 l.debug('...changed memory: [%#x, %#x] = %s', address, address + length, binascii.hexlify(s))
                 self.state.memory.store(address, s)
-
-            p_update = update.next
-
-        _UC_NATIVE.destroy(head)    # free the linked list
+        contents.release()
 
         # adjust the countdowns
         #if self.steps >= 128:
@@ -1052,6 +1663,12 @@ class Unicorn(SimStatePlugin):
         else:
             self.countdown_nonunicorn_blocks = self.cooldown_nonunicorn_blocks
 
+        stats = STATS()
+        _UC_NATIVE.get_stats(self._uc_state, ctypes.byref(stats))
+        self.stats = stats.as_dict()
+        _add_stats(self.stats)
+        l.debug("Native counters: %s", self.stats)
+
         if not is_testing and self.time != 0 and self.steps / self.time < 10: # TODO: make this tunable
             l.info(
                 "Unicorn stepped %d block%s in %fsec (%f blocks/sec), enabling cooldown",
@@ -1071,18 +1688,20 @@ class Unicorn(SimStatePlugin):
             )
 
         # get the address list out of the state
+        # a ring only holds the most recent entries
         if options.UNICORN_TRACK_BBL_ADDRS in self.state.options:
-            bbl_addrs = _UC_NATIVE.bbl_addrs(self._uc_state)
-            #bbl_addr_count = _UC_NATIVE.bbl_addr_count(self._uc_state)
-            # why is bbl_addr_count unused?
-            if self.steps:
-                self.state.history.recent_bbl_addrs = bbl_addrs[:self.steps]
+            bbl_addr_count = min(self.steps, _UC_NATIVE.bbl_addr_count(self._uc_state))
+            if bbl_addr_count:
+                self.state.history.recent_bbl_addrs = self._read_trace(False, bbl_addr_count)
         # get the stack pointers
         if options.UNICORN_TRACK_STACK_POINTERS in self.state.options:
-            stack_pointers = _UC_NATIVE.stack_pointers(self._uc_state)
-            self.state.scratch.stack_pointer_list = stack_pointers[:self.steps]
+            stack_pointer_count = min(self.steps, _UC_NATIVE.stack_pointer_count(self._uc_state))
+            self.state.scratch.stack_pointer_list = self._read_trace(True, stack_pointer_count) if stack_pointer_count else []
         # syscall counts
         self.state.history.recent_syscall_count = _UC_NATIVE.syscall_count(self._uc_state)
+        self.smc_count = _UC_NATIVE.smc_count(self._uc_state)
+        if self.smc_count:
+            l.debug("%d writes to cached code pages invalidated lifted blocks", self.smc_count)
         # executed page set
         self.state.scratch.executed_pages_set = set()
         while True:
@@ -1099,6 +1718,7 @@ class Unicorn(SimStatePlugin):
         #l.debug('deallocting native state %#x', self._uc_state)
         _UC_NATIVE.dealloc(self._uc_state)
         self._uc_state = None
+        self._coverage_view = None
 
         # there's something we're not properly resetting for syscalls, so
         # we'll clear the state when they happen
@@ -1107,6 +1727,10 @@ class Unicorn(SimStatePlugin):
 
         #l.debug("Resetting the unicorn state.")
         self.uc.reset()
+        if self._own_uc is not None:
+            # hooks keep the engine alive until the garbage collector gets to it, so release its native side now
+            _UC_NATIVE.engine_closed(self._own_uc._uch)
+            self._own_uc = None
 
     def set_regs(self):
         ''' setting unicorn registers '''
@@ -0,0 +1,699 @@
+/*
+ * Microbenchmarks for the hot paths of sim_unicorn, driven through the same C
+ * interface angr uses. Every benchmark runs a small synthetic guest program on
+ * x86, amd64, arm and mips, and prints one JSON object per line:
+ *
+ *   {"arch": "amd64", "benchmark": "store_loop", "operations": 65536,
+ *    "repetitions": 20, "min_ns": ..., "median_ns": ..., "mean_ns": ...,
+ *    "ns_per_operation": ...}
+ *
+ * ns_per_operation is the median divided by operations. Only the call being
+ * measured is timed; setting up States and memory is not.
+ *
+ * usage: bench [-r repetitions] [filter ...]
+ * a filter selects the benchmarks whose "arch/benchmark" name contains it.
+ * built by `make tools`, not by the default target.
+ */
+#define __STDC_FORMAT_MACROS 1
+#include <unicorn/unicorn.h>
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libvex.h>
+#include <libvex_guest_x86.h>
+#include <libvex_guest_amd64.h>
+#include <libvex_guest_arm.h>
+#include <libvex_guest_mips32.h>
+#include <pyvex.h>
+}
+
+#include "sim_unicorn.h"
+
+#define PAGE_SIZE 0x1000
+
+// guest memory layout, the same on every architecture
+#define CODE_ADDRESS 0x100000ULL // one page of code per kernel
+#define CODE_SIZE 0x10000ULL
+#define DATA_ADDRESS 0x1000000ULL // writable, activated
+#define DATA_SIZE 0x400000ULL
+#define FAULT_ADDRESS 0x8000000ULL // read-only, in the page cache
+
+#define LOOP_ITERATIONS (1 << 16)
+#define ROLLBACK_STORES 64
+#define ROLLBACK_RUNS 100
+#define FAULT_PAGES 1024
+#define DEFAULT_REPETITIONS 20
+
+#define TAINT_SYMBOLIC 2
+
+/*
+ * An assembler for the handful of operations the kernels are made of, on three
+ * registers: base (an address), count and a scratch register that loads go to.
+ */
+class Assembler {
+	uint64_t address;
+
+protected:
+	std::vector<uint8_t> code;
+
+	void emit8(uint8_t byte) {
+		code.push_back(byte);
+	}
+
+	void emit32le(uint32_t word) {
+		for (int i = 0; i < 32; i += 8) {
+			emit8(word >> i);
+		}
+	}
+
+	void emit32be(uint32_t word) {
+		for (int i = 24; i >= 0; i -= 8) {
+			emit8(word >> i);
+		}
+	}
+
+public:
+	Assembler(uint64_t address) : address(address) {}
+	virtual ~Assembler() {}
+
+	uint64_t start() const {
+		return address;
+	}
+
+	uint64_t here() const {
+		return address + code.size();
+	}
+
+	const std::vector<uint8_t> &bytes() const {
+		return code;
+	}
+
+	virtual void set_base(uint32_t value) = 0;
+	virtual void set_count(uint32_t value) = 0;
+	virtual void store(uint8_t offset) = 0; // [base + offset] = count
+	virtual void load(uint8_t offset) = 0; // scratch = [base + offset]
+	virtual void advance(uint32_t stride) = 0; // base += stride
+	virtual void loop(uint64_t target) = 0; // if (--count != 0) goto target
+	virtual void nop() = 0;
+};
+
+class X86Assembler : public Assembler {
+	bool amd64;
+
+	void rex_w() {
+		if (amd64) {
+			emit8(0x48);
+		}
+	}
+
+public:
+	X86Assembler(uint64_t address, bool amd64) : Assembler(address), amd64(amd64) {}
+
+	// base is edi/rdi, count is ecx/rcx, scratch is eax/rax
+	void set_base(uint32_t value) {
+		emit8(0xbf); // mov edi, imm32 (zero-extended on amd64)
+		emit32le(value);
+	}
+
+	void set_count(uint32_t value) {
+		emit8(0xb9); // mov ecx, imm32
+		emit32le(value);
+	}
+
+	void store(uint8_t offset) {
+		rex_w();
+		emit8(0x89); // mov [rdi + disp8], rcx
+		emit8(0x4f);
+		emit8(offset);
+	}
+
+	void load(uint8_t offset) {
+		rex_w();
+		emit8(0x8b); // mov rax, [rdi + disp8]
+		emit8(0x47);
+		emit8(offset);
+	}
+
+	void advance(uint32_t stride) {
+		rex_w();
+		emit8(0x81); // add rdi, imm32
+		emit8(0xc7);
+		emit32le(stride);
+	}
+
+	void loop(uint64_t target) {
+		emit8(0xff); // dec ecx
+		emit8(0xc9);
+		emit8(0x0f); // jnz rel32
+		emit8(0x85);
+		emit32le(target - (here() + 4));
+	}
+
+	void nop() {
+		emit8(0x90);
+	}
+};
+
+class ArmAssembler : public Assembler {
+	// movw/movt rd, value
+	void set(int rd, uint32_t value) {
+		emit32le(0xe3000000 | ((value & 0xf000) << 4) | (rd << 12) | (value & 0xfff));
+		value >>= 16;
+		emit32le(0xe3400000 | ((value & 0xf000) << 4) | (rd << 12) | (value & 0xfff));
+	}
+
+public:
+	ArmAssembler(uint64_t address) : Assembler(address) {}
+
+	// base is r0, count is r1, scratch is r2
+	void set_base(uint32_t value) {
+		set(0, value);
+	}
+
+	void set_count(uint32_t value) {
+		set(1, value);
+	}
+
+	void store(uint8_t offset) {
+		emit32le(0xe5801000 | offset); // str r1, [r0, #offset]
+	}
+
+	void load(uint8_t offset) {
+		emit32le(0xe5902000 | offset); // ldr r2, [r0, #offset]
+	}
+
+	void advance(uint32_t stride) {
+		set(3, stride);
+		emit32le(0xe0800003); // add r0, r0, r3
+	}
+
+	void loop(uint64_t target) {
+		emit32le(0xe2511001); // subs r1, r1, #1
+		emit32le(0x1a000000 | (((target - (here() + 8)) >> 2) & 0xffffff)); // bne target
+	}
+
+	void nop() {
+		emit32le(0xe1a00000); // mov r0, r0
+	}
+};
+
+class MipsAssembler : public Assembler {
+	// lui/ori rt, value
+	void set(int rt, uint32_t value) {
+		emit32be(0x3c000000 | (rt << 16) | (value >> 16));
+		emit32be(0x34000000 | (rt << 21) | (rt << 16) | (value & 0xffff));
+	}
+
+public:
+	MipsAssembler(uint64_t address) : Assembler(address) {}
+
+	// base is $t0, count is $t1, scratch is $t2
+	void set_base(uint32_t value) {
+		set(8, value);
+	}
+
+	void set_count(uint32_t value) {
+		set(9, value);
+	}
+
+	void store(uint8_t offset) {
+		emit32be(0xad090000 | offset); // sw $t1, offset($t0)
+	}
+
+	void load(uint8_t offset) {
+		emit32be(0x8d0a0000 | offset); // lw $t2, offset($t0)
+	}
+
+	void advance(uint32_t stride) {
+		emit32be(0x25080000 | (stride & 0xffff)); // addiu $t0, $t0, stride
+	}
+
+	void loop(uint64_t target) {
+		emit32be(0x2529ffff); // addiu $t1, $t1, -1
+		emit32be(0x15200000 | (((target - (here() + 4)) >> 2) & 0xffff)); // bnez $t1, target
+		nop(); // delay slot
+	}
+
+	void nop() {
+		emit32be(0);
+	}
+};
+
+typedef struct bench_arch {
+	const char *name;
+	uc_arch arch;
+	uc_mode mode;
+	VexArch vex_arch;
+	VexEndness vex_endness;
+	UInt vex_hwcaps;
+	uint64_t spare_register; // VEX offset of a register the kernels never use
+	uint8_t word_size; // of loads and stores
+	Assembler *(*assembler)(uint64_t address);
+} bench_arch_t;
+
+static const bench_arch_t bench_archs[] = {
+	{"x86", UC_ARCH_X86, UC_MODE_32, VexArchX86, VexEndnessLE, 0,
+		offsetof(VexGuestX86State, guest_EBP), 4,
+		[](uint64_t address) -> Assembler * { return new X86Assembler(address, false); }},
+	{"amd64", UC_ARCH_X86, UC_MODE_64, VexArchAMD64, VexEndnessLE, 0,
+		offsetof(VexGuestAMD64State, guest_R15), 8,
+		[](uint64_t address) -> Assembler * { return new X86Assembler(address, true); }},
+	{"arm", UC_ARCH_ARM, UC_MODE_ARM, VexArchARM, VexEndnessLE, 7,
+		offsetof(VexGuestARMState, guest_R8), 4,
+		[](uint64_t address) -> Assembler * { return new ArmAssembler(address); }},
+	{"mips", UC_ARCH_MIPS, (uc_mode)(UC_MODE_MIPS32 | UC_MODE_BIG_ENDIAN), VexArchMIPS32, VexEndnessBE, VEX_PRID_COMP_MIPS,
+		offsetof(VexGuestMIPS32State, guest_r20), 4,
+		[](uint64_t address) -> Assembler * { return new MipsAssembler(address); }},
+};
+
+typedef struct bench_options {
+	int repetitions;
+	std::vector<std::string> filters;
+} bench_options_t;
+
+static uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void fail(const bench_arch_t &arch, const char *benchmark, const char *what) {
+	fprintf(stderr, "%s/%s: %s\n", arch.name, benchmark, what);
+	exit(1);
+}
+
+/*
+ * One architecture's engine, with the code and data regions mapped, and a
+ * cache_key of its own.
+ */
+class Bench {
+	const bench_arch_t &arch;
+	const bench_options_t &options;
+	uc_engine *uc;
+	uint64_t cache_key;
+	uint64_t next_code;
+
+public:
+	Bench(const bench_arch_t &arch, const bench_options_t &options, uint64_t cache_key)
+		: arch(arch), options(options), cache_key(cache_key), next_code(CODE_ADDRESS) {
+		uc_err err = uc_open(arch.arch, arch.mode, &uc);
+		if (err == UC_ERR_OK) {
+			err = uc_mem_map(uc, CODE_ADDRESS, CODE_SIZE, UC_PROT_ALL);
+		}
+		if (err == UC_ERR_OK) {
+			err = uc_mem_map(uc, DATA_ADDRESS, DATA_SIZE, UC_PROT_READ | UC_PROT_WRITE);
+		}
+		if (err != UC_ERR_OK) {
+			fail(arch, "setup", uc_strerror(err));
+		}
+	}
+
+	~Bench() {
+		simunicorn_engine_closed(uc);
+		uc_close(uc);
+	}
+
+	bool selected(const char *benchmark) const {
+		if (options.filters.empty()) {
+			return true;
+		}
+		std::string name = std::string(arch.name) + "/" + benchmark;
+		for (auto &filter : options.filters) {
+			if (name.find(filter) != std::string::npos) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * a fresh assembler for a kernel. every kernel gets its own page, so that
+	 * neither unicorn nor the block cache ever see code change under them.
+	 */
+	Assembler *assembler() {
+		Assembler *as = arch.assembler(next_code);
+		next_code += PAGE_SIZE;
+		if (next_code > CODE_ADDRESS + CODE_SIZE) {
+			fail(arch, "setup", "out of code pages");
+		}
+		return as;
+	}
+
+	// write the kernel into guest memory; returns its start address
+	uint64_t install(Assembler *as) {
+		if (as->bytes().size() > PAGE_SIZE) {
+			fail(arch, "setup", "kernel larger than a page");
+		}
+		uc_mem_write(uc, as->start(), as->bytes().data(), as->bytes().size());
+		return as->start();
+	}
+
+	State *new_state(uint64_t stop, uint64_t key) {
+		State *state = simunicorn_alloc(uc, key);
+		simunicorn_hook(state);
+		simunicorn_set_stops(state, 1, &stop);
+		return state;
+	}
+
+	State *new_state(uint64_t stop) {
+		return new_state(stop, cache_key);
+	}
+
+	void free_state(State *state) {
+		simunicorn_unhook(state);
+		simunicorn_dealloc(state);
+	}
+
+	void track_spare_register(State *state) {
+		VexArchInfo archinfo;
+		memset(&archinfo, 0, sizeof(archinfo));
+		archinfo.hwcaps = arch.vex_hwcaps;
+		archinfo.endness = arch.vex_endness;
+		archinfo.hwcache_info.icaches_maintain_coherence = True;
+		archinfo.x86_cr0 = 0xffffffff;
+		simunicorn_enable_symbolic_reg_tracking(state, arch.vex_arch, archinfo);
+
+		std::vector<uint64_t> offsets;
+		for (uint64_t i = 0; i < arch.word_size; i++) {
+			offsets.push_back(arch.spare_register + i);
+		}
+		simunicorn_symbolic_register_data(state, offsets.size(), offsets.data());
+	}
+
+	// run state from pc, checking that it ran at least blocks blocks; returns the time taken
+	uint64_t run(const char *benchmark, State *state, uint64_t pc, uint64_t blocks) {
+		uint64_t start = now_ns();
+		uc_err err = simunicorn_start(state, pc, UINT64_MAX >> 1);
+		uint64_t elapsed = now_ns() - start;
+		if (err != UC_ERR_OK) {
+			fail(arch, benchmark, uc_strerror(err));
+		}
+		if (simunicorn_step(state) < blocks) {
+			fail(arch, benchmark, "stopped early");
+		}
+		return elapsed;
+	}
+
+	void report(const char *benchmark, uint64_t operations, std::vector<uint64_t> &samples) {
+		std::sort(samples.begin(), samples.end());
+		uint64_t total = 0;
+		for (uint64_t sample : samples) {
+			total += sample;
+		}
+		uint64_t median = samples[samples.size() / 2];
+		printf("{\"arch\": \"%s\", \"benchmark\": \"%s\", \"operations\": %" PRIu64 ", "
+				"\"repetitions\": %zu, \"min_ns\": %" PRIu64 ", \"median_ns\": %" PRIu64 ", "
+				"\"mean_ns\": %" PRIu64 ", \"ns_per_operation\": %.3f}\n",
+				arch.name, benchmark, operations, samples.size(), samples.front(), median,
+				total / samples.size(), (double)median / operations);
+		fflush(stdout);
+	}
+
+	/*
+	 * store_loop: two stores per block into activated pages, so every block goes
+	 * through handle_write and commit. sync and sync_export then collect the
+	 * dirty bytes of every page the loop wrote.
+	 */
+	void store_loop() {
+		bool bench_sync = selected("sync"), bench_export = selected("sync_export");
+		if (!selected("store_loop") && !bench_sync && !bench_export) {
+			return;
+		}
+
+		std::unique_ptr<Assembler> as(assembler());
+		uint32_t stride = 2 * arch.word_size;
+		as->set_base(DATA_ADDRESS);
+		as->set_count(LOOP_ITERATIONS);
+		uint64_t top = as->here();
+		as->store(0);
+		as->store(arch.word_size);
+		as->advance(stride);
+		as->loop(top);
+		uint64_t end = as->here();
+		as->nop();
+		uint64_t pc = install(as.get());
+		uint64_t length = (uint64_t)LOOP_ITERATIONS * stride;
+
+		std::vector<uint64_t> run_samples, sync_samples, export_samples;
+		for (int i = 0; i < options.repetitions; i++) {
+			State *state = new_state(end);
+			simunicorn_activate(state, DATA_ADDRESS, length, NULL);
+			run_samples.push_back(run("store_loop", state, pc, LOOP_ITERATIONS));
+
+			uint64_t start = now_ns();
+			simunicorn_destroy(simunicorn_sync(state));
+			sync_samples.push_back(now_ns() - start);
+
+			uint64_t size;
+			start = now_ns();
+			simunicorn_sync_export(state, &size);
+			export_samples.push_back(now_ns() - start);
+			if (size < length) {
+				fail(arch, "sync_export", "missing dirty bytes");
+			}
+			free_state(state);
+		}
+
+		if (selected("store_loop")) {
+			report("store_loop", LOOP_ITERATIONS, run_samples);
+		}
+		// per dirty page
+		if (bench_sync) {
+			report("sync", length / PAGE_SIZE, sync_samples);
+		}
+		if (bench_export) {
+			report("sync_export", length / PAGE_SIZE, export_samples);
+		}
+	}
+
+	/*
+	 * rollback: a single block of stores to different pages, ending in a read of
+	 * symbolic memory, so that the run stops and rolls every store back. the
+	 * loop at the end is never taken; it only ends the block.
+	 */
+	void rollback() {
+		if (!selected("rollback")) {
+			return;
+		}
+
+		std::unique_ptr<Assembler> as(assembler());
+		uint64_t symbolic = DATA_ADDRESS + (ROLLBACK_STORES + 1) * PAGE_SIZE;
+		as->set_base(DATA_ADDRESS);
+		as->set_count(1);
+		uint64_t top = as->here();
+		for (int i = 0; i < ROLLBACK_STORES; i++) {
+			as->store(0);
+			as->advance(PAGE_SIZE);
+		}
+		as->advance(PAGE_SIZE);
+		as->load(0);
+		as->loop(top);
+		uint64_t end = as->here();
+		as->nop();
+		uint64_t pc = install(as.get());
+
+		std::vector<uint8_t> taint(PAGE_SIZE, TAINT_SYMBOLIC);
+		std::vector<uint64_t> samples;
+		for (int i = 0; i < options.repetitions; i++) {
+			uint64_t elapsed = 0;
+			for (int j = 0; j < ROLLBACK_RUNS; j++) {
+				State *state = new_state(end);
+				simunicorn_activate(state, DATA_ADDRESS, ROLLBACK_STORES * PAGE_SIZE, NULL);
+				simunicorn_activate(state, symbolic, PAGE_SIZE, taint.data());
+				elapsed += run("rollback", state, pc, 0);
+				if (simunicorn_stopping_memory(state) != symbolic) {
+					fail(arch, "rollback", "did not stop at the symbolic read");
+				}
+				free_state(state);
+			}
+			samples.push_back(elapsed);
+		}
+		// per store rolled back
+		report("rollback", ROLLBACK_STORES * ROLLBACK_RUNS, samples);
+	}
+
+	/*
+	 * load_loop: two loads per block from activated pages that each hold a
+	 * symbolic byte the loop never reads, so that find_tainted has to look at
+	 * the taint of every load.
+	 */
+	void load_loop() {
+		if (!selected("load_loop")) {
+			return;
+		}
+
+		std::unique_ptr<Assembler> as(assembler());
+		// read the first half of every 4-word chunk, and taint the last byte of each page
+		uint32_t stride = 4 * arch.word_size;
+		as->set_base(DATA_ADDRESS);
+		as->set_count(LOOP_ITERATIONS);
+		uint64_t top = as->here();
+		as->load(0);
+		as->load(arch.word_size);
+		as->advance(stride);
+		as->loop(top);
+		uint64_t end = as->here();
+		as->nop();
+		uint64_t pc = install(as.get());
+
+		uint64_t length = (uint64_t)LOOP_ITERATIONS * stride;
+		std::vector<uint8_t> taint(length, 0);
+		for (uint64_t page = 0; page < length; page += PAGE_SIZE) {
+			taint[page + PAGE_SIZE - 1] = TAINT_SYMBOLIC;
+		}
+
+		std::vector<uint64_t> samples;
+		for (int i = 0; i < options.repetitions; i++) {
+			State *state = new_state(end);
+			simunicorn_activate(state, DATA_ADDRESS, length, taint.data());
+			samples.push_back(run("load_loop", state, pc, LOOP_ITERATIONS));
+			free_state(state);
+		}
+		report("load_loop", LOOP_ITERATIONS, samples);
+	}
+
+	/*
+	 * block_loop and check_block: a loop of one block that touches no memory,
+	 * first as is, then with a symbolic register so that every block is
+	 * checked against the block cache. check_block_cold runs the loop body
+	 * once, with a new cache_key every time, so that its block is lifted anew.
+	 */
+	void block_loop() {
+		bool bench_plain = selected("block_loop"), bench_check = selected("check_block"),
+			bench_cold = selected("check_block_cold");
+		if (!bench_plain && !bench_check && !bench_cold) {
+			return;
+		}
+
+		uint64_t pc[2], end[2];
+		for (int i = 0; i < 2; i++) {
+			std::unique_ptr<Assembler> as(assembler());
+			as->set_base(0);
+			as->set_count(i == 0 ? LOOP_ITERATIONS : 1);
+			uint64_t top = as->here();
+			as->advance(1);
+			as->loop(top);
+			end[i] = as->here();
+			as->nop();
+			pc[i] = install(as.get());
+		}
+
+		if (bench_plain) {
+			std::vector<uint64_t> samples;
+			for (int i = 0; i < options.repetitions; i++) {
+				State *state = new_state(end[0]);
+				samples.push_back(run("block_loop", state, pc[0], LOOP_ITERATIONS));
+				free_state(state);
+			}
+			report("block_loop", LOOP_ITERATIONS, samples);
+		}
+
+		if (bench_check) {
+			std::vector<uint64_t> samples;
+			for (int i = 0; i < options.repetitions; i++) {
+				State *state = new_state(end[0]);
+				track_spare_register(state);
+				samples.push_back(run("check_block", state, pc[0], LOOP_ITERATIONS));
+				free_state(state);
+			}
+			report("check_block", LOOP_ITERATIONS, samples);
+		}
+
+		if (bench_cold) {
+			std::vector<uint64_t> samples;
+			for (int i = 0; i < options.repetitions; i++) {
+				State *state = new_state(end[1], cache_key + 1 + i);
+				track_spare_register(state);
+				samples.push_back(run("check_block_cold", state, pc[1], 1));
+				free_state(state);
+			}
+			report("check_block_cold", 1, samples);
+		}
+	}
+
+	/*
+	 * page_faults: a load from each of many pages that are in the page cache
+	 * but not mapped, so that every load faults into hook_mem_unmapped and
+	 * map_cache. the pages are unmapped again between runs.
+	 */
+	void page_faults() {
+		if (!selected("page_faults")) {
+			return;
+		}
+
+		std::unique_ptr<Assembler> as(assembler());
+		as->set_base(FAULT_ADDRESS);
+		as->set_count(FAULT_PAGES);
+		uint64_t top = as->here();
+		as->load(0);
+		as->advance(PAGE_SIZE);
+		as->loop(top);
+		uint64_t end = as->here();
+		as->nop();
+		uint64_t pc = install(as.get());
+
+		uint64_t length = (uint64_t)FAULT_PAGES * PAGE_SIZE;
+		std::vector<char> bytes(length);
+		for (uint64_t i = 0; i < length; i++) {
+			bytes[i] = (char)i;
+		}
+		State *state = new_state(end);
+		if (!simunicorn_cache_page(state, FAULT_ADDRESS, length, bytes.data(), UC_PROT_READ)) {
+			fail(arch, "page_faults", "could not cache pages");
+		}
+		free_state(state);
+
+		std::vector<uint64_t> samples;
+		for (int i = 0; i < options.repetitions; i++) {
+			uc_mem_unmap(uc, FAULT_ADDRESS, length);
+			state = new_state(end);
+			samples.push_back(run("page_faults", state, pc, FAULT_PAGES));
+			free_state(state);
+		}
+		report("page_faults", FAULT_PAGES, samples);
+	}
+};
+
+int main(int argc, char **argv) {
+	bench_options_t options;
+	options.repetitions = DEFAULT_REPETITIONS;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			options.repetitions = atoi(argv[++i]);
+		} else if (argv[i][0] == '-') {
+			fprintf(stderr, "usage: %s [-r repetitions] [filter ...]\n", argv[0]);
+			return 2;
+		} else {
+			options.filters.push_back(argv[i]);
+		}
+	}
+	if (options.repetitions < 1) {
+		options.repetitions = 1;
+	}
+
+	vex_init();
+
+	// keep every architecture's caches apart, and out of the way of check_block_cold
+	uint64_t cache_key = 0xbe5c000000000000ULL;
+	for (const bench_arch_t &arch : bench_archs) {
+		Bench bench(arch, options, cache_key);
+		bench.store_loop();
+		bench.rollback();
+		bench.load_loop();
+		bench.block_loop();
+		bench.page_faults();
+		cache_key += 0x100000000ULL;
+	}
+	return 0;
+}
@@ -25,6 +25,8 @@
 #include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,16 +39,32 @@
 
 static int log_fd = STDERR_FILENO;
 static bool log_fd_isatty = true;
-enum llevel_t log_level = DEBUG;
+// not DEBUG, as nsjail has it: the emulator logs at DEBUG for every block and memory access
+int log_level = WARNING;
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+struct ll_t {
+    char *descr;
+    char *prefix;
+    bool print_funcline;
+};
+static const struct ll_t logLevels[] = {
+    {"F", "\033[7;35m", true},
+    {"E", "\033[1;31m", true},
+    {"W", "\033[0;33m", true},
+    {"I", "\033[1m", true},
+    {"D", "\033[0;4m", true},
+    {"HR", "\033[0m", false},
+    {"HB", "\033[1m", false},
+};
+
 void logSetLogLevel(enum llevel_t level) {
-	log_level = level;
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
 }
 
 enum llevel_t logGetLogLevel(void)
 {
-    return log_level;
+    return (enum llevel_t)LOG_CURRENT_LEVEL();
 }
 
 /*
@@ -56,7 +74,7 @@ enum llevel_t logGetLogLevel(void)
 bool logInitLogFile(const char *logfile, enum llevel_t ll)
 {
     log_fd_isatty = (isatty(log_fd) == 1 ? true : false);
-    log_level = ll;
+    logSetLogLevel(ll);
 
     if (logfile == NULL) {
         return true;
@@ -78,20 +96,10 @@ void logLog(enum llevel_t ll, const char *fn, int ln, bool perr, const char *fmt
     if (perr == true) {
         snprintf(strerr, sizeof(strerr), "%s", strerror(errno));
     }
-    struct ll_t {
-        char *descr;
-        char *prefix;
-        bool print_funcline;
-    };
-    struct ll_t logLevels[] = {
-        {"F", "\033[7;35m", true},
-        {"E", "\033[1;31m", true},
-        {"W", "\033[0;33m", true},
-        {"I", "\033[1m", true},
-        {"D", "\033[0;4m", true},
-        {"HR", "\033[0m", false},
-        {"HB", "\033[1m", false},
-    };
+    if (ll == FATAL) {
+        // whatever was logged asynchronously happened before
+        logFlush();
+    }
 
     time_t ltstamp = time(NULL);
     struct tm utctime;
@@ -148,3 +156,336 @@ void logDirectlyToFD(const char *msg)
 {
     dprintf(log_fd, "%s", msg);
 }
+
+/*
+ * Asynchronous logging
+ *
+ * every thread that logs gets a ring of binary records. the thread only copies
+ * the format string pointer and the raw arguments in, without locks or
+ * syscalls, and a background thread formats and writes them. rings of threads
+ * that exited are handed to new threads once drained.
+ */
+
+#define LOG_RING_SIZE 4096 // records per thread, about 400KiB
+
+struct log_record {
+    struct timespec time;
+    const char *fn;
+    const char *fmt;
+    int line;
+    pid_t tid;
+    uint8_t level;
+    uint8_t nargs;
+    uint64_t args[LOG_MAX_ARGS];
+};
+
+struct log_ring {
+    struct log_record records[LOG_RING_SIZE];
+    _Atomic uint64_t head; // next record to write, advanced by the owner
+    _Atomic uint64_t tail; // next record to format, advanced by the drain
+    _Atomic uint64_t dropped; // records lost to a full ring
+    atomic_bool owned;
+    atomic_int tid; // of the owner
+    struct log_ring *next;
+};
+
+static _Atomic(struct log_ring *) log_rings;
+static __thread struct log_ring *log_thread_ring;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_async_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the drain thread sleeps on log_wake while every ring is empty. it sets
+ * log_drain_sleeping and then looks at the rings once more, and a thread that
+ * logs publishes its record and then looks at log_drain_sleeping, with a full
+ * fence in between on both sides, so at least one of them sees the other.
+ */
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static atomic_bool log_drain_sleeping;
+
+// format one conversion of fmt, which is spec_length bytes long, with the argument it takes from args
+static int logFormatOne(char *out, size_t size, const char *spec, size_t spec_length, const uint64_t *args, int nargs, int *arg)
+{
+    char conversion[32];
+    if (spec_length >= sizeof(conversion)) {
+        return snprintf(out, size, "%.*s", (int)spec_length, spec);
+    }
+    memcpy(conversion, spec, spec_length);
+    conversion[spec_length] = '\0';
+
+    char type = spec[spec_length - 1];
+    if (type == '%') {
+        return snprintf(out, size, "%%");
+    }
+    if (strchr(conversion, '*') != NULL || *arg >= nargs) {
+        // no way to tell how many arguments a * takes, or too few of them
+        return snprintf(out, size, "%s", conversion);
+    }
+    uint64_t value = args[(*arg)++];
+
+    const char *length = conversion + strcspn(conversion, "hljztL");
+    switch (type) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            if (length[0] == 'l' && length[1] == 'l') {
+                return snprintf(out, size, conversion, (long long)value);
+            } else if (length[0] == 'l') {
+                return snprintf(out, size, conversion, (long)value);
+            } else if (length[0] == 'j') {
+                return snprintf(out, size, conversion, (intmax_t)value);
+            } else if (length[0] == 'z') {
+                return snprintf(out, size, conversion, (size_t)value);
+            } else if (length[0] == 't') {
+                return snprintf(out, size, conversion, (ptrdiff_t)value);
+            }
+            return snprintf(out, size, conversion, (int)value);
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            if (length[0] == 'L') {
+                return snprintf(out, size, conversion, (long double)d);
+            }
+            return snprintf(out, size, conversion, d);
+        }
+        case 's':
+            return snprintf(out, size, conversion, value ? (const char *)(uintptr_t)value : "(null)");
+        case 'p':
+            return snprintf(out, size, conversion, (void *)(uintptr_t)value);
+        default:
+            return snprintf(out, size, "%s", conversion);
+    }
+}
+
+// printf, with the arguments of an asynchronous record
+static size_t logFormat(char *out, size_t size, const char *fmt, const uint64_t *args, int nargs)
+{
+    size_t used = 0;
+    int arg = 0;
+    while (*fmt != '\0' && used + 1 < size) {
+        if (*fmt != '%') {
+            out[used++] = *fmt++;
+            continue;
+        }
+        size_t spec_length = 1 + strspn(fmt + 1, "-+ #0123456789.*hljztL");
+        if (fmt[spec_length] == '\0') {
+            break;
+        }
+        spec_length++;
+        int written = logFormatOne(out + used, size - used, fmt, spec_length, args, nargs, &arg);
+        if (written > 0) {
+            used += (size_t)written < size - used ? (size_t)written : size - used - 1;
+        }
+        fmt += spec_length;
+    }
+    out[used] = '\0';
+    return used;
+}
+
+static size_t logFormatRecord(char *out, size_t size, const struct log_record *record)
+{
+    struct tm utctime;
+    localtime_r(&record->time.tv_sec, &utctime);
+    char timestr[32];
+    if (strftime(timestr, sizeof(timestr) - 1, "%FT%T%z", &utctime) == 0) {
+        timestr[0] = '\0';
+    }
+
+    // leave room for the color reset and the newline, however long the message
+    size_t body = size - 8;
+    size_t used = 0;
+    int written;
+    if (log_fd_isatty) {
+        written = snprintf(out, body, "%s", logLevels[record->level].prefix);
+        used += written > 0 ? written : 0;
+    }
+    if (logLevels[record->level].print_funcline && used < body) {
+        written = snprintf(out + used, body - used, "[%s][%s][%d] %s():%d ",
+                timestr, logLevels[record->level].descr, record->tid, record->fn, record->line);
+        used += written > 0 ? written : 0;
+    }
+    if (used < body) {
+        used += logFormat(out + used, body - used, record->fmt, record->args, record->nargs);
+    } else {
+        used = body - 1;
+    }
+    written = snprintf(out + used, size - used, "%s\n", log_fd_isatty ? "\033[0m" : "");
+    return used + (written > 0 ? written : 0);
+}
+
+// write out all of buffer, through short and interrupted writes. other errors drop the rest, there being nowhere to report them
+static void logWrite(const char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(log_fd, buffer, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buffer += written;
+        size -= written;
+    }
+}
+
+// format and write out everything logged so far. returns the number of records written
+static uint64_t logDrain(void)
+{
+    char buffer[16384];
+    size_t used = 0;
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&log_drain_mutex);
+    for (struct log_ring *ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped != 0) {
+            if (used + 128 > sizeof(buffer)) {
+                logWrite(buffer, used);
+                used = 0;
+            }
+            used += snprintf(buffer + used, sizeof(buffer) - used,
+                    "[%d] %llu log messages dropped, the ring was full\n", atomic_load(&ring->tid), (unsigned long long)dropped);
+        }
+
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (used + 1024 > sizeof(buffer)) {
+                logWrite(buffer, used);
+                used = 0;
+            }
+            used += logFormatRecord(buffer + used, 1024, &ring->records[tail % LOG_RING_SIZE]);
+            count++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    if (used > 0) {
+        logWrite(buffer, used);
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+    return count;
+}
+
+// is there anything to drain?
+static bool logPending(void)
+{
+    for (struct log_ring *ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail) || atomic_load(&ring->dropped) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *logDrainThread(void *arg)
+{
+    (void)arg;
+    while (true) {
+        if (logDrain() != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&log_wake_mutex);
+        atomic_store(&log_drain_sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!logPending()) {
+            pthread_cond_wait(&log_wake, &log_wake_mutex);
+        }
+        atomic_store(&log_drain_sleeping, false);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+    return NULL;
+}
+
+static void logWakeDrain(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log_drain_sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+}
+
+// a thread that logged exited; its ring goes to the next thread that needs one
+static void logReleaseRing(void *ring)
+{
+    atomic_store(&((struct log_ring *)ring)->owned, false);
+}
+
+static void logAsyncInit(void)
+{
+    pthread_key_create(&log_ring_key, logReleaseRing);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logDrainThread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    atexit(logFlush);
+}
+
+static struct log_ring *logClaimRing(void)
+{
+    pthread_once(&log_async_once, logAsyncInit);
+
+    struct log_ring *ring;
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &expected, true)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->owned, true);
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+    }
+    atomic_store(&ring->tid, (pid_t)syscall(__NR_gettid));
+    pthread_setspecific(log_ring_key, ring);
+    log_thread_ring = ring;
+    return ring;
+}
+
+void logAsync(enum llevel_t ll, const char *fn, int ln, const char *fmt, int nargs, const uint64_t *args)
+{
+    struct log_ring *ring = log_thread_ring;
+    if (ring == NULL && (ring = logClaimRing()) == NULL) {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        logWakeDrain();
+        return;
+    }
+
+    struct log_record *record = &ring->records[head % LOG_RING_SIZE];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->fn = fn;
+    record->fmt = fmt;
+    record->line = ln;
+    record->tid = atomic_load_explicit(&ring->tid, memory_order_relaxed);
+    record->level = ll;
+    record->nargs = nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS;
+    memcpy(record->args, args, record->nargs * sizeof(uint64_t));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    logWakeDrain();
+}
+
+/*
+ * write out every asynchronous message logged so far
+ */
+void logFlush(void)
+{
+    logDrain();
+}
+
+// never called; lets the compiler check the format of asynchronous messages
+void logCheckFormat(const char *fmt, ...)
+{
+    (void)fmt;
+}
@@ -23,46 +23,149 @@
 #define _LOG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * levels above LOG_COMPILE_LEVEL compile to nothing, arguments included. the
+ * rest are checked against log_level at run time, which is read in place.
+ */
+#define LOG_LEVEL_FATAL 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#ifdef _WIN32
+// log.c is not built there
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL -1
+#define LOG_PRINTF_FORMAT(fmt, args)
+#else
+#define LOG_PRINTF_FORMAT(fmt, args) __attribute__ ((format(printf, fmt, args)))
+#endif
 
 #define LOG_RAW(...) dprintf(logGetFD(), __VA_ARGS__);
 
 #define LOG_HELP(...) logLog(HELP, __FUNCTION__, __LINE__, false, __VA_ARGS__);
 #define LOG_HELP_BOLD(...) logLog(HELP_BOLD, __FUNCTION__, __LINE__, false, __VA_ARGS__);
 
-#define LOG_D(...) if (logGetLogLevel() >= DEBUG) { logLog(DEBUG, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_I(...) if (logGetLogLevel() >= INFO) { logLog(INFO, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_W(...) if (logGetLogLevel() >= WARNING) { logLog(WARNING, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_E(...) if (logGetLogLevel() >= ERROR) { logLog(ERROR, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_F(...) if (logGetLogLevel() >= FATAL) { logLog(FATAL, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
+/*
+ * in C++, LOG_* only copy their arguments into a ring buffer of the calling
+ * thread, and a background thread formats them later. so they take at most
+ * LOG_MAX_ARGS integers, pointers or doubles, no * widths, and strings passed
+ * for %s must outlive the call (literals, uc_strerror, ...). should the ring be full, the
+ * message is dropped rather than waited for. FATAL and PLOG_* are written out
+ * right away.
+ */
+#ifdef __cplusplus
+#define LOG_ASYNC(ll, ...) do { if (LOG_CURRENT_LEVEL() >= ll) { if (0) { logCheckFormat(__VA_ARGS__); } logAsyncArgs(ll, __FUNCTION__, __LINE__, __VA_ARGS__); } } while (0)
+#else
+#define LOG_ASYNC(ll, ...) do { if (LOG_CURRENT_LEVEL() >= ll) { logLog(ll, __FUNCTION__, __LINE__, false, __VA_ARGS__); } } while (0)
+#endif
+#define LOG_SYNC(ll, perr, ...) do { if (LOG_CURRENT_LEVEL() >= ll) { logLog(ll, __FUNCTION__, __LINE__, perr, __VA_ARGS__); } } while (0)
+// a relaxed load, without a call, so that a disabled message costs a compare
+#define LOG_CURRENT_LEVEL() __atomic_load_n(&log_level, __ATOMIC_RELAXED)
+#define LOG_NOTHING(...) do { } while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) LOG_ASYNC(DEBUG, __VA_ARGS__)
+#define PLOG_D(...) LOG_SYNC(DEBUG, true, __VA_ARGS__)
+#else
+#define LOG_D(...) LOG_NOTHING()
+#define PLOG_D(...) LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) LOG_ASYNC(INFO, __VA_ARGS__)
+#define PLOG_I(...) LOG_SYNC(INFO, true, __VA_ARGS__)
+#else
+#define LOG_I(...) LOG_NOTHING()
+#define PLOG_I(...) LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_W(...) LOG_ASYNC(WARNING, __VA_ARGS__)
+#define PLOG_W(...) LOG_SYNC(WARNING, true, __VA_ARGS__)
+#else
+#define LOG_W(...) LOG_NOTHING()
+#define PLOG_W(...) LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) LOG_ASYNC(ERROR, __VA_ARGS__)
+#define PLOG_E(...) LOG_SYNC(ERROR, true, __VA_ARGS__)
+#else
+#define LOG_E(...) LOG_NOTHING()
+#define PLOG_E(...) LOG_NOTHING()
+#endif
 
-#define PLOG_D(...) if (logGetLogLevel() >= DEBUG) { logLog(DEBUG, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_I(...) if (logGetLogLevel() >= INFO) { logLog(INFO, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_W(...) if (logGetLogLevel() >= WARNING) { logLog(WARNING, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_E(...) if (logGetLogLevel() >= ERROR) { logLog(ERROR, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_F(...) if (logGetLogLevel() >= FATAL) { logLog(FATAL, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_FATAL
+#define LOG_F(...) LOG_SYNC(FATAL, false, __VA_ARGS__)
+#define PLOG_F(...) LOG_SYNC(FATAL, true, __VA_ARGS__)
+#else
+#define LOG_F(...) LOG_NOTHING()
+#define PLOG_F(...) LOG_NOTHING()
+#endif
 
 enum llevel_t {
-    FATAL = 0,
-    ERROR,
-    WARNING,
-    INFO,
-    DEBUG,
+    FATAL = LOG_LEVEL_FATAL,
+    ERROR = LOG_LEVEL_ERROR,
+    WARNING = LOG_LEVEL_WARNING,
+    INFO = LOG_LEVEL_INFO,
+    DEBUG = LOG_LEVEL_DEBUG,
     HELP,
     HELP_BOLD
 };
 
+#define LOG_MAX_ARGS 6
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+extern int log_level; // an llevel_t, only accessed with __atomic builtins
 void logSetLogLevel(enum llevel_t);
 enum llevel_t logGetLogLevel(void);
 int logGetFD();
 bool logInitLogFile(const char *logfile, enum llevel_t ll);
 void logLog(enum llevel_t ll, const char *fn, int ln, bool perr, const char *fmt, ...)
-    __attribute__ ((format(printf, 5, 6)));
+    LOG_PRINTF_FORMAT(5, 6);
+void logAsync(enum llevel_t ll, const char *fn, int ln, const char *fmt, int nargs, const uint64_t *args);
+void logFlush(void);
+void logCheckFormat(const char *fmt, ...) LOG_PRINTF_FORMAT(1, 2);
 void logStop(int sig);
 #ifdef __cplusplus
 }
+
+#include <cstring>
+#include <type_traits>
+
+// the bits of one argument of an asynchronous message
+template <typename T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type logArg(T value) {
+    return (uint64_t)(int64_t)value;
+}
+
+template <typename T>
+static inline uint64_t logArg(T *value) {
+    return (uint64_t)(uintptr_t)value;
+}
+
+static inline uint64_t logArg(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+template <typename... Args>
+static inline void logAsyncArgs(enum llevel_t ll, const char *fn, int ln, const char *fmt, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many arguments for an asynchronous log message");
+    const uint64_t values[sizeof...(Args) + 1] = { logArg(args)... };
+    logAsync(ll, fn, ln, fmt, sizeof...(Args), values);
+}
 #endif
 
 // courtesy of @pwntester on github
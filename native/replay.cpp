@@ -0,0 +1,101 @@
+/*
+ * Replays a run recorded with simunicorn_record_run (SimStateUnicorn.dump_snapshot
+ * in angr), without python, to profile the native side of the emulation on its
+ * own. Every run starts from a fresh engine set up from the snapshot, and prints
+ * one JSON object per line:
+ *
+ *   {"run": 0, "elapsed_ns": ..., "stop": "STOP_STOPPOINT", "steps": 1234,
+ *    "stats": {"blocks": ..., ...}}
+ *
+ * Only simunicorn_start is timed; loading the snapshot is not. Runs after the
+ * first share the page and block caches of the first, as runs in angr do.
+ *
+ * usage: replay [-n runs] [-s steps] snapshot
+ * -s overrides the step limit the run was recorded with.
+ * built by `make tools`, not by the default target.
+ */
+#define __STDC_FORMAT_MACROS 1
+#include <unicorn/unicorn.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include <chrono>
+
+extern "C" {
+#include <libvex.h>
+#include <pyvex.h>
+}
+
+#include "sim_unicorn.h"
+
+static void print_run(int run, uint64_t elapsed_ns, State *state) {
+	stop_t stop = simunicorn_stop_reason(state);
+	stats_t stats;
+	simunicorn_get_stats(state, &stats);
+
+	printf("{\"run\": %d, \"elapsed_ns\": %" PRIu64 ", \"stop\": \"%s\", \"steps\": %" PRIu64 ", \"stats\": {",
+		run, elapsed_ns, stop < STOP_REASONS ? stop_names[stop] : "STOP_UNKNOWN",
+		simunicorn_step(state));
+	const uint64_t *counters = (const uint64_t *)&stats;
+	for (size_t i = 0; i < sizeof(stats_names) / sizeof(stats_names[0]); i++) {
+		printf("\"%s\": %" PRIu64 ", ", stats_names[i], counters[i]);
+	}
+	printf("\"stops\": {");
+	const char *separator = "";
+	for (size_t i = 0; i < STOP_REASONS; i++) {
+		if (stats.stops[i] != 0) {
+			printf("%s\"%s\": %" PRIu64, separator, stop_names[i], stats.stops[i]);
+			separator = ", ";
+		}
+	}
+	printf("}}}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	int runs = 1;
+	uint64_t steps = 0;
+	const char *path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			steps = strtoull(argv[++i], NULL, 0);
+		} else if (argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		} else {
+			path = NULL;
+			break;
+		}
+	}
+	if (path == NULL || runs < 1) {
+		fprintf(stderr, "usage: %s [-n runs] [-s steps] snapshot\n", argv[0]);
+		return 2;
+	}
+
+	vex_init();
+	for (int run = 0; run < runs; run++) {
+		uc_engine *uc;
+		uint64_t pc, step;
+		State *state = simunicorn_load_run(path, &uc, &pc, &step);
+		if (state == NULL) {
+			fprintf(stderr, "%s: cannot load the run snapshot\n", path);
+			return 1;
+		}
+		if (steps != 0) {
+			step = steps;
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+		simunicorn_start(state, pc, step);
+		auto end = std::chrono::steady_clock::now();
+		print_run(run, std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(), state);
+
+		simunicorn_unload_run(state);
+	}
+	return 0;
+}
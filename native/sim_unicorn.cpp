@@ -4,122 +4,2907 @@
 #include <cinttypes>
 #include <cstring>
 #include <cstdint>
+#include <cerrno>
 
 #include <memory>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <map>
 #include <vector>
+#include <deque>
 #include <unordered_set>
 #include <unordered_map>
 #include <set>
 #include <algorithm>
 
+#include "log.h"
+#include "sim_unicorn.h"
+
 extern "C" {
 #include <assert.h>
 #include <libvex.h>
 #include <pyvex.h>
 }
 
-#define PAGE_SIZE 0x1000
-#define PAGE_SHIFT 12
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define TAINT_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TAINT_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+
+#define MAX_REG_SIZE 0x2000 // hope it's big enough
+
+static inline int count_trailing_zeros(uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline int count_set_bits(uint64_t x) {
+#if defined(_MSC_VER)
+	return (int)__popcnt64(x);
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+#define REGISTER_SET_WORDS (MAX_REG_SIZE / 64)
+
+/*
+ * A set of register byte offsets below MAX_REG_SIZE, kept as a dense bitset.
+ * `top` is one past the highest word that may be non-zero, so that the
+ * word-wide operations only scan the part of the register file in use.
+ * Callers check offsets from outside with fits() first; a range past the end
+ * is a bug, not something to clamp.
+ */
+class RegisterSet {
+	uint64_t words[REGISTER_SET_WORDS];
+	int top;
+
+	static inline uint64_t range_mask(uint64_t first, uint64_t last) {
+		// bits [first, last] of a single word
+		return (~0ULL << first) & (~0ULL >> (63 - last));
+	}
+
+public:
+	// can the bytes [offset, offset + size) be kept in a set?
+	static inline bool fits(uint64_t offset, int size) {
+		return offset < MAX_REG_SIZE && size <= (int)(MAX_REG_SIZE - offset);
+	}
+
+	RegisterSet() : top(0) {
+		memset(words, 0, sizeof(words));
+	}
+
+	RegisterSet(const RegisterSet &other) : top(other.top) {
+		memcpy(words, other.words, sizeof(uint64_t) * top);
+		memset(words + top, 0, sizeof(uint64_t) * (REGISTER_SET_WORDS - top));
+	}
+
+	RegisterSet &operator=(const RegisterSet &other) {
+		if (this != &other) {
+			memcpy(words, other.words, sizeof(uint64_t) * other.top);
+			if (top > other.top) {
+				memset(words + other.top, 0, sizeof(uint64_t) * (top - other.top));
+			}
+			top = other.top;
+		}
+		return *this;
+	}
+
+	inline void clear() {
+		memset(words, 0, sizeof(uint64_t) * top);
+		top = 0;
+	}
+
+	inline bool empty() const {
+		for (int i = 0; i < top; i++) {
+			if (words[i]) return false;
+		}
+		return true;
+	}
+
+	size_t size() const {
+		size_t count = 0;
+		for (int i = 0; i < top; i++) {
+			count += count_set_bits(words[i]);
+		}
+		return count;
+	}
+
+	inline bool contains(uint64_t offset) const {
+		assert(offset < MAX_REG_SIZE);
+		return (words[offset / 64] >> (offset % 64)) & 1;
+	}
+
+	inline void insert(uint64_t offset) {
+		insert_range(offset, 1);
+	}
+
+	inline void erase(uint64_t offset) {
+		erase_range(offset, 1);
+	}
+
+	// add the bytes [offset, offset + size)
+	void insert_range(uint64_t offset, int size) {
+		if (size <= 0) return;
+		assert(fits(offset, size));
+		uint64_t last = offset + size - 1;
+		for (uint64_t word = offset / 64; word <= last / 64; word++) {
+			uint64_t first_bit = word == offset / 64 ? offset % 64 : 0;
+			uint64_t last_bit = word == last / 64 ? last % 64 : 63;
+			words[word] |= range_mask(first_bit, last_bit);
+		}
+		top = std::max(top, (int)(last / 64) + 1);
+	}
+
+	// remove the bytes [offset, offset + size)
+	void erase_range(uint64_t offset, int size) {
+		if (size <= 0) return;
+		assert(fits(offset, size));
+		uint64_t last = offset + size - 1;
+		for (uint64_t word = offset / 64; word <= last / 64 && word < (uint64_t)top; word++) {
+			uint64_t first_bit = word == offset / 64 ? offset % 64 : 0;
+			uint64_t last_bit = word == last / 64 ? last % 64 : 63;
+			words[word] &= ~range_mask(first_bit, last_bit);
+		}
+	}
+
+	// does any of the bytes [offset, offset + size) belong to the set?
+	bool intersects_range(uint64_t offset, int size) const {
+		if (size <= 0) return false;
+		assert(fits(offset, size));
+		uint64_t last = offset + size - 1;
+		for (uint64_t word = offset / 64; word <= last / 64 && word < (uint64_t)top; word++) {
+			uint64_t first_bit = word == offset / 64 ? offset % 64 : 0;
+			uint64_t last_bit = word == last / 64 ? last % 64 : 63;
+			if (words[word] & range_mask(first_bit, last_bit)) return true;
+		}
+		return false;
+	}
+
+	// add the bytes [offset, offset + size) that are not in `excluded`
+	void insert_range_except(uint64_t offset, int size, const RegisterSet &excluded) {
+		if (size <= 0) return;
+		assert(fits(offset, size));
+		uint64_t last = offset + size - 1;
+		for (uint64_t word = offset / 64; word <= last / 64; word++) {
+			uint64_t first_bit = word == offset / 64 ? offset % 64 : 0;
+			uint64_t last_bit = word == last / 64 ? last % 64 : 63;
+			uint64_t bits = range_mask(first_bit, last_bit);
+			if (word < (uint64_t)excluded.top) {
+				bits &= ~excluded.words[word];
+			}
+			if (bits) {
+				words[word] |= bits;
+				top = std::max(top, (int)word + 1);
+			}
+		}
+	}
+
+	// the lowest offset in both sets, or -1 if they are disjoint
+	int64_t first_common(const RegisterSet &other) const {
+		int end = std::min(top, other.top);
+		for (int i = 0; i < end; i++) {
+			uint64_t common = words[i] & other.words[i];
+			if (common) {
+				return i * 64 + count_trailing_zeros(common);
+			}
+		}
+		return -1;
+	}
+
+	// remove every offset that is in `other`
+	void subtract(const RegisterSet &other) {
+		int end = std::min(top, other.top);
+		for (int i = 0; i < end; i++) {
+			words[i] &= ~other.words[i];
+		}
+	}
+
+	// call fn(offset) for every offset in the set, in ascending order
+	template <typename F>
+	void for_each(F fn) const {
+		for (int i = 0; i < top; i++) {
+			uint64_t bits = words[i];
+			while (bits) {
+				fn((uint64_t)i * 64 + count_trailing_zeros(bits));
+				bits &= bits - 1;
+			}
+		}
+	}
+};
+
+// Maximum size of a qemu/unicorn basic block
+// See State::step for why this is necessary
+static const uint32_t MAX_BB_SIZE = 800;
+
+extern "C" void x86_reg_update(uc_engine *uc, uint8_t *buf, int save);
+extern "C" void mips_reg_update(uc_engine *uc, uint8_t *buf, int save);
+
+typedef enum taint: uint8_t {
+	TAINT_NONE = 0,
+	TAINT_DIRTY = 1,
+	TAINT_SYMBOLIC = 2,
+} taint_t;
+
+// about 2 KiB: each RegisterSet is a 1 KiB bitset
+typedef struct block_entry {
+	bool try_unicorn;
+	uint32_t instructions; // 0 if unknown
+	RegisterSet used_registers;
+	RegisterSet clobbered_registers;
+} block_entry_t;
+
+/*
+ * Called once no cached page refers to a page_buffer_t (a mapped page cache
+ * snapshot) any more.
+ */
+typedef void (*page_release_t)(void *context, uint8_t *bytes);
+
+/*
+ * A caller-provided buffer backing one or more cached pages.
+ */
+typedef struct page_buffer {
+	std::atomic<uint64_t> refs;
+	uint8_t *bytes;
+	page_release_t release;
+	void *context;
+} page_buffer_t;
+
+static void page_buffer_put(page_buffer_t *buffer) {
+	if (--buffer->refs == 0) {
+		if (buffer->release != NULL) {
+			buffer->release(buffer->context, buffer->bytes);
+		}
+		delete buffer;
+	}
+}
+
+/*
+ * The immutable contents of one cached page.
+ *
+ * Cached pages are never written, so every page cache that caches the same
+ * contents shares one PageData, whatever State or cache_key it belongs to.
+ * Each page cache entry and each unicorn mapping of the page holds a reference.
+ */
+class PageData {
+private:
+	friend class PageStore;
+
+	std::atomic<uint64_t> refs;
+	page_buffer_t *buffer; // NULL if we own a private copy of the bytes
+	uint64_t hash;
+
+	PageData(const uint8_t *_bytes, uint64_t _hash, page_buffer_t *_buffer) : refs(1), buffer(_buffer), hash(_hash) {
+		if (buffer != NULL) {
+			bytes = _bytes;
+			buffer->refs++;
+		} else {
+			uint8_t *copy = new uint8_t[PAGE_SIZE];
+			memcpy(copy, _bytes, PAGE_SIZE);
+			bytes = copy;
+		}
+	}
+
+	~PageData() {
+		if (buffer != NULL) {
+			page_buffer_put(buffer);
+		} else {
+			delete[] bytes;
+		}
+	}
+
+public:
+	const uint8_t *bytes;
+
+	// take another reference. the caller must already hold one.
+	void acquire() {
+		refs++;
+	}
+};
+
+#define PAGE_STORE_SHARDS 16
+
+/*
+ * Interns PageData by content. Sharded by hash, since every block lift and page
+ * mapping drops a reference through here.
+ */
+class PageStore {
+private:
+	struct shard_t {
+		std::mutex lock;
+		std::unordered_multimap<uint64_t, PageData *> pages;
+		char pad[64]; // keep neighbouring shards' locks off the same cache line
+	};
+	shard_t shards[PAGE_STORE_SHARDS];
+
+	inline shard_t &shard(uint64_t hash) {
+		return shards[hash % PAGE_STORE_SHARDS];
+	}
+
+	static uint64_t hash_page(const uint8_t *bytes) {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (int i = 0; i < PAGE_SIZE; i += 8) {
+			uint64_t word;
+			memcpy(&word, &bytes[i], 8);
+			hash = (hash ^ word) * 0x100000001b3ULL;
+			hash ^= hash >> 29;
+		}
+		return hash;
+	}
+
+public:
+	/*
+	 * return a reference to the PageData holding these bytes. if there is none
+	 * yet, one is created that either points into buffer or, if buffer is NULL,
+	 * holds a private copy.
+	 */
+	PageData *get(const uint8_t *bytes, page_buffer_t *buffer = NULL) {
+		uint64_t hash = hash_page(bytes);
+		shard_t &s = shard(hash);
+		std::lock_guard<std::mutex> guard(s.lock);
+
+		auto range = s.pages.equal_range(hash);
+		for (auto it = range.first; it != range.second; it++) {
+			if (memcmp(it->second->bytes, bytes, PAGE_SIZE) == 0) {
+				it->second->refs++;
+				return it->second;
+			}
+		}
+
+		PageData *data = new PageData(bytes, hash, buffer);
+		s.pages.insert(std::make_pair(hash, data));
+		return data;
+	}
+
+	/*
+	 * drop a reference, freeing the PageData with the last one.
+	 */
+	void put(PageData *data) {
+		shard_t &s = shard(data->hash);
+		std::lock_guard<std::mutex> guard(s.lock);
+		if (--data->refs != 0) {
+			return;
+		}
+
+		auto range = s.pages.equal_range(data->hash);
+		for (auto it = range.first; it != range.second; it++) {
+			if (it->second == data) {
+				s.pages.erase(it);
+				break;
+			}
+		}
+		delete data;
+	}
+};
+
+static PageStore page_store;
+
+typedef struct CachedPage {
+	size_t size;
+	PageData *data;
+	uint64_t perms;
+} CachedPage;
+
+/*
+ * The cached pages mapped into one unicorn engine. Each mapping holds a
+ * reference, so the bytes outlive a wipe from another engine's page cache.
+ * Every State on the engine shares this, and only they take its lock.
+ */
+class MappedPages {
+public:
+	std::mutex lock;
+	std::unordered_map<uint64_t, PageData *> pages;
+
+	~MappedPages() {
+		for (auto &page : pages) {
+			page_store.put(page.second);
+		}
+	}
+};
+
+// An engine's entry goes away with simunicorn_engine_closed.
+static std::unordered_map<uc_engine *, std::shared_ptr<MappedPages>> engine_mapped_pages;
+static std::mutex engine_mapped_pages_lock;
+
+static std::shared_ptr<MappedPages> get_mapped_pages(uc_engine *uc) {
+	std::lock_guard<std::mutex> guard(engine_mapped_pages_lock);
+	std::shared_ptr<MappedPages> &mapped = engine_mapped_pages[uc];
+	if (!mapped) {
+		mapped.reset(new MappedPages());
+	}
+	return mapped;
+}
+
+/*
+ * drop the references held by the cached pages mapped into uc, once the last
+ * State using them is gone.
+ */
+static void release_mapped_pages(uc_engine *uc) {
+	std::lock_guard<std::mutex> guard(engine_mapped_pages_lock);
+	engine_mapped_pages.erase(uc);
+}
+
+// Taint is packed two bits per guest byte, 32 bytes per word
+#define TAINT_BITS 2
+#define TAINT_BYTES_PER_WORD (64 / TAINT_BITS)
+#define TAINT_WORDS (PAGE_SIZE / TAINT_BYTES_PER_WORD)
+// Masks selecting the TAINT_DIRTY / TAINT_SYMBOLIC bit of every packed byte
+#define TAINT_DIRTY_BITS 0x5555555555555555ULL
+#define TAINT_SYMBOLIC_BITS 0xAAAAAAAAAAAAAAAAULL
+
+/*
+ * Return the index of the first word in [from, to) that has any bit of mask set,
+ * or to if there is none.
+ */
+static int taint_scan_scalar(const uint64_t *words, int from, int to, uint64_t mask) {
+	for (int i = from; i < to; i++) {
+		if (words[i] & mask) {
+			return i;
+		}
+	}
+	return to;
+}
+
+#ifdef TAINT_SCAN_SSE2
+static int taint_scan_sse2(const uint64_t *words, int from, int to, uint64_t mask) {
+	const __m128i m = _mm_set1_epi64x((long long)mask);
+	const __m128i zero = _mm_setzero_si128();
+	int i = from;
+	for (; i + 2 <= to; i += 2) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)&words[i]), m);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+			break;
+		}
+	}
+	return taint_scan_scalar(words, i, to, mask);
+}
+#endif
+
+#ifdef TAINT_SCAN_AVX2
+__attribute__((target("avx2")))
+static int taint_scan_avx2(const uint64_t *words, int from, int to, uint64_t mask) {
+	const __m256i m = _mm256_set1_epi64x((long long)mask);
+	int i = from;
+	for (; i + 4 <= to; i += 4) {
+		if (!_mm256_testz_si256(_mm256_loadu_si256((const __m256i *)&words[i]), m)) {
+			break;
+		}
+	}
+	return taint_scan_scalar(words, i, to, mask);
+}
+#endif
+
+typedef int (*taint_scan_t)(const uint64_t *words, int from, int to, uint64_t mask);
+
+static taint_scan_t select_taint_scan() {
+#ifdef TAINT_SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return taint_scan_avx2;
+	}
+#endif
+#ifdef TAINT_SCAN_SSE2
+	return taint_scan_sse2;
+#else
+	return taint_scan_scalar;
+#endif
+}
+
+static const taint_scan_t taint_scan = select_taint_scan();
+
+/*
+ * Taint of one active page.
+ *
+ * Most pages are uniformly clean, dirty or symbolic, so those are kept as a
+ * single summary value and need no storage at all. Only a page with mixed taint
+ * gets a bitmap, packed to two bits per byte (a taint_t fits in two bits).
+ */
+class PageBitmap {
+private:
+	taint_t uniform; // taint of every byte, only valid if packed is NULL
+	uint64_t *packed;
+	// no byte outside [dirty_lo, dirty_hi] has ever been dirty, so sync can skip them
+	int dirty_lo, dirty_hi;
+	bool listed; // on the owning State's list of dirty pages
+	std::atomic<int> refs; // States sharing this bitmap since a fork
+
+	inline void widen_dirty(int start, int end) {
+		dirty_lo = std::min(dirty_lo, start);
+		dirty_hi = std::max(dirty_hi, end);
+	}
+
+	static inline uint64_t pattern(taint_t taint) {
+		return (uint64_t)taint * TAINT_DIRTY_BITS;
+	}
+
+	// mask of the packed bytes [lo, hi] of a single word
+	static inline uint64_t word_mask(int lo, int hi) {
+		int bits = (hi - lo + 1) * TAINT_BITS;
+		uint64_t mask = bits == 64 ? ~0ULL : ((1ULL << bits) - 1);
+		return mask << (lo * TAINT_BITS);
+	}
+
+	void expand() {
+		packed = new uint64_t[TAINT_WORDS];
+		uint64_t fill = pattern(uniform);
+		for (int i = 0; i < TAINT_WORDS; i++) {
+			packed[i] = fill;
+		}
+	}
+
+	void collapse(taint_t taint) {
+		delete[] packed;
+		packed = NULL;
+		uniform = taint;
+	}
+
+	/*
+	 * return the first byte in [start, end] with any of the bits of mask set,
+	 * or -1.
+	 */
+	int find(int start, int end, uint64_t mask) const {
+		int first = start / TAINT_BYTES_PER_WORD;
+		int last = end / TAINT_BYTES_PER_WORD;
+		int lo = start % TAINT_BYTES_PER_WORD;
+		int hi = end % TAINT_BYTES_PER_WORD;
+
+		uint64_t word = packed[first] & mask;
+		if (first == last) {
+			word &= word_mask(lo, hi);
+		} else {
+			word &= word_mask(lo, TAINT_BYTES_PER_WORD - 1);
+			if (word == 0) {
+				// the words in between are scanned wholesale
+				first = taint_scan(packed, first + 1, last, mask);
+				word = packed[first] & mask;
+				if (first == last) {
+					word &= word_mask(0, hi);
+				}
+			}
+		}
+
+		if (word == 0) {
+			return -1;
+		}
+		return first * TAINT_BYTES_PER_WORD + count_trailing_zeros(word) / TAINT_BITS;
+	}
+
+public:
+	PageBitmap() : uniform(TAINT_NONE), packed(NULL), dirty_lo(PAGE_SIZE), dirty_hi(-1), listed(false), refs(1) {}
+
+	PageBitmap(const PageBitmap &other) :
+		uniform(other.uniform), packed(NULL), dirty_lo(other.dirty_lo), dirty_hi(other.dirty_hi),
+		listed(other.listed), refs(1)
+	{
+		if (other.packed != NULL) {
+			packed = new uint64_t[TAINT_WORDS];
+			memcpy(packed, other.packed, TAINT_WORDS * sizeof(uint64_t));
+		}
+	}
+
+	void acquire() {
+		refs++;
+	}
+
+	void release() {
+		if (--refs == 0) {
+			delete this;
+		}
+	}
+
+	inline bool is_shared() const {
+		return refs.load() > 1;
+	}
+
+	~PageBitmap() {
+		delete[] packed;
+	}
+
+	/*
+	 * initialize from one taint_t per byte, as handed to us from python.
+	 */
+	void load(const uint8_t *taint) {
+		int i = 1;
+#ifdef TAINT_SCAN_SSE2
+		const __m128i first = _mm_set1_epi8((char)taint[0]);
+		for (i = 0; i + 16 <= PAGE_SIZE; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&taint[i]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) != 0xFFFF) {
+				break;
+			}
+		}
+#endif
+		while (i < PAGE_SIZE && taint[i] == taint[0]) {
+			i++;
+		}
+
+		if (i == PAGE_SIZE) {
+			collapse((taint_t)taint[0]);
+			if (uniform == TAINT_DIRTY) {
+				widen_dirty(0, PAGE_SIZE - 1);
+			}
+			return;
+		}
+
+		if (packed == NULL) {
+			packed = new uint64_t[TAINT_WORDS];
+		}
+		for (int w = 0; w < TAINT_WORDS; w++) {
+			uint64_t word = 0;
+			const uint8_t *bytes = &taint[w * TAINT_BYTES_PER_WORD];
+			for (int j = 0; j < TAINT_BYTES_PER_WORD; j++) {
+				word |= (uint64_t)(bytes[j] & 3) << (j * TAINT_BITS);
+			}
+			packed[w] = word;
+			if (word & TAINT_DIRTY_BITS) {
+				widen_dirty(w * TAINT_BYTES_PER_WORD, (w + 1) * TAINT_BYTES_PER_WORD - 1);
+			}
+		}
+	}
+
+	inline bool has_dirty() const {
+		return dirty_lo <= dirty_hi;
+	}
+
+	inline bool is_listed() const {
+		return listed;
+	}
+
+	inline void set_listed() {
+		listed = true;
+	}
+
+	inline taint_t get(int offset) const {
+		if (packed == NULL) {
+			return uniform;
+		}
+		uint64_t word = packed[offset / TAINT_BYTES_PER_WORD];
+		return (taint_t)((word >> ((offset % TAINT_BYTES_PER_WORD) * TAINT_BITS)) & 3);
+	}
+
+	/*
+	 * set the taint of bytes [start, end] of the page.
+	 */
+	void set(int start, int end, taint_t taint) {
+		if (taint == TAINT_DIRTY) {
+			widen_dirty(start, end);
+		}
+		if (start == 0 && end == PAGE_SIZE - 1) {
+			collapse(taint);
+			return;
+		}
+		if (packed == NULL) {
+			if (uniform == taint) {
+				return;
+			}
+			expand();
+		}
+
+		uint64_t fill = pattern(taint);
+		for (int w = start / TAINT_BYTES_PER_WORD; w <= end / TAINT_BYTES_PER_WORD; w++) {
+			int lo = std::max(start - w * TAINT_BYTES_PER_WORD, 0);
+			int hi = std::min(end - w * TAINT_BYTES_PER_WORD, TAINT_BYTES_PER_WORD - 1);
+			uint64_t mask = word_mask(lo, hi);
+			packed[w] = (packed[w] & ~mask) | (fill & mask);
+		}
+	}
+
+	/*
+	 * copy the packed words holding the taint of bytes [start, end] into words.
+	 */
+	void save(uint64_t *words, int start, int end) const {
+		int first = start / TAINT_BYTES_PER_WORD;
+		int count = end / TAINT_BYTES_PER_WORD - first + 1;
+		if (packed == NULL) {
+			uint64_t fill = pattern(uniform);
+			for (int i = 0; i < count; i++) {
+				words[i] = fill;
+			}
+		} else {
+			memcpy(words, packed + first, count * sizeof(uint64_t));
+		}
+	}
+
+	/*
+	 * put back the taint of bytes [start, end] from a copy save() made of bytes
+	 * from saved_start on.
+	 */
+	void restore(const uint64_t *words, int saved_start, int start, int end) {
+		if (packed == NULL) {
+			expand();
+		}
+		words -= saved_start / TAINT_BYTES_PER_WORD;
+		for (int w = start / TAINT_BYTES_PER_WORD; w <= end / TAINT_BYTES_PER_WORD; w++) {
+			int lo = std::max(start - w * TAINT_BYTES_PER_WORD, 0);
+			int hi = std::min(end - w * TAINT_BYTES_PER_WORD, TAINT_BYTES_PER_WORD - 1);
+			uint64_t mask = word_mask(lo, hi);
+			packed[w] = (packed[w] & ~mask) | (words[w] & mask);
+		}
+	}
+
+	/*
+	 * return the offset of the first symbolic byte in [start, end], or -1.
+	 * a page that is uniformly concrete answers without looking at any bytes.
+	 */
+	inline int find_symbolic(int start, int end) const {
+		if (packed == NULL) {
+			return uniform == TAINT_SYMBOLIC ? start : -1;
+		}
+		return find(start, end, TAINT_SYMBOLIC_BITS);
+	}
+
+	/*
+	 * find the first run of dirty bytes at or after from. on success, the run
+	 * is [*run_start, *run_end).
+	 */
+	bool find_dirty_run(int from, int *run_start, int *run_end) const {
+		from = std::max(from, dirty_lo);
+		if (from > dirty_hi) {
+			return false;
+		}
+		if (packed == NULL) {
+			if (uniform != TAINT_DIRTY) {
+				return false;
+			}
+			*run_start = from;
+			*run_end = PAGE_SIZE;
+			return true;
+		}
+
+		int first = find(from, dirty_hi, TAINT_DIRTY_BITS);
+		if (first == -1) {
+			return false;
+		}
+
+		// the run ends at the first byte whose dirty bit is clear
+		int w = first / TAINT_BYTES_PER_WORD;
+		uint64_t clean = ~packed[w] & TAINT_DIRTY_BITS & ~word_mask(0, first % TAINT_BYTES_PER_WORD);
+		while (clean == 0 && ++w < TAINT_WORDS) {
+			clean = ~packed[w] & TAINT_DIRTY_BITS;
+		}
+
+		*run_start = first;
+		*run_end = clean == 0 ? PAGE_SIZE : w * TAINT_BYTES_PER_WORD + count_trailing_zeros(clean) / TAINT_BITS;
+		return true;
+	}
+};
+
+// Each level of the page table resolves this many bits of the page number
+#define PAGE_TABLE_LEVEL_BITS 10
+#define PAGE_TABLE_LEVEL_SIZE (1ULL << PAGE_TABLE_LEVEL_BITS)
+// Number of entries in the direct-mapped cache in front of the page table
+#define PAGE_TABLE_CACHE_SIZE 64
+
+/*
+ * A multi-level radix table from guest page addresses to per-page data.
+ *
+ * 32-bit guests get a two-level table, 64-bit guests a six-level one. Walking
+ * it is a handful of dependent loads, so a small direct-mapped cache of recent
+ * lookups sits in front of the walk. The cache remembers misses as well as
+ * hits: most accesses are to pages that are not active at all.
+ *
+ * The table does not own the values it stores.
+ */
+template <typename T>
+class PageTable {
+private:
+	typedef struct node {
+		void *slots[PAGE_TABLE_LEVEL_SIZE];
+	} node_t;
+
+	typedef struct cache_entry {
+		uint64_t page; // never page-aligned if the entry is empty
+		T *value;
+	} cache_entry_t;
+
+	node_t *root;
+	int address_bits;
+	int levels;
+	size_t count;
+	mutable cache_entry_t cache[PAGE_TABLE_CACHE_SIZE];
+
+	inline bool in_range(uint64_t page) const {
+		return address_bits >= 64 || (page >> address_bits) == 0;
+	}
+
+	inline uint64_t slot_index(uint64_t page, int level) const {
+		uint64_t page_number = page >> PAGE_SHIFT;
+		return (page_number >> ((levels - 1 - level) * PAGE_TABLE_LEVEL_BITS)) & (PAGE_TABLE_LEVEL_SIZE - 1);
+	}
+
+	inline cache_entry_t *cache_slot(uint64_t page) const {
+		return &cache[(page >> PAGE_SHIFT) & (PAGE_TABLE_CACHE_SIZE - 1)];
+	}
+
+	void flush_cache() {
+		for (int i = 0; i < PAGE_TABLE_CACHE_SIZE; i++) {
+			cache[i].page = 1;
+			cache[i].value = NULL;
+		}
+	}
+
+	T *walk(uint64_t page) const {
+		node_t *cur = root;
+		for (int level = 0; cur != NULL && level < levels - 1; level++) {
+			cur = (node_t *)cur->slots[slot_index(page, level)];
+		}
+		if (cur == NULL) {
+			return NULL;
+		}
+		return (T *)cur->slots[slot_index(page, levels - 1)];
+	}
+
+	template <typename F>
+	void visit(node_t *cur, int level, uint64_t prefix, F &fn) const {
+		for (uint64_t i = 0; i < PAGE_TABLE_LEVEL_SIZE; i++) {
+			if (cur->slots[i] == NULL) {
+				continue;
+			}
+			uint64_t page_number = (prefix << PAGE_TABLE_LEVEL_BITS) | i;
+			if (level == levels - 1) {
+				fn(page_number << PAGE_SHIFT, (T *)cur->slots[i]);
+			} else {
+				visit((node_t *)cur->slots[i], level + 1, page_number, fn);
+			}
+		}
+	}
+
+	void free_nodes(node_t *cur, int level) {
+		if (level < levels - 1) {
+			for (uint64_t i = 0; i < PAGE_TABLE_LEVEL_SIZE; i++) {
+				if (cur->slots[i] != NULL) {
+					free_nodes((node_t *)cur->slots[i], level + 1);
+				}
+			}
+		}
+		delete cur;
+	}
+
+public:
+	PageTable() : root(NULL), count(0) {
+		init(64);
+	}
+
+	~PageTable() {
+		clear();
+	}
+
+	/*
+	 * size the table for a guest with the given address width. must be called
+	 * while the table is empty.
+	 */
+	void init(int guest_address_bits) {
+		assert(count == 0);
+		address_bits = guest_address_bits;
+		int page_number_bits = address_bits - PAGE_SHIFT;
+		levels = (page_number_bits + PAGE_TABLE_LEVEL_BITS - 1) / PAGE_TABLE_LEVEL_BITS;
+		flush_cache();
+	}
+
+	/*
+	 * return the value stored for the page containing address, or NULL.
+	 */
+	inline T *lookup(uint64_t address) const {
+		uint64_t page = address & ~0xFFFULL;
+		cache_entry_t *entry = cache_slot(page);
+		if (entry->page == page) {
+			return entry->value;
+		}
+		T *value = in_range(page) ? walk(page) : NULL;
+		entry->page = page;
+		entry->value = value;
+		return value;
+	}
+
+	/*
+	 * store value for the page containing address, replacing any previous value.
+	 * returns false if the address does not fit the guest address width.
+	 */
+	bool insert(uint64_t address, T *value) {
+		uint64_t page = address & ~0xFFFULL;
+		if (!in_range(page)) {
+			return false;
+		}
+		if (root == NULL) {
+			root = new node_t();
+		}
+		node_t *cur = root;
+		for (int level = 0; level < levels - 1; level++) {
+			void **slot = &cur->slots[slot_index(page, level)];
+			if (*slot == NULL) {
+				*slot = new node_t();
+			}
+			cur = (node_t *)*slot;
+		}
+		void **leaf = &cur->slots[slot_index(page, levels - 1)];
+		if (*leaf == NULL) {
+			count++;
+		}
+		*leaf = value;
+
+		cache_entry_t *entry = cache_slot(page);
+		entry->page = page;
+		entry->value = value;
+		return true;
+	}
+
+	/*
+	 * call fn(page_address, value) for every stored page, in address order.
+	 */
+	template <typename F>
+	void for_each(F fn) const {
+		if (root != NULL) {
+			visit(root, 0, 0, fn);
+		}
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	/*
+	 * drop all entries. values are not freed.
+	 */
+	void clear() {
+		if (root != NULL) {
+			free_nodes(root, 0);
+			root = NULL;
+		}
+		count = 0;
+		flush_cache();
+	}
+};
+
+#define CACHE_SHARDS 16
+
+/*
+ * reader/writer spinlock. readers only bump a counter, so any number of threads
+ * looking up the same shard never wait on each other. writers (caching or wiping
+ * a page, publishing a lifted block) are rare and hold the lock briefly, for one
+ * map insert or erase. that is shorter than a thread takes to go to sleep and wake
+ * up again, so waiting spins instead of blocking; std::shared_timed_mutex would
+ * also make every reader take its internal mutex, on the lookup hot path.
+ *
+ * a waiting writer keeps new readers out, so that threads constantly reading a
+ * hot shard can't hold it off for good.
+ */
+class RWLock {
+private:
+	std::atomic<int32_t> state; // reader count, or -1 while a writer holds it
+	std::atomic<int32_t> writers; // waiting for or holding the lock
+
+public:
+	RWLock() : state(0), writers(0) {}
+
+	void lock_shared() {
+		for (;;) {
+			int32_t cur = state.load(std::memory_order_relaxed);
+			if (cur >= 0 && writers.load(std::memory_order_relaxed) == 0 &&
+					state.compare_exchange_weak(cur, cur + 1, std::memory_order_acquire)) {
+				return;
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	void unlock_shared() {
+		state.fetch_sub(1, std::memory_order_release);
+	}
+
+	void lock() {
+		writers.fetch_add(1, std::memory_order_relaxed);
+		for (;;) {
+			int32_t cur = 0;
+			if (state.compare_exchange_weak(cur, -1, std::memory_order_acquire)) {
+				return;
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	void unlock() {
+		state.store(0, std::memory_order_release);
+		writers.fetch_sub(1, std::memory_order_relaxed);
+	}
+};
+
+class SharedGuard {
+private:
+	RWLock &lock;
+
+public:
+	explicit SharedGuard(RWLock &_lock) : lock(_lock) {
+		lock.lock_shared();
+	}
+
+	~SharedGuard() {
+		lock.unlock_shared();
+	}
+};
+
+/*
+ * pages cached under one cache_key, shared by every State created with that key.
+ * the map is split into shards by page number so threads touching different pages
+ * don't even share a lock word.
+ */
+class PageCache {
+private:
+	struct shard_t {
+		RWLock lock;
+		std::map<uint64_t, CachedPage> pages;
+		char pad[64]; // keep neighbouring shards' locks off the same cache line
+	};
+	shard_t shards[CACHE_SHARDS];
+
+	inline shard_t &shard(uint64_t address) {
+		return shards[(address >> PAGE_SHIFT) % CACHE_SHARDS];
+	}
+
+public:
+	/*
+	 * copy out the page cached at address. the copy holds its own reference to the
+	 * bytes, which the caller must drop with page_store.put().
+	 */
+	bool get(uint64_t address, CachedPage *out) {
+		shard_t &s = shard(address);
+		SharedGuard guard(s.lock);
+		auto it = s.pages.find(address);
+		if (it == s.pages.end()) {
+			return false;
+		}
+		*out = it->second;
+		out->data->acquire();
+		return true;
+	}
+
+	bool contains(uint64_t address) {
+		shard_t &s = shard(address);
+		SharedGuard guard(s.lock);
+		return s.pages.find(address) != s.pages.end();
+	}
+
+	/*
+	 * cache a page, taking over the caller's reference. returns false, leaving the
+	 * reference with the caller, if another thread cached the address first.
+	 */
+	bool insert(uint64_t address, const CachedPage &page) {
+		shard_t &s = shard(address);
+		std::lock_guard<RWLock> guard(s.lock);
+		return s.pages.insert(std::make_pair(address, page)).second;
+	}
+
+	/*
+	 * drop the page at address, handing its reference to the caller.
+	 */
+	bool remove(uint64_t address, CachedPage *out) {
+		shard_t &s = shard(address);
+		std::lock_guard<RWLock> guard(s.lock);
+		auto it = s.pages.find(address);
+		if (it == s.pages.end()) {
+			return false;
+		}
+		*out = it->second;
+		s.pages.erase(it);
+		return true;
+	}
+
+	// every cached address at the time of the call, in address order
+	std::vector<uint64_t> addresses() {
+		std::vector<uint64_t> result;
+		for (auto &s : shards) {
+			SharedGuard guard(s.lock);
+			for (auto &page : s.pages) {
+				result.push_back(page.first);
+			}
+		}
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+};
+
+/*
+ * machine code read straight out of the page cache. the pages stay referenced
+ * while this lives; only code crossing a page boundary is copied.
+ */
+class CachedCode {
+private:
+	PageData *pinned[2];
+	int pinned_count;
+	uint8_t scratch[MAX_BB_SIZE];
+
+	void release() {
+		for (int i = 0; i < pinned_count; i++) {
+			page_store.put(pinned[i]);
+		}
+		pinned_count = 0;
+	}
+
+public:
+	const uint8_t *bytes;
+
+	CachedCode() : pinned_count(0), bytes(NULL) {}
+
+	~CachedCode() {
+		release();
+	}
+
+	// false unless all of [address, address + size) is cached
+	bool load(PageCache *cache, uint64_t address, uint32_t size) {
+		release();
+		bytes = NULL;
+		if (size == 0 || size > MAX_BB_SIZE) {
+			return false;
+		}
+
+		uint64_t page = address & ~0xFFFULL;
+		uint32_t offset = address - page;
+		CachedPage first, second;
+		if (!cache->get(page, &first)) {
+			return false;
+		}
+		pinned[pinned_count++] = first.data;
+		if (offset + size <= PAGE_SIZE) {
+			bytes = first.data->bytes + offset;
+			return true;
+		}
+
+		if (!cache->get(page + PAGE_SIZE, &second)) {
+			release();
+			return false;
+		}
+		pinned[pinned_count++] = second.data;
+		memcpy(scratch, first.data->bytes + offset, PAGE_SIZE - offset);
+		memcpy(scratch + PAGE_SIZE - offset, second.data->bytes, size - (PAGE_SIZE - offset));
+		bytes = scratch;
+		return true;
+	}
+};
+
+/*
+ * feasibility results for lifted blocks. entries are immutable once published, so
+ * readers keep using an entry after dropping the shard lock.
+ *
+ * every page holding cached blocks has a write generation. a guest write to such a
+ * page drops just the blocks on it and bumps the generation, so a lift that raced
+ * with the write is not published.
+ */
+class BlockCache {
+private:
+	typedef struct code_page {
+		uint64_t generation;
+		std::unordered_set<uint64_t> blocks; // start addresses of the cached blocks overlapping the page
+		std::unordered_set<uint64_t> parked; // likewise for the speculative blocks
+	} code_page_t;
+
+	typedef struct speculative_block {
+		int32_t size;
+		std::shared_ptr<const block_entry_t> entry;
+	} speculative_block_t;
+
+	struct shard_t {
+		RWLock lock;
+		std::unordered_map<uint64_t, std::shared_ptr<const block_entry_t>> blocks; // by start address
+		std::unordered_map<uint64_t, code_page_t> pages;
+		std::unordered_map<uint64_t, speculative_block_t> speculative; // by start address
+		char pad[64];
+	};
+	shard_t shards[CACHE_SHARDS];
+	std::atomic<uint64_t> code_epoch; // bumped whenever a page starts holding blocks
+
+	// blocks live in the shard of the page they start on, so a page is invalidated
+	// with at most two shard locks
+	inline shard_t &shard(uint64_t address) {
+		return shards[(address >> PAGE_SHIFT) % CACHE_SHARDS];
+	}
+
+	static inline uint64_t last_page(uint64_t address, int32_t size) {
+		// a zero size is a block qemu split, see State::step
+		uint32_t real_size = size == 0 ? MAX_BB_SIZE : size;
+		return (address + real_size - 1) & ~0xFFFULL;
+	}
+
+	// the caller holds the shard's lock
+	static inline uint64_t page_generation(shard_t &s, uint64_t page) {
+		auto it = s.pages.find(page);
+		return it == s.pages.end() ? 0 : it->second.generation;
+	}
+
+	// generation(), for a caller holding a BlockGuard on address
+	uint64_t held_generation(uint64_t address, int32_t size) {
+		uint64_t result = 0;
+		for (uint64_t page = address & ~0xFFFULL; page <= last_page(address, size); page += PAGE_SIZE) {
+			result += page_generation(shard(page), page);
+		}
+		return result;
+	}
+
+	/*
+	 * holds the shards of the two pages a block starting at address may span. they
+	 * are locked in shard order, and nothing else holds two shard locks at once, so
+	 * these never deadlock.
+	 */
+	class BlockGuard {
+	private:
+		shard_t *first, *second;
+
+	public:
+		BlockGuard(BlockCache &cache, uint64_t address) {
+			uint64_t page = address & ~0xFFFULL;
+			first = &cache.shard(page);
+			second = &cache.shard(page + PAGE_SIZE);
+			if (second < first) {
+				std::swap(first, second);
+			}
+			first->lock.lock();
+			if (second != first) {
+				second->lock.lock();
+			}
+		}
+
+		~BlockGuard() {
+			if (second != first) {
+				second->lock.unlock();
+			}
+			first->lock.unlock();
+		}
+	};
+
+public:
+	BlockCache() : code_epoch(0) {}
+
+	std::shared_ptr<const block_entry_t> find(uint64_t address) {
+		shard_t &s = shard(address);
+		SharedGuard guard(s.lock);
+		auto it = s.blocks.find(address);
+		if (it == s.blocks.end()) {
+			return nullptr;
+		}
+		return it->second;
+	}
+
+	// combined write generation of the pages [address, address + size) spans
+	uint64_t generation(uint64_t address, int32_t size) {
+		uint64_t result = 0;
+		for (uint64_t page = address & ~0xFFFULL; page <= last_page(address, size); page += PAGE_SIZE) {
+			shard_t &s = shard(page);
+			SharedGuard guard(s.lock);
+			result += page_generation(s, page);
+		}
+		return result;
+	}
+
+	/*
+	 * publish an entry unless another thread beat us to it. returns whichever entry
+	 * ends up in the cache. `generation` is what generation() returned before the
+	 * block was lifted; if its code was written since, the entry is returned without
+	 * being cached.
+	 */
+	std::shared_ptr<const block_entry_t> insert(uint64_t address, int32_t size, std::shared_ptr<const block_entry_t> entry, uint64_t generation) {
+		// checked with the shards held, so that an invalidate_page can't slip in before the entry is in
+		BlockGuard guard(*this, address);
+		if (held_generation(address, size) != generation) {
+			return entry;
+		}
+
+		auto result = shard(address).blocks.insert(std::make_pair(address, entry));
+		if (!result.second) {
+			return result.first->second;
+		}
+		for (uint64_t page = address & ~0xFFFULL; page <= last_page(address, size); page += PAGE_SIZE) {
+			code_page_t &code = shard(page).pages[page];
+			if (code.blocks.empty()) {
+				code_epoch++;
+			}
+			code.blocks.insert(address);
+		}
+		return entry;
+	}
+
+	inline uint64_t epoch() {
+		return code_epoch.load(std::memory_order_acquire);
+	}
+
+	// is the block at address cached, or waiting to be claimed?
+	bool known(uint64_t address) {
+		shard_t &s = shard(address);
+		SharedGuard guard(s.lock);
+		return s.blocks.count(address) > 0 || s.speculative.count(address) > 0;
+	}
+
+	/*
+	 * park a block lifted ahead of time. unicorn's idea of where the block ends may
+	 * differ from VEX's, so it only becomes a cache entry once claim() sees a block
+	 * of the same size. `generation` is what generation(address, code_size)
+	 * returned before the code_size bytes it was lifted from were read; if those
+	 * were written since, the block is dropped.
+	 */
+	void offer(uint64_t address, int32_t size, std::shared_ptr<const block_entry_t> entry, int32_t code_size, uint64_t generation) {
+		BlockGuard guard(*this, address);
+		shard_t &s = shard(address);
+		if (held_generation(address, code_size) != generation || s.blocks.count(address) != 0 ||
+				!s.speculative.insert(std::make_pair(address, speculative_block_t{size, entry})).second) {
+			return;
+		}
+		for (uint64_t page = address & ~0xFFFULL; page <= last_page(address, size); page += PAGE_SIZE) {
+			code_page_t &code = shard(page).pages[page];
+			if (code.blocks.empty() && code.parked.empty()) {
+				// writes to the page need checking from now on
+				code_epoch++;
+			}
+			code.parked.insert(address);
+		}
+	}
+
+	std::shared_ptr<const block_entry_t> claim(uint64_t address, int32_t size) {
+		BlockGuard guard(*this, address);
+		shard_t &s = shard(address);
+		auto it = s.speculative.find(address);
+		if (it == s.speculative.end()) {
+			return nullptr;
+		}
+		std::shared_ptr<const block_entry_t> entry = it->second.size == size ? it->second.entry : nullptr;
+		for (uint64_t page = address & ~0xFFFULL; page <= last_page(address, it->second.size); page += PAGE_SIZE) {
+			shard(page).pages[page].parked.erase(address);
+		}
+		s.speculative.erase(it);
+		return entry;
+	}
+
+	/*
+	 * the page was written: drop every block overlapping it, cached or parked, and
+	 * bump its generation. returns false if there was nothing on the page.
+	 */
+	bool invalidate_page(uint64_t page) {
+		std::unordered_set<uint64_t> victims, parked;
+		{
+			shard_t &s = shard(page);
+			SharedGuard guard(s.lock);
+			auto it = s.pages.find(page);
+			if (it == s.pages.end() || (it->second.blocks.empty() && it->second.parked.empty())) {
+				return false;
+			}
+		}
+
+		{
+			shard_t &s = shard(page);
+			std::lock_guard<RWLock> guard(s.lock);
+			code_page_t &code = s.pages[page];
+			code.generation++;
+			victims.swap(code.blocks);
+			parked.swap(code.parked);
+			for (uint64_t address : victims) {
+				if ((address & ~0xFFFULL) == page) {
+					s.blocks.erase(address);
+				}
+			}
+			for (uint64_t address : parked) {
+				if ((address & ~0xFFFULL) == page) {
+					s.speculative.erase(address);
+				}
+			}
+		}
+
+		// unlink the victims from the other page they may overlap. a block is shorter
+		// than a page, so that is the page before or after its start
+		for (uint64_t address : victims) {
+			uint64_t first = address & ~0xFFFULL;
+			for (uint64_t other = first; other <= first + PAGE_SIZE; other += PAGE_SIZE) {
+				if (other == page) {
+					continue;
+				}
+				shard_t &s = shard(other);
+				std::lock_guard<RWLock> guard(s.lock);
+				if (other == first) {
+					s.blocks.erase(address);
+				}
+				auto it = s.pages.find(other);
+				if (it != s.pages.end()) {
+					it->second.blocks.erase(address);
+				}
+			}
+		}
+		for (uint64_t address : parked) {
+			uint64_t first = address & ~0xFFFULL;
+			for (uint64_t other = first; other <= first + PAGE_SIZE; other += PAGE_SIZE) {
+				if (other == page) {
+					continue;
+				}
+				shard_t &s = shard(other);
+				std::lock_guard<RWLock> guard(s.lock);
+				if (other == first) {
+					s.speculative.erase(address);
+				}
+				auto it = s.pages.find(other);
+				if (it != s.pages.end()) {
+					it->second.parked.erase(address);
+				}
+			}
+		}
+		return true;
+	}
+};
+
+static inline uint64_t fnv1a_hash(const void *data, size_t length, uint64_t hash = 0xcbf29ce484222325ULL) {
+	const uint8_t *bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#define BLOCK_CACHE_FILE_MAGIC 0x31434253 // "SBC1"
+#define BLOCK_CACHE_FILE_VERSION 2 // 2: records carry the instruction count
+
+typedef struct block_cache_file_header {
+	uint32_t magic;
+	uint32_t version;
+} block_cache_file_header_t;
+
+/*
+ * one lifted block. the header is followed by used_count + clobbered_count
+ * register offsets (uint16_t), then code_size bytes of machine code, padded so
+ * the next record starts 8-byte aligned.
+ */
+typedef struct block_cache_record {
+	uint32_t length; // of the whole record, padding included
+	uint32_t code_size;
+	uint64_t code_hash;
+	uint64_t arch_hash; // guest, VexArchInfo and anything else the lift depends on
+	uint16_t try_unicorn;
+	uint16_t used_count;
+	uint16_t clobbered_count;
+	uint16_t instructions;
+} block_cache_record_t;
+
+/*
+ * append-only file of feasibility results, shared by every process that opens it.
+ * records are looked up by the block's bytes rather than its address, so a block
+ * hits no matter where the binary was loaded. records found when the file is
+ * opened are read straight out of a read-only mapping; records appended later are
+ * kept in memory as well.
+ */
+class BlockCacheFile {
+private:
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	RWLock lock;
+	std::unordered_multimap<uint64_t, const block_cache_record_t *> index; // code hash -> record
+	std::vector<std::unique_ptr<uint64_t[]>> appended;
+
+	static bool record_valid(const block_cache_record_t *record, size_t available) {
+		if (available < sizeof(block_cache_record_t)) {
+			return false;
+		}
+		if (record->length < sizeof(block_cache_record_t) || record->length % 8 != 0 || record->length > available) {
+			return false;
+		}
+		size_t needed = sizeof(block_cache_record_t) +
+			sizeof(uint16_t) * (record->used_count + record->clobbered_count) + record->code_size;
+		return needed <= record->length;
+	}
+
+	static const uint16_t *record_registers(const block_cache_record_t *record) {
+		return (const uint16_t *)(record + 1);
+	}
+
+	static const uint8_t *record_code(const block_cache_record_t *record) {
+		return (const uint8_t *)(record_registers(record) + record->used_count + record->clobbered_count);
+	}
+
+public:
+	BlockCacheFile() : fd(-1), map(NULL), map_size(0) {}
+
+	~BlockCacheFile() {
+#ifndef _WIN32
+		if (map != NULL) {
+			munmap(map, map_size);
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+#endif
+	}
+
+	bool open(const char *path) {
+#ifdef _WIN32
+		return false;
+#else
+		fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			return false;
+		}
+
+		// keep other processes from appending while we validate the file
+		flock(fd, LOCK_EX);
+		bool success = false;
+		struct stat st;
+		block_cache_file_header_t header;
+		if (fstat(fd, &st) != 0) {
+			goto out;
+		}
+
+		if (st.st_size == 0) {
+			header.magic = BLOCK_CACHE_FILE_MAGIC;
+			header.version = BLOCK_CACHE_FILE_VERSION;
+			success = write(fd, &header, sizeof(header)) == sizeof(header);
+			goto out;
+		}
+
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != BLOCK_CACHE_FILE_MAGIC) {
+			fprintf(stderr, "%s is not a block cache file, ignoring it.\n", path);
+			goto out;
+		}
+		if (header.version != BLOCK_CACHE_FILE_VERSION) {
+			fprintf(stderr, "%s is a block cache file of version %u, not %u, ignoring it.\n", path, header.version, BLOCK_CACHE_FILE_VERSION);
+			goto out;
+		}
+
+		map_size = st.st_size;
+		map = (uint8_t *)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			goto out;
+		}
+
+		{
+			size_t offset = sizeof(header);
+			while (offset < map_size) {
+				const block_cache_record_t *record = (const block_cache_record_t *)(map + offset);
+				if (!record_valid(record, map_size - offset)) {
+					break;
+				}
+				index.insert(std::make_pair(record->code_hash, record));
+				offset += record->length;
+			}
+			if (offset < map_size) {
+				// a writer died halfway through a record; drop the torn tail so appends line up again
+				if (ftruncate(fd, offset) != 0) {
+					goto out;
+				}
+			}
+		}
+		success = true;
+
+out:
+		flock(fd, LOCK_UN);
+		return success;
+#endif
+	}
+
+	std::shared_ptr<block_entry_t> find(uint64_t arch_hash, const uint8_t *code, uint32_t code_size) {
+		uint64_t code_hash = fnv1a_hash(code, code_size);
+		SharedGuard guard(lock);
+		auto range = index.equal_range(code_hash);
+		for (auto it = range.first; it != range.second; it++) {
+			const block_cache_record_t *record = it->second;
+			if (record->arch_hash != arch_hash || record->code_size != code_size ||
+					memcmp(record_code(record), code, code_size) != 0) {
+				continue;
+			}
+
+			const uint16_t *registers = record_registers(record);
+			if (!std::all_of(registers, registers + record->used_count + record->clobbered_count,
+					[](uint16_t offset) { return RegisterSet::fits(offset, 1); })) {
+				// written by a build with a bigger register file
+				continue;
+			}
+			std::shared_ptr<block_entry_t> entry(new block_entry_t());
+			entry->try_unicorn = record->try_unicorn;
+			entry->instructions = record->instructions;
+			for (uint32_t i = 0; i < record->used_count; i++) {
+				entry->used_registers.insert(*registers++);
+			}
+			for (uint32_t i = 0; i < record->clobbered_count; i++) {
+				entry->clobbered_registers.insert(*registers++);
+			}
+			return entry;
+		}
+		return nullptr;
+	}
+
+	void append(uint64_t arch_hash, const uint8_t *code, uint32_t code_size, const block_entry_t &entry) {
+#ifndef _WIN32
+		size_t register_count = entry.used_registers.size() + entry.clobbered_registers.size();
+		if (register_count > 0xFFFF) {
+			return;
+		}
+		size_t length = sizeof(block_cache_record_t) + sizeof(uint16_t) * register_count + code_size;
+		length = (length + 7) & ~(size_t)7;
+
+		std::unique_ptr<uint64_t[]> buffer(new uint64_t[length / 8]());
+		block_cache_record_t *record = (block_cache_record_t *)buffer.get();
+		record->length = length;
+		record->code_size = code_size;
+		record->code_hash = fnv1a_hash(code, code_size);
+		record->arch_hash = arch_hash;
+		record->try_unicorn = entry.try_unicorn;
+		record->used_count = entry.used_registers.size();
+		record->clobbered_count = entry.clobbered_registers.size();
+		record->instructions = std::min<uint32_t>(entry.instructions, 0xFFFF);
+
+		// offsets are below MAX_REG_SIZE, so they always fit
+		uint16_t *registers = (uint16_t *)(record + 1);
+		entry.used_registers.for_each([&](uint64_t offset) { *registers++ = offset; });
+		entry.clobbered_registers.for_each([&](uint64_t offset) { *registers++ = offset; });
+		memcpy(registers, code, code_size);
+
+		std::lock_guard<RWLock> guard(lock);
+		// a single write of the whole record, so concurrent appenders never interleave
+		flock(fd, LOCK_EX);
+		bool written = write(fd, record, length) == (ssize_t)length;
+		flock(fd, LOCK_UN);
+		if (written) {
+			index.insert(std::make_pair(record->code_hash, record));
+			appended.push_back(std::move(buffer));
+		}
+#endif
+	}
+};
+
+static std::shared_ptr<BlockCacheFile> block_cache_file;
+static std::mutex block_cache_file_lock;
+
+static std::shared_ptr<BlockCacheFile> current_block_cache_file() {
+	std::lock_guard<std::mutex> guard(block_cache_file_lock);
+	return block_cache_file;
+}
+
+#define PAGE_CACHE_SNAPSHOT_MAGIC 0x31435053 // "SPC1"
+#define PAGE_CACHE_SNAPSHOT_VERSION 1
+
+/*
+ * a page cache snapshot is the header, count entries sorted by address, padding up
+ * to a page boundary, then the contents of each page in entry order. keeping the
+ * contents page aligned lets a loader map them straight out of the file.
+ */
+typedef struct page_cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+} page_cache_snapshot_header_t;
+
+typedef struct page_cache_snapshot_entry {
+	uint64_t address;
+	uint64_t perms;
+} page_cache_snapshot_entry_t;
+
+static inline uint64_t page_cache_snapshot_data_offset(uint64_t count) {
+	uint64_t offset = sizeof(page_cache_snapshot_header_t) + count * sizeof(page_cache_snapshot_entry_t);
+	return (offset + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+#ifndef _WIN32
+// release callback for a snapshot mapping; context holds its length
+static void page_cache_snapshot_release(void *context, uint8_t *bytes) {
+	munmap(bytes, (size_t)(uintptr_t)context);
+}
+#endif
+
+#define RUN_SNAPSHOT_MAGIC 0x31535253 // "SRS1"
+#define RUN_SNAPSHOT_VERSION 1
+#define RUN_SNAPSHOT_REGISTER_SIZE 64 // fits every register unicorn reads, vectors included
+
+// flags of a run_snapshot_page_t
+#define RUN_SNAPSHOT_PAGE_TAINT 1 // the page was active; its taint, one taint_t per byte, follows its contents
+#define RUN_SNAPSHOT_PAGE_MAPPED 2 // a cached page that was mapped when the run started
+
+/*
+ * a run snapshot is everything a run started from, so that native/replay can run
+ * it again without python: the header, then its registers, stops and symbolic
+ * register offsets, then its pages, each followed by its contents (and taint),
+ * then the page cache as it was at the end of the run, each page followed by
+ * its contents. the vex settings are only meaningful to the libvex that wrote
+ * them.
+ */
+typedef struct run_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t arch; // uc_arch
+	uint32_t mode; // uc_mode
+	uint64_t pc;
+	uint64_t step;
+	uint64_t cache_key;
+	uint64_t registers;
+	uint64_t stops;
+	uint64_t symbolic_registers;
+	uint64_t pages;
+	uint64_t cached_pages;
+	uint32_t transmit_sysno;
+	uint32_t transmit_bbl_addr;
+	uint8_t track_bbls;
+	uint8_t track_stack;
+	uint8_t reserved[2];
+	uint32_t vex_guest; // VexArch_INVALID without symbolic register tracking
+	VexArchInfo vex_archinfo; // with hwcache_info.caches cleared
+} run_snapshot_header_t;
+
+typedef struct run_snapshot_register {
+	int32_t id; // for uc_reg_write
+	uint32_t reserved;
+	uint8_t value[RUN_SNAPSHOT_REGISTER_SIZE];
+} run_snapshot_register_t;
+
+typedef struct run_snapshot_page {
+	uint64_t address;
+	uint32_t perms;
+	uint32_t flags;
+} run_snapshot_page_t;
+
+class RunSnapshot {
+public:
+	typedef struct page {
+		run_snapshot_page_t info;
+		std::vector<uint8_t> bytes;
+		std::vector<uint8_t> taint; // empty without RUN_SNAPSHOT_PAGE_TAINT
+	} page_t;
+
+	run_snapshot_header_t header;
+	std::vector<run_snapshot_register_t> registers; // in the order to write them back in
+	std::vector<uint64_t> stops;
+	std::vector<uint64_t> symbolic_registers;
+	std::map<uint64_t, page_t> pages;
+	std::map<uint64_t, page_t> cached_pages;
+
+	RunSnapshot() : file(NULL) {
+		memset(&header, 0, sizeof(header));
+	}
+
+	~RunSnapshot() {
+		if (file != NULL) {
+			fclose(file);
+			remove(temp_path.c_str());
+		}
+	}
+
+	/*
+	 * start a snapshot to be written to path. the file is created next to it right
+	 * away, so that a bad path fails now and not once the run is over.
+	 */
+	bool create(const char *_path) {
+		path = _path;
+		temp_path = path + ".tmp";
+		file = fopen(temp_path.c_str(), "wb");
+		return file != NULL;
+	}
+
+	/*
+	 * write the snapshot out and move it to the path given to create().
+	 */
+	bool write() {
+		if (file == NULL) {
+			return false;
+		}
+		header.magic = RUN_SNAPSHOT_MAGIC;
+		header.version = RUN_SNAPSHOT_VERSION;
+		header.registers = registers.size();
+		header.stops = stops.size();
+		header.symbolic_registers = symbolic_registers.size();
+		header.pages = pages.size();
+		header.cached_pages = cached_pages.size();
+
+		bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+		success &= fwrite(registers.data(), sizeof(run_snapshot_register_t), registers.size(), file) == registers.size();
+		success &= fwrite(stops.data(), sizeof(uint64_t), stops.size(), file) == stops.size();
+		success &= fwrite(symbolic_registers.data(), sizeof(uint64_t), symbolic_registers.size(), file) == symbolic_registers.size();
+		for (auto *list : {&pages, &cached_pages}) {
+			for (auto &it : *list) {
+				page_t &page = it.second;
+				success &= fwrite(&page.info, sizeof(page.info), 1, file) == 1;
+				success &= fwrite(page.bytes.data(), PAGE_SIZE, 1, file) == 1;
+				if (page.info.flags & RUN_SNAPSHOT_PAGE_TAINT) {
+					success &= fwrite(page.taint.data(), PAGE_SIZE, 1, file) == 1;
+				}
+			}
+		}
+		success &= fclose(file) == 0;
+		file = NULL;
+
+		if (success) {
+#ifdef _WIN32
+			remove(path.c_str());
+#endif
+			success = rename(temp_path.c_str(), path.c_str()) == 0;
+		}
+		if (!success) {
+			remove(temp_path.c_str());
+		}
+		return success;
+	}
+
+	bool read(const char *_path) {
+		FILE *f = fopen(_path, "rb");
+		if (f == NULL) {
+			return false;
+		}
+		fseek(f, 0, SEEK_END);
+		uint64_t size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		bool success = fread(&header, sizeof(header), 1, f) == 1 &&
+			header.magic == RUN_SNAPSHOT_MAGIC && header.version == RUN_SNAPSHOT_VERSION &&
+			header.registers <= size / sizeof(run_snapshot_register_t) &&
+			header.stops <= size / sizeof(uint64_t) &&
+			header.symbolic_registers <= size / sizeof(uint64_t) &&
+			header.pages <= size / PAGE_SIZE && header.cached_pages <= size / PAGE_SIZE;
+		if (success) {
+			registers.resize(header.registers);
+			stops.resize(header.stops);
+			symbolic_registers.resize(header.symbolic_registers);
+			success = fread(registers.data(), sizeof(run_snapshot_register_t), registers.size(), f) == registers.size() &&
+				fread(stops.data(), sizeof(uint64_t), stops.size(), f) == stops.size() &&
+				fread(symbolic_registers.data(), sizeof(uint64_t), symbolic_registers.size(), f) == symbolic_registers.size() &&
+				read_pages(f, header.pages, pages) && read_pages(f, header.cached_pages, cached_pages);
+		}
+		fclose(f);
+		return success;
+	}
+
+private:
+	std::string path, temp_path;
+	FILE *file; // the temporary file, while recording
+
+	static bool read_pages(FILE *f, uint64_t count, std::map<uint64_t, page_t> &out) {
+		for (uint64_t i = 0; i < count; i++) {
+			page_t page;
+			page.bytes.resize(PAGE_SIZE);
+			if (fread(&page.info, sizeof(page.info), 1, f) != 1 || fread(page.bytes.data(), PAGE_SIZE, 1, f) != 1) {
+				return false;
+			}
+			if (page.info.flags & RUN_SNAPSHOT_PAGE_TAINT) {
+				page.taint.resize(PAGE_SIZE);
+				if (fread(page.taint.data(), PAGE_SIZE, 1, f) != 1) {
+					return false;
+				}
+			}
+			out[page.info.address] = std::move(page);
+		}
+		return true;
+	}
+};
+
+/*
+ * read every register unicorn has for the architecture, in an order they can be
+ * written back in: the descriptor tables before the segment selectors on x86,
+ * and the cpsr before the banked registers on arm. amd64 keeps its segment bases
+ * in msrs, as angr sets them. returns false for architectures we don't know.
+ */
+static bool save_run_registers(uc_engine *uc, uc_arch arch, uc_mode mode, std::vector<run_snapshot_register_t> &out) {
+	std::vector<int> ids;
+	std::vector<uint32_t> msrs;
+	int last;
+	switch (arch) {
+		case UC_ARCH_X86:
+			ids = {UC_X86_REG_GDTR, UC_X86_REG_IDTR, UC_X86_REG_LDTR, UC_X86_REG_TR};
+			if (mode == UC_MODE_64) {
+				msrs = {0xC0000100, 0xC0000101}; // fs and gs base
+			}
+			last = UC_X86_REG_ENDING;
+			break;
+		case UC_ARCH_ARM:
+			ids = {UC_ARM_REG_CPSR};
+			last = UC_ARM_REG_ENDING;
+			break;
+		case UC_ARCH_ARM64:
+			last = UC_ARM64_REG_ENDING;
+			break;
+		case UC_ARCH_MIPS:
+			last = UC_MIPS_REG_ENDING;
+			break;
+		default:
+			return false;
+	}
+	size_t first = ids.size();
+	for (int id = 1; id < last; id++) {
+		if (std::find(ids.begin(), ids.begin() + first, id) != ids.begin() + first) {
+			continue;
+		}
+		if (arch == UC_ARCH_X86 && (id == UC_X86_REG_MSR || (mode == UC_MODE_64 &&
+				(id == UC_X86_REG_CS || id == UC_X86_REG_DS || id == UC_X86_REG_ES ||
+				 id == UC_X86_REG_FS || id == UC_X86_REG_GS || id == UC_X86_REG_SS)))) {
+			continue;
+		}
+		ids.push_back(id);
+	}
+
+	out.clear();
+	run_snapshot_register_t reg;
+	for (int id : ids) {
+		memset(&reg, 0, sizeof(reg));
+		reg.id = id;
+		if (uc_reg_read(uc, id, reg.value) == UC_ERR_OK) {
+			out.push_back(reg);
+		}
+	}
+	for (uint32_t msr : msrs) {
+		memset(&reg, 0, sizeof(reg));
+		reg.id = UC_X86_REG_MSR;
+		((uc_x86_msr *)reg.value)->rid = msr;
+		if (uc_reg_read(uc, UC_X86_REG_MSR, reg.value) == UC_ERR_OK) {
+			out.push_back(reg);
+		}
+	}
+	if (arch == UC_ARCH_ARM) {
+		// writing the pc leaves thumb mode unless its low bit is set
+		uint32_t cpsr = 0;
+		uc_reg_read(uc, UC_ARM_REG_CPSR, &cpsr);
+		for (auto &r : out) {
+			if (r.id == UC_ARM_REG_PC && (cpsr & 0x20)) {
+				r.value[0] |= 1;
+			}
+		}
+	}
+	return true;
+}
+
+typedef struct caches {
+	PageCache *page_cache;
+	BlockCache *block_cache;
+} caches_t;
+std::map<uint64_t, caches_t> global_cache;
+static std::mutex global_cache_lock;
+
+// libVEX keeps its IR in a single global arena, so only one thread may lift at a time.
+// angr takes it too, through simunicorn_lift_lock, whenever it lifts with pyvex
+static std::mutex vex_lift_lock;
+
+#define SPECULATIVE_QUEUE_SIZE 64
+#define SPECULATIVE_DEPTH 3 // successors of successors of ... of a block unicorn reached
+
+typedef struct speculative_job {
+	BlockCache *block_cache;
+	PageCache *page_cache;
+	VexArch guest;
+	VexArchInfo archinfo;
+	uint64_t address;
+	int depth;
+} speculative_job_t;
+
+/*
+ * lifts the constant successors of freshly lifted blocks on a background thread,
+ * so that first-touch code is usually checked by the time unicorn reaches it.
+ * only code in cached pages is lifted: those are read-only and the same for every
+ * State with the cache key. results wait in the BlockCache for check_block.
+ *
+ * lifts only happen while some native run is going on, and a run doesn't return
+ * to python before the lift in progress is over. off unless turned on.
+ */
+class SpeculativeLifter {
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<speculative_job_t> jobs;
+	std::thread worker;
+	bool enabled;
+	bool stopping;
+	bool lifting;
+	uint64_t runs; // native runs going on
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake.wait(guard, [this] { return stopping || (runs != 0 && !jobs.empty()); });
+			if (stopping) {
+				return;
+			}
+			speculative_job_t job = jobs.front();
+			jobs.pop_front();
+			lifting = true;
+			guard.unlock();
+			lift(job);
+			guard.lock();
+			lifting = false;
+			idle.notify_all();
+		}
+	}
+
+	void lift(const speculative_job_t &job); // needs State, see below
+
+public:
+	SpeculativeLifter() : enabled(false), stopping(false), lifting(false), runs(0) {}
+
+	~SpeculativeLifter() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+
+	void set_enabled(bool enable) {
+		std::lock_guard<std::mutex> guard(lock);
+		enabled = enable;
+		if (!enabled) {
+			jobs.clear();
+		}
+	}
+
+	void run_begin() {
+		std::lock_guard<std::mutex> guard(lock);
+		if (runs++ == 0 && !jobs.empty()) {
+			wake.notify_one();
+		}
+	}
+
+	// once the last run is over, wait for the lift in progress
+	void run_end() {
+		std::unique_lock<std::mutex> guard(lock);
+		if (--runs == 0) {
+			idle.wait(guard, [this] { return !lifting; });
+		}
+	}
+
+	// queue a block to lift, unless it is known already or the queue is full
+	void submit(const speculative_job_t &job) {
+		if (job.block_cache->known(job.address)) {
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		if (!enabled || stopping || jobs.size() >= SPECULATIVE_QUEUE_SIZE) {
+			return;
+		}
+		for (auto &queued : jobs) {
+			if (queued.address == job.address && queued.block_cache == job.block_cache) {
+				return;
+			}
+		}
+		if (!worker.joinable()) {
+			worker = std::thread(&SpeculativeLifter::run, this);
+		}
+		jobs.push_back(job);
+		wake.notify_one();
+	}
+};
+
+static SpeculativeLifter speculative_lifter;
+
+#define STOP_PAGE_BUCKETS 4096 // pages are hashed into this many presence bits
+
+/*
+ * the addresses to stop at, as a sorted vector. a bit per bucket of pages says
+ * whether any stop point may be on a page, so most blocks are let through after
+ * a single bit test, and only the rest pay for a binary search.
+ */
+class StopPointIndex {
+private:
+	std::vector<uint64_t> points; // sorted, no duplicates
+	std::unordered_set<uint64_t> mid_block;
+	uint32_t bucket_refs[STOP_PAGE_BUCKETS]; // stop points hashed to each bucket
+	uint64_t bucket_bits[STOP_PAGE_BUCKETS / 64];
+
+	static inline uint32_t bucket(uint64_t address) {
+		uint64_t page = address >> PAGE_SHIFT;
+		return (page ^ (page >> 12) ^ (page >> 24)) % STOP_PAGE_BUCKETS;
+	}
+
+	inline bool page_may_stop(uint64_t address) const {
+		uint32_t b = bucket(address);
+		return (bucket_bits[b / 64] >> (b % 64)) & 1;
+	}
+
+	void ref_bucket(uint64_t address, int delta) {
+		uint32_t b = bucket(address);
+		bucket_refs[b] += delta;
+		if (bucket_refs[b] != 0) {
+			bucket_bits[b / 64] |= 1ULL << (b % 64);
+		} else {
+			bucket_bits[b / 64] &= ~(1ULL << (b % 64));
+		}
+	}
+
+public:
+	StopPointIndex() {
+		clear();
+	}
+
+	void clear() {
+		points.clear();
+		mid_block.clear();
+		memset(bucket_refs, 0, sizeof(bucket_refs));
+		memset(bucket_bits, 0, sizeof(bucket_bits));
+	}
+
+	void assign(const uint64_t *addresses, uint64_t count) {
+		std::unordered_set<uint64_t> marked;
+		marked.swap(mid_block);
+		clear();
+		points.assign(addresses, addresses + count);
+		std::sort(points.begin(), points.end());
+		points.erase(std::unique(points.begin(), points.end()), points.end());
+		for (uint64_t address : points) {
+			ref_bucket(address, 1);
+			if (marked.count(address) > 0) {
+				mid_block.insert(address);
+			}
+		}
+	}
+
+	void add(uint64_t address) {
+		auto it = std::lower_bound(points.begin(), points.end(), address);
+		if (it == points.end() || *it != address) {
+			points.insert(it, address);
+			ref_bucket(address, 1);
+		}
+	}
+
+	void remove(uint64_t address) {
+		auto it = std::lower_bound(points.begin(), points.end(), address);
+		if (it != points.end() && *it == address) {
+			points.erase(it);
+			mid_block.erase(address);
+			ref_bucket(address, -1);
+		}
+	}
+
+	size_t size() const {
+		return points.size();
+	}
+
+	bool contains(uint64_t address) const {
+		return std::binary_search(points.begin(), points.end(), address);
+	}
+
+	// is there a stop point in [address, address + size)?
+	inline bool any_in(uint64_t address, uint32_t size) const {
+		uint64_t first;
+		return first_in(address, size, &first);
+	}
+
+	// the lowest stop point in [address, address + size), if any
+	inline bool first_in(uint64_t address, uint32_t size, uint64_t *first) const {
+		if (points.empty()) {
+			return false;
+		}
+		// a block spans at most two pages
+		uint64_t last = address + size - 1;
+		if (!page_may_stop(address) && !page_may_stop(last)) {
+			return false;
+		}
+		auto it = std::lower_bound(points.begin(), points.end(), address);
+		if (it == points.end() || *it > last) {
+			return false;
+		}
+		*first = *it;
+		return true;
+	}
+
+	/*
+	 * stop points seen in the middle of a block get an instruction hook of their
+	 * own. the mark goes with the stop point.
+	 */
+	void mark_mid_block(uint64_t address) {
+		mid_block.insert(address);
+	}
+
+	const std::vector<uint64_t> &addresses() const {
+		return points;
+	}
+
+	// the current stop points that need an instruction hook
+	const std::unordered_set<uint64_t> &hooked_points() const {
+		return mid_block;
+	}
+};
+
+/*
+ * stop points outlive the State they were set on: python allocates a State per
+ * run on a reused engine, and only sends the changes to the stop points. an
+ * engine's entry goes away with simunicorn_engine_closed.
+ */
+static std::unordered_map<uc_engine *, std::shared_ptr<StopPointIndex>> engine_stop_points;
+static std::mutex engine_stop_points_lock;
+
+static void release_stop_points(uc_engine *uc) {
+	std::lock_guard<std::mutex> guard(engine_stop_points_lock);
+	engine_stop_points.erase(uc);
+}
+
+#define TRACE_CHUNK_SIZE 0x10000
+#define TRACE_TAIL_SIZE 64 // entries kept unencoded in TRACE_COMPRESSED, so rollback can drop them
+
+/*
+ * the addresses or stack pointers of the blocks executed in a run. in
+ * TRACE_COMPRESSED, each entry is stored as the zigzag varint of its difference
+ * from the one before, which takes a byte or two for blocks of the same binary.
+ */
+class TraceBuffer {
+private:
+	trace_mode_t mode;
+	std::vector<uint64_t> entries; // all of them, the ring, or the unencoded tail
+	size_t ring_capacity;
+	size_t ring_start;
+	size_t ring_count;
+	uint64_t dropped; // oldest entries overwritten in the ring
+
+	std::vector<std::unique_ptr<uint8_t[]>> chunks;
+	std::vector<uint32_t> chunk_used;
+	uint64_t encoded_count;
+	uint64_t last_encoded;
+
+	std::vector<uint64_t> decoded; // backs data() in the modes that don't keep a flat array
+
+	void encode(uint64_t value) {
+		if (chunks.empty() || chunk_used.back() + 10 > TRACE_CHUNK_SIZE) {
+			chunks.emplace_back(new uint8_t[TRACE_CHUNK_SIZE]);
+			chunk_used.push_back(0);
+		}
+		int64_t delta = (int64_t)(value - last_encoded);
+		uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+		uint8_t *out = chunks.back().get() + chunk_used.back();
+		int length = 0;
+		while (zigzag >= 0x80) {
+			out[length++] = (uint8_t)zigzag | 0x80;
+			zigzag >>= 7;
+		}
+		out[length++] = (uint8_t)zigzag;
+		chunk_used.back() += length;
+		last_encoded = value;
+		encoded_count++;
+	}
+
+public:
+	TraceBuffer() {
+		configure(TRACE_FULL, 0);
+	}
+
+	// pick a mode, dropping everything recorded so far. capacity is the ring size
+	void configure(trace_mode_t _mode, size_t capacity) {
+		mode = _mode;
+		ring_capacity = mode == TRACE_RING ? std::max<size_t>(capacity, 1) : 0;
+		clear();
+	}
+
+	trace_mode_t get_mode() const {
+		return mode;
+	}
+
+	size_t get_capacity() const {
+		return ring_capacity;
+	}
+
+	void clear() {
+		entries.clear();
+		if (mode == TRACE_RING) {
+			entries.resize(ring_capacity);
+		}
+		ring_start = ring_count = 0;
+		dropped = 0;
+		chunks.clear();
+		chunk_used.clear();
+		encoded_count = 0;
+		last_encoded = 0;
+		decoded.clear();
+	}
+
+	inline void push_back(uint64_t value) {
+		switch (mode) {
+			case TRACE_FULL:
+				entries.push_back(value);
+				break;
+			case TRACE_RING:
+				if (ring_count < ring_capacity) {
+					entries[(ring_start + ring_count) % ring_capacity] = value;
+					ring_count++;
+				} else {
+					entries[ring_start] = value;
+					ring_start = (ring_start + 1) % ring_capacity;
+					dropped++;
+				}
+				break;
+			case TRACE_COMPRESSED:
+				entries.push_back(value);
+				if (entries.size() == TRACE_TAIL_SIZE) {
+					for (size_t i = 0; i < TRACE_TAIL_SIZE / 2; i++) {
+						encode(entries[i]);
+					}
+					entries.erase(entries.begin(), entries.begin() + TRACE_TAIL_SIZE / 2);
+				}
+				break;
+		}
+	}
+
+	// drop the newest entry. entries already overwritten or encoded stay
+	inline void pop_back() {
+		if (mode == TRACE_RING) {
+			if (ring_count > 0) {
+				ring_count--;
+			}
+		} else if (!entries.empty()) {
+			entries.pop_back();
+		}
+	}
+
+	// entries that can still be read back
+	uint64_t size() const {
+		if (mode == TRACE_RING) {
+			return ring_count;
+		}
+		return encoded_count + entries.size();
+	}
+
+	// entries recorded, including the ones the ring dropped
+	uint64_t total() const {
+		return size() + dropped;
+	}
+
+	// copy up to max entries, oldest first. returns how many were copied
+	uint64_t decode(uint64_t *out, uint64_t max) const {
+		uint64_t count = 0;
+		switch (mode) {
+			case TRACE_FULL:
+				count = std::min<uint64_t>(max, entries.size());
+				std::copy(entries.begin(), entries.begin() + count, out);
+				break;
+			case TRACE_RING:
+				for (; count < max && count < ring_count; count++) {
+					out[count] = entries[(ring_start + count) % ring_capacity];
+				}
+				break;
+			case TRACE_COMPRESSED: {
+				uint64_t value = 0;
+				for (size_t chunk = 0; chunk < chunks.size() && count < max; chunk++) {
+					const uint8_t *in = chunks[chunk].get();
+					const uint8_t *end = in + chunk_used[chunk];
+					while (in < end && count < max) {
+						uint64_t zigzag = 0;
+						int shift = 0;
+						do {
+							zigzag |= (uint64_t)(*in & 0x7F) << shift;
+							shift += 7;
+						} while (*in++ & 0x80);
+						value += (uint64_t)((zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+						out[count++] = value;
+					}
+				}
+				for (size_t i = 0; i < entries.size() && count < max; i++) {
+					out[count++] = entries[i];
+				}
+				break;
+			}
+		}
+		return count;
+	}
+
+	// all readable entries as one array, valid until the next change
+	const uint64_t *data() {
+		if (mode == TRACE_FULL) {
+			return entries.data();
+		}
+		decoded.resize(size());
+		decode(decoded.data(), decoded.size());
+		return decoded.data();
+	}
+
+	size_t memory_used() const {
+		return entries.capacity() * sizeof(uint64_t) + chunks.size() * TRACE_CHUNK_SIZE;
+	}
+};
+
+#define TRACE_FILE_MAGIC 0x31465453 // "STF1"
+#define TRACE_FILE_VERSION 1
+#define TRACE_SINK_MAX_PENDING 64 // chunks waiting for the writer before more are dropped
+
+typedef enum trace_event {
+	TRACE_EVENT_BLOCK = 0, // a block was executed
+	TRACE_EVENT_STACK,     // the stack pointer at the start of that block
+	TRACE_EVENT_PAGE,      // the first block on a page this run comes next
+} trace_event_t;
+
+typedef struct trace_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunk_size; // largest payload of a chunk
+	uint32_t reserved;
+} trace_file_header_t;
+
+/*
+ * the events of one run are split into chunks, each decodable on its own. chunks
+ * of different runs may interleave in the file, but those of a run are in order.
+ */
+typedef struct trace_chunk_header {
+	uint32_t size; // of the payload that follows
+	uint32_t events;
+	uint64_t run;
+	uint32_t sequence; // of the chunk within its run
+	uint32_t reserved;
+} trace_chunk_header_t;
+
+typedef struct trace_chunk {
+	struct trace_chunk *next;
+	trace_chunk_header_t header;
+	uint8_t payload[TRACE_CHUNK_SIZE];
+} trace_chunk_t;
+
+// write out all of buffer, through short and interrupted writes
+static bool write_all(int fd, const void *buffer, size_t size) {
+#ifdef _WIN32
+	return false;
+#else
+	const uint8_t *bytes = (const uint8_t *)buffer;
+	while (size > 0) {
+		ssize_t written = write(fd, bytes, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return true;
+#endif
+}
+
+/*
+ * streams the traces of every run to a file. producers hand over full chunks,
+ * never waiting on the writer, and a background thread writes them out. the only
+ * lock they take is held for one push, once per chunk.
+ */
+class TraceSink {
+private:
+	int fd;
+	std::atomic<trace_chunk_t *> published; // newest first
+	std::atomic<uint64_t> pending;
+	std::atomic<uint64_t> next_run;
+	std::atomic<bool> closing;
+	std::atomic<bool> failed;
+	std::mutex wake_lock;
+	std::condition_variable wake;
+	std::thread writer;
+
+	void write_chunks(trace_chunk_t *chunks) {
+		// the list is newest first; reverse it so a run's chunks stay in order
+		trace_chunk_t *ordered = NULL;
+		while (chunks != NULL) {
+			trace_chunk_t *next = chunks->next;
+			chunks->next = ordered;
+			ordered = chunks;
+			chunks = next;
+		}
+		while (ordered != NULL) {
+			trace_chunk_t *next = ordered->next;
+			if (!failed && !write_all(fd, &ordered->header, sizeof(trace_chunk_header_t) + ordered->header.size)) {
+				fprintf(stderr, "failed writing the trace file, dropping the rest of the trace.\n");
+				failed = true;
+			}
+			delete ordered;
+			pending--;
+			ordered = next;
+		}
+	}
+
+	void run() {
+		while (true) {
+			bool done = closing;
+			write_chunks(published.exchange(NULL));
+			if (done) {
+				break;
+			}
+			std::unique_lock<std::mutex> guard(wake_lock);
+			wake.wait(guard, [&]{ return closing || published != NULL; });
+		}
+	}
+
+public:
+	TraceSink() : fd(-1), published(NULL), pending(0), next_run(0), closing(false), failed(false) {}
+
+	~TraceSink() {
+		if (writer.joinable()) {
+			{
+				std::lock_guard<std::mutex> guard(wake_lock);
+				closing = true;
+			}
+			wake.notify_one();
+			writer.join();
+		}
+#ifndef _WIN32
+		if (fd != -1) {
+			close(fd);
+		}
+#endif
+	}
+
+	bool open(const char *path) {
+#ifdef _WIN32
+		return false;
+#else
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			return false;
+		}
+		trace_file_header_t header = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION, TRACE_CHUNK_SIZE, 0};
+		if (!write_all(fd, &header, sizeof(header))) {
+			return false;
+		}
+		writer = std::thread(&TraceSink::run, this);
+		return true;
+#endif
+	}
+
+	uint64_t new_run() {
+		return next_run++;
+	}
+
+	// hand chunk to the writer. if it is too far behind, the chunk is dropped and false is returned
+	bool publish(trace_chunk_t *chunk) {
+		if (pending.fetch_add(1) >= TRACE_SINK_MAX_PENDING) {
+			// waiting here would hold up emulation, and chunks decode on their own
+			pending--;
+			delete chunk;
+			return false;
+		}
+		{
+			// under wake_lock, so the writer can't miss it between checking for chunks and going to sleep
+			std::lock_guard<std::mutex> guard(wake_lock);
+			chunk->next = published.load(std::memory_order_relaxed);
+			while (!published.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed));
+		}
+		wake.notify_one();
+		return true;
+	}
+};
+
+static std::shared_ptr<TraceSink> trace_sink;
+static std::mutex trace_sink_lock;
+
+static std::shared_ptr<TraceSink> current_trace_sink() {
+	std::lock_guard<std::mutex> guard(trace_sink_lock);
+	return trace_sink;
+}
+
+/*
+ * the producer side of a TraceSink for one State. events go into a chunk only this
+ * State touches, as zigzag varint deltas from the previous event of their kind.
+ * the latest block is held back until the next one, so that rollback can drop it
+ * the same way it does from bbl_addrs.
+ */
+class TraceStream {
+private:
+	std::shared_ptr<TraceSink> sink;
+	trace_chunk_t *chunk;
+	uint64_t run;
+	uint32_t sequence;
+	uint64_t last[3];
+	bool has_pending;
+	uint64_t pending_block, pending_stack;
+
+	void emit(trace_event_t kind, uint64_t value) {
+		if (chunk != NULL && chunk->header.size + 11 > TRACE_CHUNK_SIZE) {
+			flush();
+		}
+		if (chunk == NULL) {
+			chunk = new trace_chunk_t;
+			chunk->header.size = chunk->header.events = 0;
+			chunk->header.run = run;
+			chunk->header.sequence = sequence++;
+			chunk->header.reserved = 0;
+			memset(last, 0, sizeof(last));
+		}
+
+		// the low two bits of the first byte are the kind, the rest carry the delta
+		int64_t delta = (int64_t)(value - last[kind]);
+		uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+		uint8_t *out = chunk->payload + chunk->header.size;
+		int length = 0;
+		uint8_t byte = (uint8_t)(kind | (zigzag & 0x1F) << 2);
+		zigzag >>= 5;
+		while (zigzag != 0) {
+			out[length++] = byte | 0x80;
+			byte = zigzag & 0x7F;
+			zigzag >>= 7;
+		}
+		out[length++] = byte;
+		chunk->header.size += length;
+		chunk->header.events++;
+		last[kind] = value;
+	}
+
+	void flush() {
+		if (chunk != NULL) {
+			if (!sink->publish(chunk)) {
+				dropped++;
+			}
+			chunk = NULL;
+		}
+	}
+
+public:
+	uint64_t dropped; // chunks of this run the sink had no room for
+
+	TraceStream() : chunk(NULL), run(0), sequence(0), has_pending(false), dropped(0) {}
+
+	~TraceStream() {
+		finish();
+	}
+
+	bool active() const {
+		return sink != nullptr;
+	}
+
+	// start a run, streaming to the current sink if there is one
+	void begin() {
+		finish();
+		sink = current_trace_sink();
+		dropped = 0;
+		if (sink) {
+			run = sink->new_run();
+			sequence = 0;
+		}
+	}
+
+	inline void block(uint64_t address, uint64_t stack_pointer) {
+		commit_block();
+		has_pending = true;
+		pending_block = address;
+		pending_stack = stack_pointer;
+	}
 
-#define MAX_REG_SIZE 0x2000 // hope it's big enough
+	inline void page(uint64_t address) {
+		emit(TRACE_EVENT_PAGE, address);
+	}
 
-// Maximum size of a qemu/unicorn basic block
-// See State::step for why this is necessary
-static const uint32_t MAX_BB_SIZE = 800;
+	// the latest block is done, even if rollback comes next
+	inline void commit_block() {
+		if (has_pending) {
+			emit(TRACE_EVENT_BLOCK, pending_block);
+			emit(TRACE_EVENT_STACK, pending_stack);
+			has_pending = false;
+		}
+	}
 
-extern "C" void x86_reg_update(uc_engine *uc, uint8_t *buf, int save);
-extern "C" void mips_reg_update(uc_engine *uc, uint8_t *buf, int save);
+	// forget the latest block, which was rolled back
+	inline void drop_block() {
+		has_pending = false;
+	}
 
-typedef enum taint: uint8_t {
-	TAINT_NONE = 0,
-	TAINT_DIRTY = 1,
-	TAINT_SYMBOLIC = 2,
-} taint_t;
+	// hand whatever this run recorded to the writer
+	void finish() {
+		if (sink) {
+			flush();
+			sink.reset();
+		}
+		has_pending = false;
+	}
+};
 
-typedef enum stop {
-	STOP_NORMAL=0,
-	STOP_STOPPOINT,
-	STOP_SYMBOLIC_MEM,
-	STOP_SYMBOLIC_REG,
-	STOP_ERROR,
-	STOP_SYSCALL,
-	STOP_EXECNONE,
-	STOP_ZEROPAGE,
-	STOP_NOSTART,
-	STOP_SEGFAULT,
-	STOP_ZERO_DIV,
-	STOP_NODECODE,
-	STOP_HLT,
-} stop_t;
+typedef struct profile_block {
+	uint64_t address;
+	uint64_t executions;
+	uint64_t instructions; // executed in the block, or 0 if VEX could not count them
+	uint64_t stops[STOP_REASONS]; // runs that ended in the block, by stop_t
+} profile_block_t;
 
-typedef struct block_entry {
-	bool try_unicorn;
-	std::unordered_set<uint64_t> used_registers;
-	std::unordered_set<uint64_t> clobbered_registers;
-} block_entry_t;
+typedef struct run_profile_block {
+	profile_block_t counts;
+	uint32_t instructions; // per execution
+} run_profile_block_t;
 
-typedef struct CachedPage {
-	size_t size;
-	uint8_t *bytes;
-	uint64_t perms;
-} CachedPage;
+/*
+ * execution counts of every block run while profiling is on, across all States.
+ * each State counts its run on its own and merges it in when the run is over.
+ */
+class Profile {
+private:
+	std::mutex lock;
+	std::unordered_map<uint64_t, profile_block_t> blocks;
 
-typedef taint_t PageBitmap[PAGE_SIZE];
-typedef std::map<uint64_t, CachedPage> PageCache;
-typedef std::unordered_map<uint64_t, block_entry_t> BlockCache;
-typedef struct caches {
-	PageCache *page_cache;
-	BlockCache *block_cache;
-} caches_t;
-std::map<uint64_t, caches_t> global_cache;
+public:
+	std::atomic<bool> enabled;
+
+	Profile() : enabled(false) {}
+
+	void merge(const std::unordered_map<uint64_t, run_profile_block_t> &run) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto &it : run) {
+			const profile_block_t &counts = it.second.counts;
+			auto inserted = blocks.insert(std::make_pair(it.first, counts));
+			if (inserted.second) {
+				continue;
+			}
+			profile_block_t &block = inserted.first->second;
+			block.executions += counts.executions;
+			block.instructions += counts.instructions;
+			for (int i = 0; i < STOP_REASONS; i++) {
+				block.stops[i] += counts.stops[i];
+			}
+		}
+	}
 
-typedef std::unordered_set<uint64_t> RegisterSet;
+	void reset() {
+		std::lock_guard<std::mutex> guard(lock);
+		blocks.clear();
+	}
+
+	uint64_t size() {
+		std::lock_guard<std::mutex> guard(lock);
+		return blocks.size();
+	}
+
+	// copy up to max blocks out, in no particular order. returns how many were copied
+	uint64_t dump(profile_block_t *out, uint64_t max) {
+		std::lock_guard<std::mutex> guard(lock);
+		uint64_t count = 0;
+		for (auto it = blocks.begin(); it != blocks.end() && count < max; it++) {
+			out[count++] = it->second;
+		}
+		return count;
+	}
+};
+
+static Profile profile;
 
-typedef struct mem_access {
+// spans of a page saved per block before the rest of its writes are covered by saving the whole page
+#define UNDO_SPANS_PER_PAGE 8
+
+/*
+ * bytes of a page from before the current block wrote them, and their taint,
+ * saved in the undo arena. a span saves just the bytes of one write. a page
+ * written to often is saved whole, and its later writes only widen [lo, hi].
+ */
+typedef struct undo_span {
+	uint64_t page;
+	size_t offset; // in words, of the saved bytes in the arena, then of their packed taint
+	int saved_lo, saved_hi; // bytes saved
+	int lo, hi; // bytes to put back, within those
+} undo_span_t;
+
+// words of undo arena holding bytes [lo, hi] of a page
+static inline size_t undo_byte_words(int lo, int hi) {
+	return (hi - lo + 8) / 8;
+}
+
+// a page written during the current block
+typedef struct undo_page {
+	uint64_t page;
+	int spans; // saved for it
+	int whole; // the span saving the whole page, -1 until there is one
+} undo_page_t;
+
+// a write to a page that was not mapped yet, so there was nothing to save
+typedef struct pending_write {
 	uint64_t address;
-	uint8_t value[8]; // assume size of any memory write is no more than 8
 	int size;
-	int clean; // save current page bitmap
-} mem_access_t; // actually it should be `mem_write_t` :)
+} pending_write_t;
 
 typedef struct mem_update {
 	uint64_t address, length;
 	struct mem_update *next;
 } mem_update_t;
 
+typedef struct sync_header {
+	uint64_t count; // number of sync_range_t that follow
+	uint64_t size; // of the whole buffer
+} sync_header_t;
+
+typedef struct sync_range {
+	uint64_t address, length;
+	uint64_t offset; // of the range's bytes from the start of the buffer
+} sync_range_t;
+
 typedef struct transmit_record {
 	void *data;
 	uint32_t count;
 } transmit_record_t;
 
+class State;
+
+typedef enum batch_status {
+	BATCH_PENDING = 0, // not started before the deadline
+	BATCH_FINISHED,
+	BATCH_CANCELLED, // stopped by the deadline, with STOP_NORMAL as if out of steps
+} batch_status_t;
+
+// a run for simunicorn_run_batch, which fills in err and status
+typedef struct batch_run {
+	State *state;
+	uint64_t pc;
+	uint64_t step;
+	uc_err err; // what State::start returned
+	batch_status_t status;
+} batch_run_t;
+
 // These prototypes may be found in <unicorn/unicorn.h> by searching for "Callback"
 static void hook_mem_read(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
 static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
 static bool hook_mem_unmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
 static bool hook_mem_prot(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
 static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user_data);
+static void hook_stop_point(uc_engine *uc, uint64_t address, uint32_t size, void *user_data);
 static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data);
 
 class State {
 private:
 	uc_engine *uc;
+	uint64_t cache_key;
 	PageCache *page_cache;
 	BlockCache *block_cache;
 	bool hooked;
 
 	uc_context *saved_regs;
 
-	std::vector<mem_access_t> mem_writes;
-	std::map<uint64_t, taint_t *> active_pages;
-	std::set<uint64_t> stop_points;
+	// undo journal for the current block
+	std::vector<undo_span_t> undo_spans;
+	std::vector<undo_page_t> undo_pages;
+	std::vector<uint64_t> undo_arena; // reused from block to block
+	size_t undo_arena_used; // words
+	std::vector<pending_write_t> pending_writes;
+	std::vector<uint64_t> dirty_pages; // every active page with dirty bytes
+	std::vector<sync_range_t> sync_ranges;
+	std::vector<uint8_t> sync_buffer;
+	PageTable<PageBitmap> active_pages;
+	std::shared_ptr<StopPointIndex> stop_points; // shared with every State on our engine
+	std::shared_ptr<MappedPages> mapped_pages; // likewise
+	std::unordered_map<uint64_t, uc_hook> stop_point_hooks; // instruction hooks on stop points inside blocks
+	bool restarting; // the current block is to run again, from a translation with restart_point hooked
+	uint64_t restart_point;
+	uint64_t last_data_page, last_data_page_epoch;
+	std::vector<uint8_t> lift_buffer;
+	TraceStream trace_stream;
+
+	// AFL-style edge coverage, counted into a map owned by the caller
+	uint8_t *coverage_map;
+	uint64_t coverage_mask;
+	uint64_t coverage_prev; // location of the previous block, shifted
+	uint64_t coverage_edge, coverage_edge_prev; // the latest block's edge, so that rollback can take it back
+	bool coverage_pending;
+
+	// this run's share of the profile
+	bool profiling;
+	std::unordered_map<uint64_t, run_profile_block_t> run_profile;
+	run_profile_block_t *profile_pending; // the latest block, so that rollback can take it back
+	uint64_t profile_last_block;
+
+	// the next run, recorded for native/replay. see record_run
+	std::unique_ptr<RunSnapshot> run_snapshot;
+	bool recording_run;
+
+	// a run started by start_async, on a thread of its own
+	std::thread async_thread;
+	std::mutex async_lock;
+	std::condition_variable async_wake;
+	bool async_running;
+	uc_err async_result;
+	std::atomic<bool> async_cancel;
 
 public:
-	std::vector<uint64_t> bbl_addrs;
-	std::vector<uint64_t> stack_pointers;
+	TraceBuffer bbl_addrs;
+	TraceBuffer stack_pointers;
 	std::unordered_set<uint64_t> executed_pages;
 	std::unordered_set<uint64_t>::iterator *executed_pages_iterator;
 	uint64_t syscall_count;
+	uint64_t smc_count; // writes that hit a page with cached blocks
+	stats_t stats;
 	std::vector<transmit_record_t> transmit_records;
 	uint64_t cur_steps, max_steps;
 	uc_hook h_read, h_write, h_block, h_prot, h_unmap, h_intr;
@@ -142,26 +2927,52 @@ public:
 	VexArch vex_guest;
 	VexArchInfo vex_archinfo;
 	RegisterSet symbolic_registers; // tracking of symbolic registers
+	std::vector<uint64_t> untracked_registers; // symbolic register bytes past MAX_REG_SIZE
 
 	bool track_bbls;
 	bool track_stack;
 
-	State(uc_engine *_uc, uint64_t cache_key):uc(_uc)
+	const std::atomic<bool> *cancel; // stops the run at the next block once set. see simunicorn_run_batch
+	bool cancelled; // the last run was stopped by cancel
+
+	State(uc_engine *_uc, uint64_t cache_key):uc(_uc), cache_key(cache_key)
 	{
 		hooked = false;
 		h_read = h_write = h_block = h_prot = 0;
+		undo_arena_used = 0;
 		max_steps = cur_steps = 0;
 		stopped = true;
 		stop_reason = STOP_NOSTART;
 		ignore_next_block = false;
 		ignore_next_selfmod = false;
+		restarting = false;
+		restart_point = 0;
+		track_bbls = false;
+		track_stack = false;
+		cancel = NULL;
+		cancelled = false;
 		interrupt_handled = false;
 		transmit_sysno = -1;
 		vex_guest = VexArch_INVALID;
 		syscall_count = 0;
+		smc_count = 0;
+		memset(&stats, 0, sizeof(stats));
+		last_data_page = 1; // never a page address
+		last_data_page_epoch = 0;
+		coverage_map = NULL;
+		coverage_mask = coverage_prev = coverage_edge = coverage_edge_prev = 0;
+		coverage_pending = false;
+		profiling = false;
+		profile_pending = NULL;
+		profile_last_block = 0;
+		recording_run = false;
+		async_running = false;
+		async_result = UC_ERR_OK;
+		async_cancel = false;
 		uc_context_alloc(uc, &saved_regs);
 		executed_pages_iterator = NULL;
 
+		std::unique_lock<std::mutex> cache_guard(global_cache_lock);
 		auto it = global_cache.find(cache_key);
 		if (it == global_cache.end()) {
 			page_cache = new PageCache();
@@ -171,10 +2982,138 @@ public:
 			page_cache = it->second.page_cache;
 			block_cache = it->second.block_cache;
 		}
+		cache_guard.unlock();
+
+		{
+			std::lock_guard<std::mutex> guard(engine_stop_points_lock);
+			std::shared_ptr<StopPointIndex> &index = engine_stop_points[uc];
+			if (!index) {
+				index.reset(new StopPointIndex());
+			}
+			stop_points = index;
+		}
+		mapped_pages = get_mapped_pages(uc);
 		arch = *((uc_arch*)uc); // unicorn hides all its internals...
 		mode = *((uc_mode*)((uc_arch*)uc + 1));
+		active_pages.init(arch_address_bits());
 	}
 	
+	uc_engine *engine() const {
+		return uc;
+	}
+
+	State *fork(uc_engine *child_uc) {
+		State *child = new State(child_uc, cache_key);
+		if (!fork_into(child)) {
+			delete child;
+			return NULL;
+		}
+		return child;
+	}
+
+	/*
+	 * turn child, a new State on a fresh engine of the same architecture, into a
+	 * copy of us. taint bitmaps are shared until either side changes them.
+	 * unicorn cannot share guest RAM between engines, so memory is copied region
+	 * by region, as our engine has it mapped; only read-only pages still holding
+	 * the cached bytes we mapped them with are mapped from the same shared bytes.
+	 * the results of our last run (bbl_addrs etc.) are not copied.
+	 */
+	bool fork_into(State *child) {
+		if (child->arch != arch || child->mode != mode || child->active_pages.size() != 0) {
+			return false;
+		}
+
+		// registers
+		uc_context *context;
+		if (uc_context_alloc(uc, &context) != UC_ERR_OK) {
+			return false;
+		}
+		uc_context_save(uc, context);
+		uc_context_restore(child->uc, context);
+		uc_context_save(child->uc, child->saved_regs);
+		uc_free(context);
+
+		// memory
+		uc_mem_region *regions;
+		uint32_t count;
+		if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+			return false;
+		}
+		std::unordered_map<uint64_t, PageData *> cached;
+		{
+			std::lock_guard<std::mutex> guard(mapped_pages->lock);
+			for (auto &page : mapped_pages->pages) {
+				page.second->acquire();
+				cached.insert(page);
+			}
+		}
+		bool success = true;
+		std::vector<uint8_t> buffer;
+		uint8_t current[PAGE_SIZE];
+		for (uint32_t i = 0; i < count; i++) {
+			uint64_t end = regions[i].end + 1;
+			uint32_t perms = regions[i].perms;
+			uint64_t run = regions[i].begin; // start of the pages to copy
+			for (uint64_t page = regions[i].begin; page <= end; page += PAGE_SIZE) {
+				PageData *shared = NULL;
+				if (page < end && !(perms & UC_PROT_WRITE)) {
+					auto hit = cached.find(page);
+					if (hit != cached.end() && uc_mem_read(uc, page, current, PAGE_SIZE) == UC_ERR_OK &&
+							memcmp(current, hit->second->bytes, PAGE_SIZE) == 0) {
+						shared = hit->second;
+					}
+				}
+				if (page < end && shared == NULL) {
+					continue;
+				}
+				if (page > run) {
+					buffer.resize(page - run);
+					success &= uc_mem_map(child->uc, run, page - run, perms) == UC_ERR_OK &&
+						uc_mem_read(uc, run, buffer.data(), page - run) == UC_ERR_OK &&
+						uc_mem_write(child->uc, run, buffer.data(), page - run) == UC_ERR_OK;
+				}
+				if (shared != NULL) {
+					// unicorn never writes to pages mapped without UC_PROT_WRITE
+					if (uc_mem_map_ptr(child->uc, page, PAGE_SIZE, perms, (uint8_t *)shared->bytes) == UC_ERR_OK) {
+						shared->acquire();
+						child->note_mapped(page, shared);
+					} else {
+						success = false;
+					}
+				}
+				run = page + PAGE_SIZE;
+			}
+		}
+		uc_free(regions);
+		for (auto &page : cached) {
+			page_store.put(page.second);
+		}
+
+		// taint
+		active_pages.for_each([&](uint64_t page, PageBitmap *bitmap) {
+			bitmap->acquire();
+			child->active_pages.insert(page, bitmap);
+		});
+		child->dirty_pages = dirty_pages;
+
+		// settings
+		*child->stop_points = *stop_points;
+		child->symbolic_registers = symbolic_registers;
+		child->untracked_registers = untracked_registers;
+		child->vex_guest = vex_guest;
+		child->vex_archinfo = vex_archinfo;
+		child->track_bbls = track_bbls;
+		child->track_stack = track_stack;
+		child->bbl_addrs.configure(bbl_addrs.get_mode(), bbl_addrs.get_capacity());
+		child->stack_pointers.configure(stack_pointers.get_mode(), stack_pointers.get_capacity());
+		child->transmit_sysno = transmit_sysno;
+		child->transmit_bbl_addr = transmit_bbl_addr;
+		child->coverage_map = coverage_map;
+		child->coverage_mask = coverage_mask;
+		return success;
+	}
+
 	/*
 	 * HOOK_MEM_WRITE is called before checking if the address is valid. so we might
 	 * see uninitialized pages. Using HOOK_MEM_PROT is too late for tracking taint.
@@ -182,7 +3121,7 @@ public:
 	 */
 	void hook() {
 		if (hooked) {
-			//LOG_D("already hooked");
+			LOG_D("already hooked");
 			return ;
 		}
 		uc_err err;
@@ -199,6 +3138,7 @@ public:
 		err = uc_hook_add(uc, &h_intr, UC_HOOK_INTR, (void *)hook_intr, this, 1, 0);
 
 		hooked = true;
+		sync_stop_point_hooks();
 	}
 
 	void unhook() {
@@ -212,52 +3152,163 @@ public:
 		err = uc_hook_del(uc, h_prot);
 		err = uc_hook_del(uc, h_unmap);
 		err = uc_hook_del(uc, h_intr);
+		for (auto &hook : stop_point_hooks) {
+			err = uc_hook_del(uc, hook.second);
+		}
+		stop_point_hooks.clear();
 
 		hooked = false;
 		h_read = h_write = h_block = h_prot = h_unmap = 0;
 	}
 
 	~State() {
-		for (auto it = active_pages.begin(); it != active_pages.end(); it++) {
-			// only poor guys consider about memory leak :(
-			//LOG_D("delete active page %#lx", it->first);
-			// delete should use the bracket operator since PageBitmap is an array typedef
-			delete[] it->second;
+		if (async_thread.joinable()) {
+			cancel_async();
+			async_thread.join();
 		}
+		active_pages.for_each([](uint64_t address, PageBitmap *bitmap) {
+			// only poor guys consider about memory leak :(
+			//LOG_D("delete active page %#lx", address);
+			bitmap->release();
+		});
 		active_pages.clear();
 		uc_free(saved_regs);
 	}
 
+	/*
+	 * start() on a thread of its own, returning right away. returns false if the
+	 * last run started this way is still going.
+	 */
+	bool start_async(uint64_t pc, uint64_t step) {
+		{
+			std::lock_guard<std::mutex> guard(async_lock);
+			if (async_running) {
+				return false;
+			}
+			async_running = true;
+		}
+		if (async_thread.joinable()) {
+			async_thread.join();
+		}
+		async_cancel = false;
+		cancel = &async_cancel;
+		async_thread = std::thread([this, pc, step] {
+			uc_err result = start(pc, step);
+			cancel = NULL;
+			std::lock_guard<std::mutex> guard(async_lock);
+			async_result = result;
+			async_running = false;
+			async_wake.notify_all();
+		});
+		return true;
+	}
+
+	/*
+	 * wait up to timeout_ms (forever if negative) for the run started by
+	 * start_async to end. returns whether it has, with what start() returned in
+	 * result. only one thread may wait at a time.
+	 */
+	bool wait_async(int64_t timeout_ms, uc_err *result) {
+		std::unique_lock<std::mutex> guard(async_lock);
+		auto over = [this] { return !async_running; };
+		if (timeout_ms < 0) {
+			async_wake.wait(guard, over);
+		} else if (!async_wake.wait_for(guard, std::chrono::milliseconds(timeout_ms), over)) {
+			return false;
+		}
+		if (result != NULL) {
+			*result = async_result;
+		}
+		guard.unlock();
+		if (async_thread.joinable()) {
+			async_thread.join();
+		}
+		return true;
+	}
+
+	// stop the run started by start_async at its next block, as if it ran out of steps
+	void cancel_async() {
+		async_cancel = true;
+	}
+
 	uc_err start(uint64_t pc, uint64_t step = 1) {
 		stopped = false;
 		stop_reason = STOP_NOSTART;
 		max_steps = step;
 		cur_steps = -1;
 		executed_pages.clear();
+		restarting = false;
+		cancelled = false;
 
 		// error if pc is 0
 		// TODO: why is this check here and not elsewhere
 		if (pc == 0) {
 			stop_reason = STOP_ZEROPAGE;
+			stats.stops[STOP_ZEROPAGE]++;
 			cur_steps = 0;
 			return UC_ERR_MAP;
 		}
 
+		trace_stream.begin();
+		coverage_prev = 0;
+		coverage_pending = false;
+		profiling = profile.enabled;
+		profile_pending = NULL;
+		profile_last_block = pc;
+		if (run_snapshot) {
+			record_run_begin(pc, step);
+		}
+		speculative_lifter.run_begin();
 		uc_err out = uc_emu_start(uc, pc, 0, 0, 0);
+		while (out == UC_ERR_OK && restarting) {
+			// back to the start of the block, which commits (and counts) it again
+			restarting = false;
+			rollback();
+			cur_steps--;
+			if (track_stack) {
+				stack_pointers.pop_back();
+			}
+			stopped = false;
+			flush_translation(restart_point);
+			uint64_t resume = get_instruction_pointer();
+			if (arch == UC_ARCH_ARM) {
+				// unicorn takes thumb mode from the low bit of the address it starts at
+				uint32_t cpsr = 0;
+				uc_reg_read(uc, UC_ARM_REG_CPSR, &cpsr);
+				if (cpsr & 0x20) {
+					resume |= 1;
+				}
+			}
+			out = uc_emu_start(uc, resume, 0, 0, 0);
+		}
+		speculative_lifter.run_end();
 		if (out == UC_ERR_OK && stop_reason == STOP_NOSTART && get_instruction_pointer() == 0) {
 		    // handle edge case where we stop because we reached our bogus stop address (0)
 		    commit();
 		    stop_reason = STOP_ZEROPAGE;
 		}
 		rollback();
+		trace_stream.finish();
+		stats.trace_chunks_dropped += trace_stream.dropped;
 
 		if (out == UC_ERR_INSN_INVALID) {
 			stop_reason = STOP_NODECODE;
 		}
+		// counted once the reason is settled
+		stats.stops[stop_reason < STOP_REASONS ? stop_reason : STOP_ERROR]++;
+		if (profiling) {
+			// the run ended in the block it stopped in, whether or not it finished it
+			profile_block(profile_last_block, 0).counts.stops[stop_reason < STOP_REASONS ? stop_reason : STOP_ERROR]++;
+			profile.merge(run_profile);
+			run_profile.clear();
+		}
 
 		// if we errored out right away, fix the step count to 0
 		if (cur_steps == -1) cur_steps = 0;
 
+		if (recording_run) {
+			record_run_end();
+		}
 		return out;
 	}
 
@@ -306,70 +3357,219 @@ public:
 				msg = "unknown error";
 		}
 		stop_reason = reason;
-		//LOG_D("stop: %s", msg);
+		(void)msg; // unused when LOG_D compiles to nothing
+		LOG_D("stop: %s", msg);
 		uc_emu_stop(uc);
 	}
 
 	void step(uint64_t current_address, int32_t size, bool check_stop_points=true) {
+		stats.blocks++;
 		if (track_bbls) {
 			bbl_addrs.push_back(current_address);
 		}
 		if (track_stack) {
 			stack_pointers.push_back(get_stack_pointer());
 		}
-		executed_pages.insert(current_address & ~0xFFFULL);
+		if (coverage_map != NULL) {
+			// the location hash of afl's qemu mode
+			uint64_t location = ((current_address >> 4) ^ (current_address << 8)) & coverage_mask;
+			coverage_edge = location ^ coverage_prev;
+			coverage_map[coverage_edge]++;
+			coverage_edge_prev = coverage_prev;
+			coverage_prev = location >> 1;
+			coverage_pending = true;
+		}
+		if (profiling) {
+			profile_pending = &profile_block(current_address, size);
+			profile_pending->counts.executions++;
+			profile_pending->counts.instructions += profile_pending->instructions;
+			profile_last_block = current_address;
+		}
+		bool new_page = executed_pages.insert(current_address & ~0xFFFULL).second;
+		if (trace_stream.active()) {
+			trace_stream.block(current_address, get_stack_pointer());
+			if (new_page) {
+				trace_stream.page(current_address & ~0xFFFULL);
+			}
+		}
 		cur_address = current_address;
 		cur_size = size;
 
 		if (cur_steps >= max_steps) {
 			stop(STOP_NORMAL);
+		} else if (cancel != NULL && cancel->load(std::memory_order_relaxed)) {
+			// out of time; python picks up from here as if we had run out of steps
+			cancelled = true;
+			stop(STOP_NORMAL);
 		} else if (check_stop_points) {
 			// If size is zero, that means that the current basic block was too large for qemu
 			// and it got split into multiple parts. unicorn will only call this hook for the
-			// first part and not for the remaining ones, so it is impossible to find the
-			// accurate size of the BB block here.
+			// first part and not for the remaining ones, so the size is decoded here instead.
 			//
 			// See https://github.com/unicorn-engine/unicorn/issues/874
-			//
-			// Until that is resolved, we use the maximum size of a Qemu basic block here. This means
-			// that some stop points may not work, but there is no way to do better.
-			uint32_t real_size = size == 0 ? MAX_BB_SIZE : size;
-
-			// if there are any stop points in the current basic block, then there is no chance
-			// for us to stop in the middle of a block.
-			// since we do not support stopping in the middle of a block.
+			uint64_t stop_point;
+			if (!stop_points->first_in(current_address, size == 0 ? PAGE_SIZE : size, &stop_point)) {
+				return;
+			}
+			if (size == 0 && !stop_points->first_in(current_address, split_block_size(current_address), &stop_point)) {
+				return;
+			}
 
-			auto stop_point = stop_points.lower_bound(current_address);
-			if (stop_point != stop_points.end() && *stop_point < current_address + real_size) {
+			// a block runs straight through, so the lowest stop point in it is the first one reached
+			if (stop_point == current_address) {
+				stop(STOP_STOPPOINT);
+			}
+#if UC_API_MAJOR < 2
+			else {
+				// unicorn 1 can only drop a translation by writing to its code, and code
+				// pages are mapped onto bytes shared between States. stop at the start of
+				// the block instead.
 				stop(STOP_STOPPOINT);
 			}
+#else
+			else if (stop_point_hooks.count(stop_point) == 0) {
+				// hook_stop_point stops right at the instruction, but only in blocks
+				// translated after the hook was added. run this one again from a new
+				// translation.
+				stop_points->mark_mid_block(stop_point);
+				add_stop_point_hook(stop_point);
+				if (stop_point_hooks.count(stop_point) > 0) {
+					restart_block(stop_point);
+				} else {
+					stop(STOP_STOPPOINT);
+				}
+			}
+#endif
 		}
 	}
 
+	// stop now and have start() run the current block again, from a translation made after hooking address
+	void restart_block(uint64_t address) {
+		restarting = true;
+		restart_point = address;
+		stopped = true;
+		uc_emu_stop(uc);
+	}
+
+	// drop unicorn's translations of the code at address, so that the next ones pick up its hooks
+	void flush_translation(uint64_t address) {
+#if UC_API_MAJOR >= 2
+		uc_ctl_remove_cache(uc, address, address + 1);
+#else
+		// unicorn 1 has no call for this. hook_block never hooks a stop point in the
+		// middle of a block there, so nothing asks for it.
+		(void)address;
+#endif
+	}
+
 	/*
-	 * record current memory write
+	 * the size of a block qemu split, which unicorn reports as 0: VEX decodes it up
+	 * to its first jump, at most a page. without a guest to decode with, it is taken
+	 * to be a page long, which can only hook a stop point that is never reached.
 	 */
-	bool log_write(uint64_t address, int size, int clean) {
-		mem_access_t record;
-
-		record.address = address;
-		record.size = size;
-		record.clean = clean;
-		if (clean == -1) {
-			// all bytes are clean before this write, so the value
-			// is not important
-			memset(record.value, 0, sizeof(record.value));
-		} else {
-			uc_err err = uc_mem_read(uc, address, record.value, size);
-			if (err) {
-				//LOG_E("log_write: %s", uc_strerror(err));
-				stop(STOP_ERROR);
-				return false;
+	uint32_t split_block_size(uint64_t address) {
+		if (vex_guest == VexArch_INVALID) {
+			return PAGE_SIZE;
+		}
+		uint32_t size = 0;
+		while (size < PAGE_SIZE) {
+			uint64_t next = address + size;
+			uint32_t chunk = std::min<uint32_t>(MAX_BB_SIZE, PAGE_SIZE - size);
+			lift_buffer.resize(chunk);
+			if (uc_mem_read(uc, next, lift_buffer.data(), chunk) != UC_ERR_OK) {
+				// the code may end before the next page does
+				chunk = std::min<uint64_t>(chunk, PAGE_SIZE - (next & 0xFFFULL));
+				if (uc_mem_read(uc, next, lift_buffer.data(), chunk) != UC_ERR_OK) {
+					break;
+				}
+			}
+			bool falls_through;
+			uint32_t lifted = lifted_size(vex_guest, vex_archinfo, next, chunk, lift_buffer.data(), &falls_through);
+			size += lifted;
+			if (lifted == 0 || !falls_through) {
+				break;
 			}
 		}
+		return size == 0 ? PAGE_SIZE : std::min<uint32_t>(size, PAGE_SIZE);
+	}
 
-		mem_writes.push_back(record);
-		return true;
+	/*
+	 * a hooked stop point in the middle of a block was reached. everything the
+	 * block did up to here is kept, and the instruction is not executed.
+	 */
+	void stop_at_instruction(uint64_t address) {
+		commit();
+		trace_stream.commit_block();
+		coverage_pending = false;
+		profile_pending = NULL;
+		if (track_bbls) {
+			// stands in for the rest of the block, which rollback drops again
+			bbl_addrs.push_back(address);
+		}
+		stop(STOP_STOPPOINT);
+	}
+
+	/*
+	 * count the edges between blocks into map, from the next run on. size is
+	 * rounded down to a power of two. NULL turns counting off.
+	 */
+	void set_coverage_map(uint8_t *map, uint64_t size) {
+		while (size & (size - 1)) {
+			size &= size - 1;
+		}
+		coverage_map = size > 0 ? map : NULL;
+		coverage_mask = size > 0 ? size - 1 : 0;
+	}
+
+	// this run's counts for the block at address, of size bytes (0 if unknown)
+	run_profile_block_t &profile_block(uint64_t address, int32_t size) {
+		auto it = run_profile.find(address);
+		if (it != run_profile.end()) {
+			return it->second;
+		}
+		run_profile_block_t &block = run_profile[address];
+		memset(&block, 0, sizeof(block));
+		block.counts.address = address;
+		if (vex_guest != VexArch_INVALID && size > 0) {
+			// counted by VEX; the block cache keeps the lift for later runs
+			std::shared_ptr<const block_entry_t> entry = find_block(address, size);
+			if (entry) {
+				block.instructions = entry->instructions;
+			}
+		}
+		return block;
+	}
+
+	void add_stop_point_hook(uint64_t address) {
+		if (!hooked || stop_point_hooks.count(address) > 0) {
+			return;
+		}
+		uc_hook hook;
+		if (uc_hook_add(uc, &hook, UC_HOOK_CODE, (void *)hook_stop_point, this, address, address) == UC_ERR_OK) {
+			stop_point_hooks[address] = hook;
+		}
+	}
+
+	// make the instruction hooks match the stop points that need one
+	void sync_stop_point_hooks() {
+		if (!hooked) {
+			return;
+		}
+		for (auto it = stop_point_hooks.begin(); it != stop_point_hooks.end();) {
+			if (!stop_points->contains(it->first)) {
+				uc_hook_del(uc, it->second);
+				it = stop_point_hooks.erase(it);
+			} else {
+				it++;
+			}
+		}
+		for (uint64_t address : stop_points->hooked_points()) {
+			if (stop_point_hooks.count(address) == 0) {
+				add_stop_point_hook(address);
+				// code translated while the address had no hook doesn't call it
+				flush_translation(address);
+			}
+		}
 	}
 
 	/*
@@ -382,17 +3582,21 @@ public:
 		// mark memory sync status
 		// we might miss some dirty bits, this happens if hitting the memory
 		// write before mapping
-		for (auto it = mem_writes.begin(); it != mem_writes.end(); it++) {
-			if (it->clean == -1) {
-				taint_t *bitmap = page_lookup(it->address);
-				memset(&bitmap[it->address & 0xFFFULL], TAINT_DIRTY, sizeof(taint_t) * it->size);
-				it->clean = (1 << it->size) - 1;
-				//LOG_D("commit: lazy initialize mem_write [%#lx, %#lx]", it->address, it->address + it->size);
-			}
+		for (auto &write : pending_writes) {
+			PageBitmap *bitmap = page_lookup_writable(write.address);
+			if (bitmap == NULL)
+				continue;
+			int start = write.address & 0xFFFULL;
+			bitmap->set(start, start + write.size - 1, TAINT_DIRTY);
+			note_dirty(write.address, bitmap);
+			//LOG_D("commit: lazy initialize mem_write [%#lx, %#lx]", write.address, write.address + write.size);
 		}
 
 		// clear memory rollback status
-		mem_writes.clear();
+		undo_spans.clear();
+		undo_pages.clear();
+		undo_arena_used = 0;
+		pending_writes.clear();
 		cur_steps++;
 	}
 
@@ -400,54 +3604,73 @@ public:
 	 * undo recent memory actions.
 	 */
 	void rollback() {
-		// roll back memory changes
-		for (auto rit = mem_writes.rbegin(); rit != mem_writes.rend(); rit++) {
-			if (rit->clean == -1) {
-				// all bytes were clean before this write
-				taint_t *bitmap = page_lookup(rit->address);
-				if (bitmap)
-					memset(bitmap, TAINT_NONE, sizeof(taint_t) * rit->size);
-			} else {
-				uc_err err = uc_mem_write(uc, rit->address, rit->value, rit->size);
-				if (err) {
-					//LOG_I("rollback: %s", uc_strerror(err));
-					break ;
-				}
-				if (rit->clean) {
-					// should untaint some bits
-					taint_t *bitmap = page_lookup(rit->address);
-					uint64_t start = rit->address & 0xFFF;
-					int size = rit->size;
-					int clean = rit->clean;
-					for (int i = 0; i < size; i++)
-						if ((clean >> i) & 1) {
-							// this byte is untouched before this memory action
-							// in the rollback, we already failed to execute, so
-							// we don't care about symoblic address, just mark
-							// it's clean.
-							bitmap[start + i] = TAINT_NONE;
-						}
-				}
+		stats.rollbacks++;
+		// roll back memory changes, latest first, so that bytes saved twice end up as they were first saved
+		for (auto it = undo_spans.rbegin(); it != undo_spans.rend(); it++) {
+			const undo_span_t &undo = *it;
+			const uint64_t *saved = &undo_arena[undo.offset];
+			uc_err err = uc_mem_write(uc, undo.page + undo.lo, (const uint8_t *)saved + (undo.lo - undo.saved_lo), undo.hi - undo.lo + 1);
+			if (err) {
+				LOG_E("rollback: %s", uc_strerror(err));
+				break ;
+			}
+			// journal_write only saves pages with a bitmap, and none goes away during a block
+			PageBitmap *bitmap = page_lookup_writable(undo.page);
+			if (bitmap == NULL) {
+				LOG_E("rollback: page %#lx has no taint", undo.page);
+				continue;
 			}
+			bitmap->restore(saved + undo_byte_words(undo.saved_lo, undo.saved_hi), undo.saved_lo, undo.lo, undo.hi);
 		}
-		mem_writes.clear();
+		for (auto &write : pending_writes) {
+			// all bytes were clean before this write
+			PageBitmap *bitmap = page_lookup_writable(write.address);
+			int start = write.address & 0xFFFULL;
+			if (bitmap)
+				bitmap->set(start, start + write.size - 1, TAINT_NONE);
+		}
+		undo_spans.clear();
+		undo_pages.clear();
+		undo_arena_used = 0;
+		pending_writes.clear();
 
 		// restore registers
 		uc_context_restore(uc, saved_regs);
 		bbl_addrs.pop_back();
+		trace_stream.drop_block();
+		if (coverage_pending) {
+			coverage_map[coverage_edge]--;
+			coverage_prev = coverage_edge_prev;
+			coverage_pending = false;
+		}
+		if (profile_pending != NULL) {
+			profile_pending->counts.executions--;
+			profile_pending->counts.instructions -= profile_pending->instructions;
+			profile_pending = NULL;
+		}
 	}
 
 	/*
 	 * return the PageBitmap only if the page is remapped for writing,
 	 * or initialized with symbolic variable, otherwise return NULL.
 	 */
-	taint_t *page_lookup(uint64_t address) const {
-		address &= ~0xFFFULL;
-		auto it = active_pages.find(address);
-		if (it == active_pages.end()) {
-			return NULL;
+	PageBitmap *page_lookup(uint64_t address) const {
+		return active_pages.lookup(address);
+	}
+
+	/*
+	 * like page_lookup, for changing the taint. a bitmap still shared with a
+	 * forked State is copied first.
+	 */
+	PageBitmap *page_lookup_writable(uint64_t address) {
+		PageBitmap *bitmap = active_pages.lookup(address);
+		if (bitmap != NULL && bitmap->is_shared()) {
+			PageBitmap *copy = new PageBitmap(*bitmap);
+			active_pages.insert(address, copy);
+			bitmap->release();
+			bitmap = copy;
 		}
-		return it->second;
+		return bitmap;
 	}
 
 	/*
@@ -455,19 +3678,19 @@ public:
 	 */
 	void page_activate(uint64_t address, uint8_t *taint = NULL, uint64_t taint_offset = 0) {
 		address &= ~0xFFFULL;
-		taint_t *bitmap = NULL;
-		auto it = active_pages.find(address);
-		if (it == active_pages.end()) {
-			bitmap = new PageBitmap;
+		PageBitmap *bitmap = page_lookup_writable(address);
+		if (bitmap == NULL) {
+			bitmap = new PageBitmap();
 			//LOG_D("inserting %lx %p", address, bitmap);
-			// active_pages[address] = bitmap;
-			active_pages.insert(std::pair<uint64_t, taint_t*>(address, bitmap));
+			if (!active_pages.insert(address, bitmap)) {
+				printf("[sim_unicorn] Trying to activate the page at %#" PRIx64 ", which is outside of the guest address space.\n", address);
+				delete bitmap;
+				return;
+			}
 			if (taint != NULL) {
 				// taint is not NULL iff current page contains symbolic data
 				// check previous write acctions.
-				memcpy(bitmap, &taint[taint_offset], sizeof(PageBitmap));
-			} else {
-				memset(bitmap, TAINT_NONE, sizeof(PageBitmap));
+				bitmap->load(&taint[taint_offset]);
 			}
 		} else {
 		    // TODO: un-hardcode this address, or at least do this warning from python land
@@ -481,103 +3704,228 @@ public:
 				// you're gonna need to spend some time looking into it.
 				// I'm not 100% sure that this is necessarily a bug condition.
 			}
-			bitmap = it->second;
 		}
 
-		for (auto a = mem_writes.begin(); a != mem_writes.end(); a++)
-			if (a->clean == -1 && (a->address & ~0xFFFULL) == address) {
+		for (auto &write : pending_writes)
+			if ((write.address & ~0xFFFULL) == address) {
 				// initialize this memory access immediately so that the
 				// following memory read is valid.
-				//LOG_D("page_activate: lazy initialize mem_write [%#lx, %#lx]", a->address, a->address + a->size);
-				memset(&bitmap[a->address & 0xFFFULL], TAINT_DIRTY, sizeof(taint_t) * a->size);
-				a->clean = (1ULL << a->size) - 1;
+				//LOG_D("page_activate: lazy initialize mem_write [%#lx, %#lx]", write.address, write.address + write.size);
+				int start = write.address & 0xFFFULL;
+				bitmap->set(start, start + write.size - 1, TAINT_DIRTY);
 			}
+		note_dirty(address, bitmap);
+		if (recording_run) {
+			// python mapped it for us during the run; replays have it from the start
+			record_run_page(address);
+		}
+	}
+
+	/*
+	 * put a page on the dirty page list the first time it gets dirty bytes.
+	 */
+	inline void note_dirty(uint64_t address, PageBitmap *bitmap) {
+		if (bitmap->has_dirty() && !bitmap->is_listed()) {
+			bitmap->set_listed();
+			dirty_pages.push_back(address & ~0xFFFULL);
+		}
 	}
 
 	/*
-	 * record consecutive dirty bit rage, return a linked list of ranges
+	 * call fn(address, length) for every dirty range, in address order
 	 */
+	template <typename F>
+	void for_each_dirty_range(F fn) {
+		// only pages that ever had dirty bytes, and only the span that did
+		std::sort(dirty_pages.begin(), dirty_pages.end());
+		for (uint64_t page : dirty_pages) {
+			PageBitmap *bitmap = page_lookup(page);
+			//LOG_D("found dirty page %#lx (%p)", page, bitmap);
+			int i = 0, j;
+			while (bitmap->find_dirty_run(i, &i, &j)) {
+				fn(page + i, (uint64_t)(j - i));
+				i = j;
+			}
+		}
+	}
+
 	mem_update_t *sync() {
 		mem_update *head = NULL;
 
-		for (auto it = active_pages.begin(); it != active_pages.end(); it++) {
-			taint_t *start = it->second;
-			taint_t *end = &it->second[0x1000];
-			//LOG_D("found active page %#lx (%p)", it->first, start);
-			for (taint_t *i = start; i < end; i++)
-				if ((*i) == TAINT_DIRTY) {
-					taint_t *j = i;
-					while (j < end && (*j) == TAINT_DIRTY) j++;
-
-					char buf[0x1000];
-					uc_mem_read(uc, it->first + (i - start), buf, j - i);
-					//LOG_D("sync [%#lx, %#lx] = %#lx", it->first + (i - start), it->first + (j - start), *(uint64_t *)buf);
-
-					mem_update_t *range = new mem_update_t;
-					range->address = it->first + (i - start);
-					range->length = j - i;
-					range->next = head;
-					head = range;
-
-					i = j;
-				}
-		}
+		for_each_dirty_range([&](uint64_t address, uint64_t length) {
+			stats.sync_ranges++;
+			stats.sync_bytes += length;
+			mem_update_t *range = new mem_update_t;
+			range->address = address;
+			range->length = length;
+			range->next = head;
+			head = range;
+		});
 
 		return head;
 	}
 
+	/*
+	 * write every dirty range and its contents into buffer, laid out as a
+	 * sync_header_t, then header.count sync_range_t, then the bytes of each range.
+	 * returns the size this needs; nothing is written if capacity is smaller.
+	 * ranges unicorn can't read are left out.
+	 */
+	uint64_t sync_into(uint8_t *buffer, uint64_t capacity) {
+		sync_ranges.clear();
+		uint64_t size = sizeof(sync_header_t);
+		for_each_dirty_range([&](uint64_t address, uint64_t length) {
+			sync_ranges.push_back({address, length, 0});
+			size += sizeof(sync_range_t) + length;
+		});
+		if (size > capacity) {
+			return size;
+		}
+
+		sync_header_t *header = (sync_header_t *)buffer;
+		header->count = 0;
+		header->size = size;
+		sync_range_t *ranges = (sync_range_t *)(header + 1);
+		uint64_t offset = sizeof(sync_header_t) + sync_ranges.size() * sizeof(sync_range_t);
+		for (auto &range : sync_ranges) {
+			uc_err err = uc_mem_read(uc, range.address, buffer + offset, range.length);
+			if (err != UC_ERR_OK) {
+				// the buffer holds no guest memory for it
+				LOG_W("sync [%#lx, %#lx]: %s", range.address, range.address + range.length, uc_strerror(err));
+				continue;
+			}
+			//LOG_D("sync [%#lx, %#lx] = %#lx", range.address, range.address + range.length, *(uint64_t *)(buffer + offset));
+			stats.sync_ranges++;
+			stats.sync_bytes += range.length;
+			range.offset = offset;
+			ranges[header->count++] = range;
+			offset += range.length;
+		}
+		return size;
+	}
+
+	/*
+	 * like sync_into, but into a buffer we own and reuse. it stays valid until the
+	 * next call or until the State goes away.
+	 */
+	uint8_t *sync_export(uint64_t *size) {
+		*size = sync_into(sync_buffer.data(), sync_buffer.size());
+		if (*size > sync_buffer.size()) {
+			sync_buffer.resize(*size);
+			sync_into(sync_buffer.data(), sync_buffer.size());
+		}
+		return sync_buffer.data();
+	}
+
 	/*
 	 * set a list of stops to stop execution at
 	 */
 
 	void set_stops(uint64_t count, uint64_t *stops)
 	{
-		stop_points.clear();
-		for (int i = 0; i < count; i++) {
-			stop_points.insert(stops[i]);
+		stop_points->assign(stops, count);
+		sync_stop_point_hooks();
+	}
+
+	/*
+	 * change the stops, which persist across States on the same engine, one at a time
+	 */
+	void add_stops(uint64_t count, uint64_t *stops)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			stop_points->add(stops[i]);
 		}
+		sync_stop_point_hooks();
 	}
 
-	std::pair<uint64_t, size_t> cache_page(uint64_t address, size_t size, char* bytes, uint64_t permissions)
+	void remove_stops(uint64_t count, uint64_t *stops)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			stop_points->remove(stops[i]);
+		}
+		sync_stop_point_hooks();
+	}
+
+	std::pair<uint64_t, size_t> cache_page(uint64_t address, size_t size, char* bytes, uint64_t permissions, page_buffer_t *buffer = NULL)
 	{
 		assert(address % 0x1000 == 0);
 		assert(size % 0x1000 == 0);
 
 		for (uint64_t offset = 0; offset < size; offset += 0x1000)
 		{
-			auto page = page_cache->find(address+offset);
-			if (page != page_cache->end())
+			CachedPage page;
+			if (page_cache->get(address+offset, &page))
 			{
 				fprintf(stderr, "[%#" PRIx64 ", %#" PRIx64 "](%#zx) already in cache.\n", address+offset, address+offset + 0x1000, 0x1000);
-				assert(page->second.size == 0x1000);
-				assert(memcmp(page->second.bytes, bytes + offset, 0x1000) == 0);
+				assert(page.size == 0x1000);
+				assert(memcmp(page.data->bytes, bytes + offset, 0x1000) == 0);
+				page_store.put(page.data);
 
 				continue;
 			}
 
-			uint8_t *copy = (uint8_t *)malloc(0x1000);
+			// the page store hands out a copy shared with everyone caching the same bytes
 			CachedPage cached_page = {
 				0x1000,
-				copy,
+				page_store.get((uint8_t *)&bytes[offset], buffer),
 				permissions
 			};
-			// address should be aligned to 0x1000
-			memcpy(copy, &bytes[offset], 0x1000);
-			page_cache->insert(std::pair<uint64_t, CachedPage>(address+offset, cached_page));
+			if (!page_cache->insert(address+offset, cached_page)) {
+				// another thread sharing our cache_key got there first
+				page_store.put(cached_page.data);
+			}
+		}
+		return std::make_pair(address, size);
+	}
+
+	/*
+	 * remember that a cached page is mapped into our unicorn engine. the mapping
+	 * takes over the caller's reference to the bytes.
+	 */
+	void note_mapped(uint64_t address, PageData *data) {
+		PageData *replaced = NULL;
+		{
+			std::lock_guard<std::mutex> guard(mapped_pages->lock);
+			auto it = mapped_pages->pages.find(address);
+			if (it != mapped_pages->pages.end()) {
+				// mapped again without our seeing the unmap
+				replaced = it->second;
+				it->second = data;
+			} else {
+				mapped_pages->pages.insert(std::make_pair(address, data));
+			}
+		}
+		if (replaced != NULL) {
+			page_store.put(replaced);
+		}
+	}
+
+	void note_unmapped(uint64_t address) {
+		PageData *data = NULL;
+		{
+			std::lock_guard<std::mutex> guard(mapped_pages->lock);
+			auto it = mapped_pages->pages.find(address);
+			if (it != mapped_pages->pages.end()) {
+				data = it->second;
+				mapped_pages->pages.erase(it);
+			}
+		}
+		if (data != NULL) {
+			page_store.put(data);
 		}
-		return std::make_pair(address, size);
 	}
 
     void wipe_page_from_cache(uint64_t address) {
-		auto page = page_cache->find(address);
-		if (page != page_cache->end()) {
-			//printf("Internal: unmapping %#llx size %#x, result %#x", page->first, page->second.size, uc_mem_unmap(uc, page->first, page->second.size));
-			uc_err err = uc_mem_unmap(uc, page->first, page->second.size);
+		CachedPage page;
+		if (page_cache->remove(address, &page)) {
+			//printf("Internal: unmapping %#llx size %#x, result %#x", address, page.size, uc_mem_unmap(uc, address, page.size));
+			uc_err err = uc_mem_unmap(uc, address, page.size);
 			//if (err) {
-			//	fprintf(stderr, "wipe_page_from_cache [%#lx, %#lx]: %s\n", page->first, page->first + page->second.size, uc_strerror(err));
+			//	fprintf(stderr, "wipe_page_from_cache [%#lx, %#lx]: %s\n", address, address + page.size, uc_strerror(err));
 			//}
-			free(page->second.bytes); // might explode
-			page_cache->erase(page);
+			note_unmapped(address);
+			// engines that still map the page keep the bytes alive
+			page_store.put(page.data);
 		} else {
 			//printf("Uh oh! Couldn't find page at %#llx\n", address);
 		}
@@ -596,9 +3944,9 @@ public:
 
     void clear_page_cache()
     {
-        while (!page_cache->empty())
+        for (uint64_t address : page_cache->addresses())
         {
-            wipe_page_from_cache(page_cache->begin()->first);
+            wipe_page_from_cache(address);
         }
     }
 
@@ -610,33 +3958,250 @@ public:
 
 		for (uint64_t offset = 0; offset < size; offset += 0x1000)
 		{
-			auto page = page_cache->find(address+offset);
-			if (page == page_cache->end())
+			CachedPage cached_page;
+			if (!page_cache->get(address+offset, &cached_page))
 			{
 				success = false;
 				continue;
 			}
 
-			auto cached_page = page->second;
 			size_t page_size = cached_page.size;
-			uint8_t *bytes = cached_page.bytes;
+			// unicorn wants a mutable pointer, but never writes to pages mapped without UC_PROT_WRITE
+			uint8_t *bytes = (uint8_t *)cached_page.data->bytes;
 			uint64_t permissions = cached_page.perms;
 
 			assert(page_size == 0x1000);
 
 			//LOG_D("hit cache [%#lx, %#lx]", address, address + size);
-			uc_err err = uc_mem_map_ptr(uc, page->first, page_size, permissions, bytes);
+			uc_err err = uc_mem_map_ptr(uc, address+offset, page_size, permissions, bytes);
 			if (err) {
 				fprintf(stderr, "map_cache [%#lx, %#lx]: %s\n", address, address + size, uc_strerror(err));
 				success = false;
+				page_store.put(cached_page.data);
+			} else {
+				// the reference get() took is the mapping's now
+				note_mapped(address+offset, cached_page.data);
+			}
+		}
+		return success;
+	}
+
+	/*
+	 * cache every page of a snapshot written by simunicorn_save_page_cache, and map
+	 * the ones our engine doesn't have yet. the pages are used in place, read-only,
+	 * straight out of the file.
+	 */
+	bool load_page_cache_snapshot(const char *path) {
+#ifdef _WIN32
+		return false;
+#else
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(page_cache_snapshot_header_t)) {
+			close(fd);
+			return false;
+		}
+		size_t map_size = st.st_size;
+		uint8_t *map = (uint8_t *)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			return false;
+		}
+
+		const page_cache_snapshot_header_t *header = (const page_cache_snapshot_header_t *)map;
+		const page_cache_snapshot_entry_t *entries = (const page_cache_snapshot_entry_t *)(header + 1);
+		uint64_t count = header->count;
+		bool valid = header->magic == PAGE_CACHE_SNAPSHOT_MAGIC && header->version == PAGE_CACHE_SNAPSHOT_VERSION &&
+				count <= map_size / PAGE_SIZE &&
+				page_cache_snapshot_data_offset(count) + count * PAGE_SIZE <= map_size;
+		// pages are aligned, sorted and have unicorn permissions, or caching them would assert
+		for (uint64_t i = 0; valid && i < count; i++) {
+			valid = entries[i].address % PAGE_SIZE == 0 && (entries[i].perms & ~(uint64_t)UC_PROT_ALL) == 0 &&
+					(i == 0 || entries[i].address > entries[i - 1].address);
+		}
+		if (!valid) {
+			fprintf(stderr, "%s is not a page cache snapshot.\n", path);
+			munmap(map, map_size);
+			return false;
+		}
+		uint8_t *data = map + page_cache_snapshot_data_offset(count);
+
+		// the mapping lives until the last page using it is gone
+		page_buffer_t *buffer = new page_buffer_t;
+		buffer->refs = 1;
+		buffer->bytes = map;
+		buffer->release = page_cache_snapshot_release;
+		buffer->context = (void *)(uintptr_t)map_size;
+
+		for (uint64_t i = 0; i < count; i++) {
+			if (!page_cache->contains(entries[i].address)) {
+				cache_page(entries[i].address, PAGE_SIZE, (char *)(data + i * PAGE_SIZE), entries[i].perms, buffer);
+			}
+		}
+
+		// skip whatever the engine already has mapped, from an earlier load or otherwise
+		uc_mem_region *regions;
+		uint32_t region_count;
+		std::vector<std::pair<uint64_t, uint64_t>> mapped;
+		if (uc_mem_regions(uc, &regions, &region_count) == UC_ERR_OK) {
+			for (uint32_t i = 0; i < region_count; i++) {
+				mapped.push_back(std::make_pair(regions[i].begin, regions[i].end));
+			}
+			uc_free(regions);
+		}
+		std::sort(mapped.begin(), mapped.end());
+
+		bool success = true;
+		uint64_t run_start = 0, run_length = 0;
+		for (uint64_t i = 0; i < count; i++) {
+			uint64_t address = entries[i].address;
+			auto region = std::upper_bound(mapped.begin(), mapped.end(), std::make_pair(address, UINT64_MAX));
+			bool is_mapped = region != mapped.begin() && (region - 1)->second >= address;
+			if (!is_mapped && run_length != 0 && run_start + run_length == address) {
+				run_length += PAGE_SIZE;
 				continue;
 			}
+			if (run_length != 0) {
+				success &= map_cache(run_start, run_length);
+				run_length = 0;
+			}
+			if (!is_mapped) {
+				run_start = address;
+				run_length = PAGE_SIZE;
+			}
 		}
+		if (run_length != 0) {
+			success &= map_cache(run_start, run_length);
+		}
+
+		page_buffer_put(buffer);
 		return success;
+#endif
 	}
 
 	bool in_cache(uint64_t address) {
-		return page_cache->find(address) != page_cache->end();
+		return page_cache->contains(address);
+	}
+
+	/*
+	 * record the next run that starts into a snapshot at path, for native/replay.
+	 * returns false if the file can't be created or the architecture has no
+	 * register list.
+	 */
+	bool record_run(const char *path) {
+		if (arch != UC_ARCH_X86 && arch != UC_ARCH_ARM && arch != UC_ARCH_ARM64 && arch != UC_ARCH_MIPS) {
+			return false;
+		}
+		run_snapshot.reset(new RunSnapshot());
+		if (!run_snapshot->create(path)) {
+			run_snapshot.reset();
+			return false;
+		}
+		return true;
+	}
+
+	void record_run_begin(uint64_t pc, uint64_t step) {
+		RunSnapshot &snapshot = *run_snapshot;
+		run_snapshot_header_t &header = snapshot.header;
+		header.arch = arch;
+		header.mode = mode;
+		header.pc = pc;
+		header.step = step;
+		header.cache_key = cache_key;
+		header.transmit_sysno = transmit_sysno;
+		header.transmit_bbl_addr = transmit_bbl_addr;
+		header.track_bbls = track_bbls;
+		header.track_stack = track_stack;
+		header.vex_guest = vex_guest;
+		header.vex_archinfo = vex_archinfo;
+		header.vex_archinfo.hwcache_info.caches = NULL;
+
+		save_run_registers(uc, arch, mode, snapshot.registers);
+		snapshot.stops = stop_points->addresses();
+		symbolic_registers.for_each([&](uint64_t offset) {
+			snapshot.symbolic_registers.push_back(offset);
+		});
+		snapshot.symbolic_registers.insert(snapshot.symbolic_registers.end(), untracked_registers.begin(), untracked_registers.end());
+
+		// everything mapped but the cached pages, which are saved once the run is over
+		{
+			std::lock_guard<std::mutex> guard(mapped_pages->lock);
+			for (auto &page : mapped_pages->pages) {
+				snapshot.cached_pages[page.first].info.flags = RUN_SNAPSHOT_PAGE_MAPPED;
+			}
+		}
+		uc_mem_region *regions;
+		uint32_t count;
+		if (uc_mem_regions(uc, &regions, &count) == UC_ERR_OK) {
+			for (uint32_t i = 0; i < count; i++) {
+				for (uint64_t page = regions[i].begin; page < regions[i].end; page += PAGE_SIZE) {
+					if (!snapshot.cached_pages.count(page)) {
+						record_run_page(page, regions[i].perms);
+					}
+				}
+			}
+			uc_free(regions);
+		}
+		recording_run = true;
+	}
+
+	void record_run_page(uint64_t address, uint32_t perms = UC_PROT_NONE) {
+		RunSnapshot::page_t &page = run_snapshot->pages[address];
+		if (!page.bytes.empty()) {
+			return;
+		}
+		if (perms == UC_PROT_NONE) {
+			uc_mem_region *regions;
+			uint32_t count;
+			if (uc_mem_regions(uc, &regions, &count) == UC_ERR_OK) {
+				for (uint32_t i = 0; i < count; i++) {
+					if (regions[i].begin <= address && address <= regions[i].end) {
+						perms = regions[i].perms;
+					}
+				}
+				uc_free(regions);
+			}
+		}
+		page.info.address = address;
+		page.info.perms = perms;
+		page.bytes.resize(PAGE_SIZE);
+		uc_mem_read(uc, address, page.bytes.data(), PAGE_SIZE);
+		PageBitmap *bitmap = page_lookup(address);
+		if (bitmap != NULL) {
+			page.info.flags |= RUN_SNAPSHOT_PAGE_TAINT;
+			page.taint.resize(PAGE_SIZE);
+			for (int i = 0; i < PAGE_SIZE; i++) {
+				page.taint[i] = bitmap->get(i);
+			}
+		}
+	}
+
+	void record_run_end() {
+		RunSnapshot &snapshot = *run_snapshot;
+		for (uint64_t address : page_cache->addresses()) {
+			CachedPage cached_page;
+			if (!page_cache->get(address, &cached_page)) {
+				continue;
+			}
+			RunSnapshot::page_t &page = snapshot.cached_pages[address];
+			page.info.address = address;
+			page.info.perms = cached_page.perms;
+			page.bytes.assign(cached_page.data->bytes, cached_page.data->bytes + PAGE_SIZE);
+			page_store.put(cached_page.data);
+		}
+		// mapped pages the cache has since dropped
+		for (auto it = snapshot.cached_pages.begin(); it != snapshot.cached_pages.end(); ) {
+			it = it->second.bytes.empty() ? snapshot.cached_pages.erase(it) : std::next(it);
+		}
+
+		if (!snapshot.write()) {
+			fprintf(stderr, "[sim_unicorn] Could not write the run snapshot.\n");
+		}
+		run_snapshot.reset();
+		recording_run = false;
 	}
 
 	//
@@ -644,7 +4209,7 @@ public:
 	//
 
 	// check if we can clobberedly handle this IRExpr
-	inline bool check_expr(RegisterSet *clobbered, RegisterSet *danger, IRExpr *e)
+	static inline bool check_expr(RegisterSet *clobbered, RegisterSet *danger, IRExpr *e)
 	{
 		int i, expr_size;
 		if (e == NULL) return true;
@@ -670,40 +4235,41 @@ public:
 				}
 
 				expr_size = sizeofIRType(e->Iex.Get.ty);
-				this->check_register_read(clobbered, danger, e->Iex.Get.offset, expr_size);
+				if (!RegisterSet::fits(e->Iex.Get.offset, expr_size)) return false;
+				check_register_read(clobbered, danger, e->Iex.Get.offset, expr_size);
 				break;
 			case Iex_Qop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg2)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg3)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg4)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg3)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg4)) return false;
 				break;
 			case Iex_Triop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg2)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg3)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg3)) return false;
 				break;
 			case Iex_Binop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Binop.arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Binop.arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Binop.arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Binop.arg2)) return false;
 				break;
 			case Iex_Unop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Unop.arg)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Unop.arg)) return false;
 				break;
 			case Iex_Load:
-				if (!this->check_expr(clobbered, danger, e->Iex.Load.addr)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Load.addr)) return false;
 				break;
 			case Iex_Const:
 				break;
 			case Iex_ITE:
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.cond)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.iffalse)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.iftrue)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.cond)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.iffalse)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.iftrue)) return false;
 				break;
 			case Iex_CCall:
 				for (i = 0; e->Iex.CCall.args[i] != NULL; i++)
 				{
-					if (!this->check_expr(clobbered, danger, e->Iex.CCall.args[i])) return false;
+					if (!check_expr(clobbered, danger, e->Iex.CCall.args[i])) return false;
 				}
 				break;
 		}
@@ -712,30 +4278,24 @@ public:
 	}
 
 	// mark the register as clobbered
-	inline void mark_register_clobbered(RegisterSet *clobbered, uint64_t offset, int size)
+	static inline void mark_register_clobbered(RegisterSet *clobbered, uint64_t offset, int size)
 	{
-		for (int i = 0; i < size; i++)
-			clobbered->insert(offset + i);
+		clobbered->insert_range(offset, size);
 	}
 
 	// check register access
-	inline void check_register_read(RegisterSet *clobbered, RegisterSet *danger, uint64_t offset, int size)
+	static inline void check_register_read(RegisterSet *clobbered, RegisterSet *danger, uint64_t offset, int size)
 	{
-		for (int i = 0; i < size; i++)
-		{
-			if (clobbered->count(offset + i) == 0) {
-				danger->insert(offset + i);
-			}
-		}
+		danger->insert_range_except(offset, size, *clobbered);
 	}
 
 	// check if we can clobberedly handle this IRStmt
-	inline bool check_stmt(RegisterSet *clobbered, RegisterSet *danger, IRTypeEnv *tyenv, IRStmt *s)
+	static inline bool check_stmt(RegisterSet *clobbered, RegisterSet *danger, IRTypeEnv *tyenv, IRStmt *s)
 	{
 		switch (s->tag)
 		{
 			case Ist_Put: {
-				if (!this->check_expr(clobbered, danger, s->Ist.Put.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Put.data)) return false;
 				IRType expr_type = typeOfIRExpr(tyenv, s->Ist.Put.data);
 				if (expr_type == Ity_I1)
 				{
@@ -744,7 +4304,8 @@ public:
 				}
 
 				int expr_size = sizeofIRType(expr_type);
-				this->mark_register_clobbered(clobbered, s->Ist.Put.offset, expr_size);
+				if (!RegisterSet::fits(s->Ist.Put.offset, expr_size)) return false;
+				mark_register_clobbered(clobbered, s->Ist.Put.offset, expr_size);
 				break;
 			}
 			case Ist_PutI:
@@ -760,44 +4321,44 @@ public:
 				return false;
 				break;
 			case Ist_WrTmp:
-				if (!this->check_expr(clobbered, danger, s->Ist.WrTmp.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.WrTmp.data)) return false;
 				break;
 			case Ist_Store:
-				if (!this->check_expr(clobbered, danger, s->Ist.Store.addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.Store.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Store.addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Store.data)) return false;
 				break;
 			case Ist_CAS:
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->dataLo)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->dataHi)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->expdLo)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->expdHi)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->dataLo)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->dataHi)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->expdLo)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->expdHi)) return false;
 				break;
 			case Ist_LLSC:
-				if (!this->check_expr(clobbered, danger, s->Ist.LLSC.addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LLSC.storedata)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LLSC.addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LLSC.storedata)) return false;
 				break;
 			case Ist_Dirty: {
-				if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->guard)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->mAddr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Dirty.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Dirty.details->mAddr)) return false;
 				for (int i = 0; s->Ist.Dirty.details->args[i] != NULL; i++)
 				{
-					if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->args[i])) return false;
+					if (!check_expr(clobbered, danger, s->Ist.Dirty.details->args[i])) return false;
 				}
 				break;
 							}
 			case Ist_Exit:
-				if (!this->check_expr(clobbered, danger, s->Ist.Exit.guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Exit.guard)) return false;
 				break;
 			case Ist_LoadG:
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->alt)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->alt)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->guard)) return false;
 				break;
 			case Ist_StoreG:
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->data)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->guard)) return false;
 				break;
 			case Ist_NoOp:
 			case Ist_IMark:
@@ -813,76 +4374,240 @@ public:
 		return true;
 	}
 
-	// check if the block is feasible
-	bool check_block(uint64_t address, int32_t size)
+	// key for everything besides the block's bytes that changes how it lifts
+	uint64_t lift_arch_hash(uint64_t address)
 	{
-		// assume we're good if we're not checking symbolic registers
-		if (this->vex_guest == VexArch_INVALID) {
-			return true;
-		}
+		uint32_t fields[] = {
+			(uint32_t)this->vex_guest,
+			(uint32_t)this->vex_archinfo.hwcaps,
+			(uint32_t)this->vex_archinfo.endness,
+			(uint32_t)this->vex_archinfo.ppc_icache_line_szB,
+			(uint32_t)this->vex_archinfo.ppc_dcbz_szB,
+			(uint32_t)this->vex_archinfo.ppc_dcbzl_szB,
+			(uint32_t)this->vex_archinfo.arm64_dMinLine_lg2_szB,
+			(uint32_t)this->vex_archinfo.arm64_iMinLine_lg2_szB,
+			(uint32_t)this->vex_archinfo.x86_cr0,
+			(uint32_t)(address & 1), // thumb
+		};
+		return fnv1a_hash(fields, sizeof(fields));
+	}
 
-		// if there are no symbolic registers we're ok
-		if (this->symbolic_registers.size() == 0) {
-			return true;
+	// lift a block and work out which registers it reads and writes. returns NULL
+	// if VEX cannot lift it.
+	std::shared_ptr<block_entry_t> lift_block(uint64_t address, int32_t size)
+	{
+		CachedCode code;
+		const uint8_t *instructions;
+		if (code.load(this->page_cache, address, size)) {
+			instructions = code.bytes;
+		} else {
+			this->lift_buffer.resize(size);
+			uc_mem_read(this->uc, address, this->lift_buffer.data(), size);
+			instructions = this->lift_buffer.data();
 		}
 
-		// check if it's in the cache already
-		RegisterSet *clobbered_registers;
-		RegisterSet *used_registers;
-		auto search = this->block_cache->find(address);
-		if (search != this->block_cache->end()) {
-			if (!search->second.try_unicorn) {
-				return false;
+		std::shared_ptr<BlockCacheFile> file = current_block_cache_file();
+		uint64_t arch_hash = 0;
+		if (file) {
+			arch_hash = lift_arch_hash(address);
+			std::shared_ptr<block_entry_t> entry = file->find(arch_hash, instructions, size);
+			if (entry) {
+				return entry;
 			}
-			clobbered_registers = &search->second.clobbered_registers;
-			used_registers = &search->second.used_registers;
-		} else {
-			// wtf i hate c++...
-			VexRegisterUpdates pxControl = VexRegUpdUnwindregsAtMemAccess;
-			auto& entry = this->block_cache->emplace(std::make_pair(address, block_entry_t())).first->second;
-			entry.try_unicorn = true;
-			clobbered_registers = &entry.clobbered_registers;
-			used_registers = &entry.used_registers;
-
-			std::unique_ptr<uint8_t[]> instructions(new uint8_t[size]);
-			uc_mem_read(this->uc, address, instructions.get(), size);
-			VEXLiftResult *lift_ret = vex_lift(
-					this->vex_guest, this->vex_archinfo, instructions.get(), address, 99, size, 1, 0, 0, 1, 0,
-					pxControl
-					);
-
-
-			if (lift_ret == NULL) {
-				// TODO: how to handle?
+		}
+
+		std::vector<uint64_t> successors;
+		auto lift_start = std::chrono::steady_clock::now();
+		std::shared_ptr<block_entry_t> entry = check_lifted_block(this->vex_guest, this->vex_archinfo, address, size, instructions, NULL, &successors);
+		stats.lifts++;
+		stats.lift_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - lift_start).count();
+		if (entry && file) {
+			file->append(arch_hash, instructions, size, *entry);
+		}
+		for (uint64_t successor : successors) {
+			speculative_lifter.submit({this->block_cache, this->page_cache, this->vex_guest, this->vex_archinfo, successor, 1});
+		}
+		return entry;
+	}
+
+	// the address a Boring or Call jump to a constant goes to
+	static bool constant_target(IRJumpKind kind, const IRConst *target, uint64_t *address)
+	{
+		if (kind != Ijk_Boring && kind != Ijk_Call) {
+			return false;
+		}
+		switch (target->tag) {
+			case Ico_U32:
+				*address = target->Ico.U32;
+				return true;
+			case Ico_U64:
+				*address = target->Ico.U64;
+				return true;
+			default:
 				return false;
-			}
+		}
+	}
 
-			IRSB *the_block = lift_ret->irsb;
+	/*
+	 * lift up to size bytes and check them. the number of bytes VEX actually lifted
+	 * and the constant jump targets of the block are returned through lifted_size
+	 * and successors when those are given.
+	 */
+	static std::shared_ptr<block_entry_t> check_lifted_block(VexArch guest, VexArchInfo archinfo, uint64_t address, int32_t size,
+			const uint8_t *instructions, int32_t *lifted_size = NULL, std::vector<uint64_t> *successors = NULL)
+	{
+		// wtf i hate c++...
+		VexRegisterUpdates pxControl = VexRegUpdUnwindregsAtMemAccess;
+		std::shared_ptr<block_entry_t> entry(new block_entry_t());
+		entry->try_unicorn = true;
+		entry->instructions = 0;
+
+		// the IRSB lives in VEX's arena, which the next lift recycles
+		std::lock_guard<std::mutex> guard(vex_lift_lock);
+		VEXLiftResult *lift_ret = vex_lift(
+				guest, archinfo, (unsigned char *)instructions, address, 99, size, 1, 0, 0, 1, 0,
+				pxControl
+				);
+
+		if (lift_ret == NULL) {
+			return nullptr;
+		}
 
+		IRSB *the_block = lift_ret->irsb;
+		if (lifted_size != NULL) {
+			*lifted_size = lift_ret->size;
+		}
+		for (int i = 0; i < the_block->stmts_used; i++) {
+			if (the_block->stmts[i]->tag == Ist_IMark) {
+				entry->instructions++;
+			}
+		}
+		if (successors != NULL) {
+			uint64_t target;
 			for (int i = 0; i < the_block->stmts_used; i++) {
-				if (!this->check_stmt(clobbered_registers, used_registers, the_block->tyenv, the_block->stmts[i])) {
-					entry.try_unicorn = false;
-					return false;
+				IRStmt *stmt = the_block->stmts[i];
+				if (stmt->tag == Ist_Exit && constant_target(stmt->Ist.Exit.jk, stmt->Ist.Exit.dst, &target)) {
+					successors->push_back(target);
 				}
 			}
+			if (the_block->next != NULL && the_block->next->tag == Iex_Const && constant_target(the_block->jumpkind, the_block->next->Iex.Const.con, &target)) {
+				successors->push_back(target);
+			}
+		}
 
-			if (!this->check_expr(clobbered_registers, used_registers, the_block->next)) {
-				entry.try_unicorn = false;
-				return false;
+		for (int i = 0; i < the_block->stmts_used; i++) {
+			if (!check_stmt(&entry->clobbered_registers, &entry->used_registers, the_block->tyenv, the_block->stmts[i])) {
+				entry->try_unicorn = false;
+				return entry;
 			}
 		}
 
-		for (uint64_t off : this->symbolic_registers) {
-			if (used_registers->count(off) > 0) {
-				stopping_register = off;
-				return false;
+		if (!check_expr(&entry->clobbered_registers, &entry->used_registers, the_block->next)) {
+			entry->try_unicorn = false;
+		}
+		return entry;
+	}
+
+	/*
+	 * the number of bytes VEX decodes as one block from up to size bytes, 0 if it
+	 * can't. falls_through tells whether the block only ended at a limit of VEX's,
+	 * and the code goes on past it.
+	 */
+	static uint32_t lifted_size(VexArch guest, VexArchInfo archinfo, uint64_t address, uint32_t size,
+			const uint8_t *instructions, bool *falls_through)
+	{
+		VexRegisterUpdates pxControl = VexRegUpdUnwindregsAtMemAccess;
+		std::lock_guard<std::mutex> guard(vex_lift_lock);
+		VEXLiftResult *lift_ret = vex_lift(
+				guest, archinfo, (unsigned char *)instructions, address, 99, size, 1, 0, 0, 1, 0,
+				pxControl
+				);
+		*falls_through = false;
+		if (lift_ret == NULL) {
+			return 0;
+		}
+		IRSB *the_block = lift_ret->irsb;
+		uint64_t target;
+		if (the_block->jumpkind == Ijk_Boring && the_block->next != NULL && the_block->next->tag == Iex_Const &&
+				constant_target(the_block->jumpkind, the_block->next->Iex.Const.con, &target)) {
+			*falls_through = target == address + lift_ret->size;
+		}
+		return lift_ret->size;
+	}
+
+	// the cached entry of a block, lifting it if needed. NULL if VEX cannot lift it
+	std::shared_ptr<const block_entry_t> find_block(uint64_t address, int32_t size)
+	{
+		std::shared_ptr<const block_entry_t> entry = this->block_cache->find(address);
+		if (entry) {
+			stats.block_cache_hits++;
+		} else {
+			stats.block_cache_misses++;
+			uint64_t generation = this->block_cache->generation(address, size);
+			entry = this->block_cache->claim(address, size);
+			if (entry) {
+				stats.speculative_hits++;
+			} else {
+				entry = lift_block(address, size);
+			}
+			if (entry) {
+				// another thread may have lifted the same block meanwhile; either result will do
+				entry = this->block_cache->insert(address, size, entry, generation);
+			}
+		}
+		return entry;
+	}
+
+	void set_symbolic_registers(const uint64_t *offsets, uint64_t count)
+	{
+		symbolic_registers.clear();
+		untracked_registers.clear();
+		for (uint64_t i = 0; i < count; i++) {
+			if (RegisterSet::fits(offsets[i], 1)) {
+				symbolic_registers.insert(offsets[i]);
+			} else {
+				untracked_registers.push_back(offsets[i]);
 			}
 		}
+	}
+
+	// check if the block is feasible
+	bool check_block(uint64_t address, int32_t size)
+	{
+		// assume we're good if we're not checking symbolic registers
+		if (this->vex_guest == VexArch_INVALID) {
+			return true;
+		}
+
+		// a symbolic register we can't track might be used by any block
+		if (!this->untracked_registers.empty()) {
+			stopping_register = this->untracked_registers.front();
+			return false;
+		}
+
+		// if there are no symbolic registers we're ok
+		if (this->symbolic_registers.empty()) {
+			return true;
+		}
+
+		std::shared_ptr<const block_entry_t> entry = find_block(address, size);
+		if (!entry) {
+			// TODO: how to handle?
+			return false;
+		}
+
+		if (!entry->try_unicorn) {
+			return false;
+		}
 
-		for (uint64_t off : *clobbered_registers) {
-			this->symbolic_registers.erase(off);
+		int64_t off = this->symbolic_registers.first_common(entry->used_registers);
+		if (off >= 0) {
+			stopping_register = off;
+			return false;
 		}
 
+		this->symbolic_registers.subtract(entry->clobbered_registers);
+
 		return true;
 	}
 
@@ -890,35 +4615,34 @@ public:
 	// Returns -1 if no tainted data is present.
 	uint64_t find_tainted(uint64_t address, int size)
 	{
-		taint_t *bitmap = page_lookup(address);
+		stats.taint_lookups++;
+		PageBitmap *bitmap = page_lookup(address);
 
 		int start = address & 0xFFF;
 		int end = (address + size - 1) & 0xFFF;
 
 		if (end >= start) {
 			if (bitmap) {
-				for (int i = start; i <= end; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return (address & ~0xFFF) + i;
-					}
+				int i = bitmap->find_symbolic(start, end);
+				if (i != -1) {
+					return (address & ~0xFFF) + i;
 				}
 			}
 		} else {
 			// cross page boundary
 			if (bitmap) {
-				for (int i = start; i <= 0xFFF; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return (address & ~0xFFF) + i;
-					}
+				int i = bitmap->find_symbolic(start, 0xFFF);
+				if (i != -1) {
+					return (address & ~0xFFF) + i;
 				}
 			}
 
+			stats.taint_lookups++;
 			bitmap = page_lookup(address + size - 1);
 			if (bitmap) {
-				for (int i = 0; i <= end; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return ((address + size - 1) & ~0xFFF) + i;
-					}
+				int i = bitmap->find_symbolic(0, end);
+				if (i != -1) {
+					return ((address + size - 1) & ~0xFFF) + i;
 				}
 			}
 		}
@@ -928,54 +4652,126 @@ public:
 
 	void handle_write(uint64_t address, int size)
 	{
-		taint_t *bitmap = page_lookup(address);
 		int start = address & 0xFFF;
 		int end = (address + size - 1) & 0xFFF;
-		int clean;
+
+		check_code_write(address & ~0xFFFULL);
+		if (end < start) {
+			check_code_write((address + size - 1) & ~0xFFFULL);
+		}
 
 		if (end >= start) {
-			if (bitmap) {
-				clean = 0;
-				for (int i = start; i <= end; i++) {
-					if (bitmap[i] != TAINT_DIRTY) {
-						clean |= (1 << i); // this bit should not be marked as taint if we undo this action
-						bitmap[i] = TAINT_DIRTY; // this will automatically remove TAINT_SYMBOLIC flag
-					}
-				}
-			} else {
-				clean = -1;
-			}
-			log_write(address, size, clean);
+			journal_write(address, start, end);
 		} else {
-			if (bitmap) {
-				clean = 0;
-				for (int i = start; i <= 0xFFF; i++) {
-					if (bitmap[i] == TAINT_DIRTY) {
-						clean |= (1 << i);
-						bitmap[i] = TAINT_DIRTY;
-					}
-				}
-			} else {
-				clean = -1;
-			}
-			if (!log_write(address, 0x1000 - start, clean))
+			if (!journal_write(address, start, 0xFFF))
 				// uc is already stopped if any error happens
 				return ;
+			journal_write(address + size - 1, 0, end);
+		}
+	}
 
-			bitmap = page_lookup(address + size - 1);
-			if (bitmap) {
-				clean = 0;
-				for (int i = 0; i <= end; i++) {
-					if (bitmap[i] == TAINT_DIRTY) {
-						clean |= (1 << i);
-						bitmap[i] = TAINT_DIRTY;
-					}
-				}
-			} else {
-				clean = -1;
+	/*
+	 * self-modifying code: a write to a page holding cached blocks drops them. the
+	 * last page found to hold none is remembered until some page gains blocks, so
+	 * ordinary data writes skip the cache lookup.
+	 */
+	inline void check_code_write(uint64_t page)
+	{
+		uint64_t epoch = block_cache->epoch();
+		if (page == last_data_page && epoch == last_data_page_epoch) {
+			return;
+		}
+		if (block_cache->invalidate_page(page)) {
+			smc_count++;
+		} else {
+			last_data_page = page;
+			last_data_page_epoch = epoch;
+		}
+	}
+
+	/*
+	 * note a write to bytes [start, end] of the page containing address, and mark
+	 * them dirty. this removes TAINT_SYMBOLIC as well. the bytes are saved first,
+	 * of any size. after UNDO_SPANS_PER_PAGE writes to a page in a block, the page
+	 * is saved whole, and its later writes in the block save nothing.
+	 */
+	bool journal_write(uint64_t address, int start, int end)
+	{
+		uint64_t page = address & ~0xFFFULL;
+		stats.taint_lookups++;
+		PageBitmap *bitmap = page_lookup_writable(page);
+		if (bitmap == NULL) {
+			// the page isn't mapped yet. page_activate marks the bytes once it is
+			pending_writes.push_back({page + start, end - start + 1});
+			return true;
+		}
+
+		undo_page_t *undo = NULL;
+		for (auto it = undo_pages.rbegin(); it != undo_pages.rend(); it++) {
+			if (it->page == page) {
+				undo = &*it;
+				break;
+			}
+		}
+		if (undo == NULL) {
+			undo_pages.push_back({page, 0, -1});
+			undo = &undo_pages.back();
+		}
+
+		if (undo->whole >= 0) {
+			undo_span_t &span = undo_spans[undo->whole];
+			span.lo = std::min(span.lo, start);
+			span.hi = std::max(span.hi, end);
+		} else if (undo->spans > 0 && undo_spans.back().page == page &&
+				start >= undo_spans.back().saved_lo && end <= undo_spans.back().saved_hi) {
+			// the same bytes again: rollback puts back what the earlier write saved
+		} else if (undo->spans < UNDO_SPANS_PER_PAGE) {
+			if (!save_span(page, start, end, bitmap)) {
+				return false;
+			}
+			undo->spans++;
+		} else {
+			if (!save_span(page, 0, PAGE_SIZE - 1, bitmap)) {
+				return false;
 			}
-			log_write(address - start + 0x1000, end + 1, clean);
+			undo_spans.back().lo = start;
+			undo_spans.back().hi = end;
+			undo->whole = undo_spans.size() - 1;
+		}
+
+		bitmap->set(start, end, TAINT_DIRTY);
+		note_dirty(page, bitmap);
+		return true;
+	}
+
+	// save bytes [lo, hi] of page and their taint as a new undo span
+	bool save_span(uint64_t page, int lo, int hi, const PageBitmap *bitmap)
+	{
+		size_t offset = undo_arena_used;
+		size_t byte_words = undo_byte_words(lo, hi);
+		size_t words = byte_words + hi / TAINT_BYTES_PER_WORD - lo / TAINT_BYTES_PER_WORD + 1;
+		if (undo_arena.size() < offset + words) {
+			undo_arena.resize(std::max(offset + words, 2 * undo_arena.size()));
+		}
+		uint64_t *saved = &undo_arena[offset];
+		uc_err err = uc_mem_read(uc, page + lo, saved, hi - lo + 1);
+		if (err) {
+			LOG_E("journal_write: %s", uc_strerror(err));
+			stop(STOP_ERROR);
+			return false;
+		}
+		bitmap->save(saved + byte_words, lo, hi);
+		undo_arena_used += words;
+		undo_spans.push_back({page, offset, lo, hi, lo, hi});
+		return true;
+	}
+
+	// width of a guest address, used to size the page table
+	inline int arch_address_bits() {
+		if (arch == UC_ARCH_ARM64 || (mode & UC_MODE_64)) {
+			return 64;
 		}
+		return 32;
 	}
 
 	inline unsigned int arch_pc_reg() {
@@ -1008,50 +4804,199 @@ public:
 		}
 	}
 
-	uint64_t get_instruction_pointer() {
-		uint64_t out = 0;
-		unsigned int reg = arch_pc_reg();
-		if (reg == -1) {
-			out = 0;
-		} else {
-			uc_reg_read(uc, reg, &out);
+	uint64_t get_instruction_pointer() {
+		uint64_t out = 0;
+		unsigned int reg = arch_pc_reg();
+		if (reg == -1) {
+			out = 0;
+		} else {
+			uc_reg_read(uc, reg, &out);
+		}
+
+		return out;
+	}
+
+	uint64_t get_stack_pointer() {
+		uint64_t out = 0;
+		unsigned int reg = arch_sp_reg();
+		if (reg == -1) {
+			out = 0;
+		} else {
+			uc_reg_read(uc, reg, &out);
+		}
+
+		return out;
+	}
+
+	void set_instruction_pointer(uint64_t val) {
+		unsigned int reg = arch_pc_reg();
+		if (reg != -1) {
+			uc_reg_write(uc, reg, &val);
+		}
+	}
+
+	void set_stack_pointer(uint64_t val) {
+		unsigned int reg = arch_sp_reg();
+		if (reg != -1) {
+			uc_reg_write(uc, reg, &val);
+		}
+	}
+};
+
+void SpeculativeLifter::lift(const speculative_job_t &job) {
+	if (job.block_cache->known(job.address)) {
+		return;
+	}
+
+	// take as much code as a block may span, or the rest of the page if the next one isn't cached
+	CachedCode code;
+	uint32_t size = MAX_BB_SIZE;
+	uint64_t generation = job.block_cache->generation(job.address, size);
+	if (!code.load(job.page_cache, job.address, size)) {
+		size = PAGE_SIZE - (job.address & 0xFFF);
+		generation = job.block_cache->generation(job.address, size);
+		if (size >= MAX_BB_SIZE || !code.load(job.page_cache, job.address, size)) {
+			return;
+		}
+	}
+
+	int32_t lifted_size = 0;
+	std::vector<uint64_t> successors;
+	std::shared_ptr<block_entry_t> entry = State::check_lifted_block(job.guest, job.archinfo, job.address, size, code.bytes,
+			&lifted_size, job.depth < SPECULATIVE_DEPTH ? &successors : NULL);
+	if (!entry || lifted_size <= 0) {
+		return;
+	}
+	job.block_cache->offer(job.address, lifted_size, entry, size, generation);
+
+	for (uint64_t successor : successors) {
+		speculative_job_t next = job;
+		next.address = successor;
+		next.depth = job.depth + 1;
+		submit(next);
+	}
+}
+
+/*
+ * runs a batch of States, each on its own engine, on a few threads. every thread
+ * starts with an even share of the runs and takes them from the front of its
+ * queue; once that is empty it steals from the back of the others', so a few
+ * long runs don't leave the rest of the threads idle. the caller's thread is one
+ * of them.
+ */
+class BatchRunner {
+private:
+	struct queue_t {
+		std::mutex lock;
+		std::deque<batch_run_t *> runs;
+	};
+	std::vector<std::unique_ptr<queue_t>> queues;
+	std::atomic<bool> expired; // the deadline passed; running States stop at their next block
+	std::mutex done_lock;
+	std::condition_variable done_wake;
+	bool done;
+
+	batch_run_t *take(size_t self) {
+		for (size_t i = 0; i < queues.size(); i++) {
+			queue_t &queue = *queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.runs.empty()) {
+				continue;
+			}
+			batch_run_t *run;
+			if (i == 0) {
+				run = queue.runs.front();
+				queue.runs.pop_front();
+			} else {
+				run = queue.runs.back();
+				queue.runs.pop_back();
+			}
+			return run;
+		}
+		return NULL;
+	}
+
+	void work(size_t self) {
+		batch_run_t *run;
+		while (!expired.load(std::memory_order_relaxed) && (run = take(self)) != NULL) {
+			State *state = run->state;
+			state->cancel = &expired;
+			run->err = state->start(run->pc, run->step);
+			state->cancel = NULL;
+			run->status = state->cancelled ? BATCH_CANCELLED : BATCH_FINISHED;
 		}
+	}
 
-		return out;
+	void watch(std::chrono::steady_clock::time_point deadline) {
+		std::unique_lock<std::mutex> guard(done_lock);
+		if (!done_wake.wait_until(guard, deadline, [this] { return done; })) {
+			expired = true;
+		}
 	}
 
-	uint64_t get_stack_pointer() {
-		uint64_t out = 0;
-		unsigned int reg = arch_sp_reg();
-		if (reg == -1) {
-			out = 0;
-		} else {
-			uc_reg_read(uc, reg, &out);
+public:
+	BatchRunner() : expired(false), done(false) {}
+
+	/*
+	 * returns how many runs finished, or -1 if two of them share an engine.
+	 */
+	int64_t run(batch_run_t *runs, uint64_t count, uint64_t threads, uint64_t timeout_ms) {
+		std::unordered_set<uc_engine *> engines;
+		for (uint64_t i = 0; i < count; i++) {
+			if (!engines.insert(runs[i].state->engine()).second) {
+				return -1;
+			}
+			runs[i].err = UC_ERR_OK;
+			runs[i].status = BATCH_PENDING;
 		}
 
-		return out;
-	}
+		if (threads == 0) {
+			threads = std::max(std::thread::hardware_concurrency(), 1U);
+		}
+		threads = std::max(std::min(threads, count), (uint64_t)1);
+		for (uint64_t t = 0; t < threads; t++) {
+			queues.emplace_back(new queue_t());
+			for (uint64_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+				queues.back()->runs.push_back(&runs[i]);
+			}
+		}
 
-	void set_instruction_pointer(uint64_t val) {
-		unsigned int reg = arch_pc_reg();
-		if (reg != -1) {
-			uc_reg_write(uc, reg, &val);
+		std::thread watchdog;
+		if (timeout_ms != 0) {
+			watchdog = std::thread(&BatchRunner::watch, this,
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms));
+		}
+		std::vector<std::thread> workers;
+		for (uint64_t t = 1; t < threads; t++) {
+			workers.emplace_back(&BatchRunner::work, this, t);
+		}
+		work(0);
+		for (auto &worker : workers) {
+			worker.join();
+		}
+		if (watchdog.joinable()) {
+			{
+				std::lock_guard<std::mutex> guard(done_lock);
+				done = true;
+			}
+			done_wake.notify_one();
+			watchdog.join();
 		}
-	}
 
-	void set_stack_pointer(uint64_t val) {
-		unsigned int reg = arch_sp_reg();
-		if (reg != -1) {
-			uc_reg_write(uc, reg, &val);
+		int64_t finished = 0;
+		for (uint64_t i = 0; i < count; i++) {
+			finished += runs[i].status == BATCH_FINISHED;
 		}
+		return finished;
 	}
 };
 
 static void hook_mem_read(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
 	// uc_mem_read(uc, address, &value, size);
 	// //LOG_D("mem_read [%#lx, %#lx] = %#lx", address, address + size);
-	//LOG_D("mem_read [%#lx, %#lx]", address, address + size);
+	LOG_D("mem_read [%#lx, %#lx]", address, address + size);
 	State *state = (State *)user_data;
+	state->stats.mem_reads++;
 
 	auto tainted = state->find_tainted(address, size);
 	if (tainted != -1)
@@ -1071,8 +5016,9 @@ static void hook_mem_read(uc_engine *uc, uc_mem_type type, uint64_t address, int
  */
 
 static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
-	//LOG_D("mem_write [%#lx, %#lx]", address, address + size);
+	LOG_D("mem_write [%#lx, %#lx]", address, address + size);
 	State *state = (State *)user_data;
+	state->stats.mem_writes++;
 
 	if (state->ignore_next_selfmod) {
 		// ...the self-modification gets repeated for internal qemu reasons
@@ -1088,7 +5034,7 @@ static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, in
 }
 
 static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user_data) {
-	//LOG_I("block [%#lx, %#lx]", address, address + size);
+	LOG_D("block [%#lx, %#lx]", address, address + size);
 
 	State *state = (State *)user_data;
 	if (state->ignore_next_block) {
@@ -1101,7 +5047,14 @@ static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user
 
 	if (!state->stopped && !state->check_block(address, size)) {
 		state->stop(STOP_SYMBOLIC_REG);
-		//LOG_I("finishing early at address %#lx", address);
+		LOG_D("finishing early at address %#lx", address);
+	}
+}
+
+static void hook_stop_point(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+	State *state = (State *)user_data;
+	if (!state->stopped) {
+		state->stop_at_instruction(address);
 	}
 }
 
@@ -1113,11 +5066,8 @@ static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data) {
 		// this is the ultimate hack for cgc -- it must be enabled by explitly setting the transmit sysno from python
 		// basically an implementation of the cgc transmit syscall
 
-		for (auto sr : state->symbolic_registers)
-		{
-			// eax,ecx,edx,ebx,esi
-			if ((sr >= 8 && sr <= 23) || (sr >= 32 && sr <= 35)) return;
-		}
+		// eax,ecx,edx,ebx,esi
+		if (state->symbolic_registers.intersects_range(8, 16) || state->symbolic_registers.intersects_range(32, 4)) return;
 
 		uint32_t sysno;
 		uc_reg_read(uc, UC_X86_REG_EAX, &sysno);
@@ -1174,10 +5124,7 @@ static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data) {
 				state->transmit_records.push_back({dup_buf, count});
 				int result = 0;
 				uc_reg_write(uc, UC_X86_REG_EAX, &result);
-				state->symbolic_registers.erase(8);
-				state->symbolic_registers.erase(9);
-				state->symbolic_registers.erase(10);
-				state->symbolic_registers.erase(11);
+				state->symbolic_registers.erase_range(8, 4);
 				state->interrupt_handled = true;
 				state->syscall_count++;
 				return;
@@ -1193,10 +5140,12 @@ static bool hook_mem_unmapped(uc_engine *uc, uc_mem_type type, uint64_t address,
 
 	// only hook nonwritable pages
 	if (type != UC_MEM_WRITE_UNMAPPED && state->map_cache(start, 0x1000) && (start == end || state->map_cache(end, 0x1000))) {
-		//LOG_D("handle unmapped page natively");
+		LOG_D("handle unmapped page %#lx natively", start);
+		state->stats.page_cache_hits++;
 		return true;
 	}
 
+	state->stats.page_cache_misses++;
 	return false;
 }
 
@@ -1222,14 +5171,49 @@ void simunicorn_dealloc(State *state) {
 	delete state;
 }
 
+/*
+ * forget what we keep about uc across States, before it is closed: its stop
+ * points, and the references its mappings hold on cached pages. unicorn may
+ * hand the same address to the next engine it opens, which must not inherit
+ * any of it. every State on uc must be deallocated first.
+ */
+extern "C"
+void simunicorn_engine_closed(uc_engine *uc) {
+	release_mapped_pages(uc);
+	release_stop_points(uc);
+}
+
+/*
+ * clone a stopped state onto child_uc, a fresh engine of the same architecture
+ * that nothing else is using. returns NULL on failure, after which child_uc
+ * should be closed. the clone must be hooked before it runs.
+ */
+extern "C"
+State *simunicorn_fork(State *parent, uc_engine *child_uc) {
+	return parent->fork(child_uc);
+}
+
+/*
+ * start every run in runs, spread over threads native threads (one per cpu if
+ * 0), and return once they are all over or timeout_ms (if not 0) has passed.
+ * runs still going at the deadline stop at their next block. every State must
+ * be hooked and have an engine of its own, and nothing else may use them until
+ * this returns. returns how many runs finished, or -1 if two share an engine.
+ */
+extern "C"
+int64_t simunicorn_run_batch(batch_run_t *runs, uint64_t count, uint64_t threads, uint64_t timeout_ms) {
+	BatchRunner runner;
+	return runner.run(runs, count, threads, timeout_ms);
+}
+
 extern "C"
-uint64_t *simunicorn_bbl_addrs(State *state) {
-	return &(state->bbl_addrs[0]);
+const uint64_t *simunicorn_bbl_addrs(State *state) {
+	return state->bbl_addrs.data();
 }
 
 extern "C"
-uint64_t *simunicorn_stack_pointers(State *state) {
-	return &(state->stack_pointers[0]);
+const uint64_t *simunicorn_stack_pointers(State *state) {
+	return state->stack_pointers.data();
 }
 
 extern "C"
@@ -1237,11 +5221,92 @@ uint64_t simunicorn_bbl_addr_count(State *state) {
 	return state->bbl_addrs.size();
 }
 
+extern "C"
+uint64_t simunicorn_stack_pointer_count(State *state) {
+	return state->stack_pointers.size();
+}
+
+/*
+ * how the block addresses and stack pointers of the next run are kept: in full,
+ * only the last ring_size of each, or in full but compressed. see trace_mode_t.
+ */
+extern "C"
+void simunicorn_set_trace_mode(State *state, trace_mode_t mode, uint64_t ring_size) {
+	state->bbl_addrs.configure(mode, ring_size);
+	state->stack_pointers.configure(mode, ring_size);
+}
+
+/*
+ * copy up to max block addresses (or stack pointers, if stack is set) into
+ * output, oldest first. returns how many were copied.
+ */
+extern "C"
+uint64_t simunicorn_trace_decode(State *state, bool stack, uint64_t *output, uint64_t max) {
+	return (stack ? state->stack_pointers : state->bbl_addrs).decode(output, max);
+}
+
+/*
+ * count the edges between executed blocks into map, afl style: a block's
+ * location is hashed from its address, and the byte at the location xor the
+ * previous location shifted right by one is incremented. map is owned by the
+ * caller and may be shared memory; it is never cleared, and size should be a
+ * power of two. pass NULL to stop counting.
+ */
+extern "C"
+void simunicorn_set_coverage_map(State *state, uint8_t *map, uint64_t size) {
+	state->set_coverage_map(map, size);
+}
+
+/*
+ * Profiling
+ */
+
+/*
+ * count how often each block runs, how many instructions that makes and which
+ * blocks runs stop in, for every run started from now on. instructions are
+ * only counted once symbolic register tracking is enabled, as VEX counts them.
+ */
+extern "C"
+void simunicorn_set_profiling(bool enable) {
+	profile.enabled = enable;
+}
+
+extern "C"
+void simunicorn_reset_profile() {
+	profile.reset();
+}
+
+extern "C"
+uint64_t simunicorn_profile_size() {
+	return profile.size();
+}
+
+/*
+ * copy up to max blocks of the profile into output. returns how many were copied.
+ */
+extern "C"
+uint64_t simunicorn_profile_dump(profile_block_t *output, uint64_t max) {
+	return profile.dump(output, max);
+}
+
+/*
+ * copy the State's counters into stats. see stats_t.
+ */
+extern "C"
+void simunicorn_get_stats(State *state, stats_t *stats) {
+	*stats = state->stats;
+}
+
 extern "C"
 uint64_t simunicorn_syscall_count(State *state) {
 	return state->syscall_count;
 }
 
+extern "C"
+uint64_t simunicorn_smc_count(State *state) {
+	return state->smc_count;
+}
+
 extern "C"
 void simunicorn_hook(State *state) {
 	state->hook();
@@ -1262,11 +5327,57 @@ void simunicorn_stop(State *state, stop_t reason) {
 	state->stop(reason);
 }
 
+/*
+ * like simunicorn_start, but on a native thread, returning right away. wait for
+ * the run with simunicorn_wait before touching the State or its engine again.
+ * returns false if the State's last such run is still going.
+ */
+extern "C"
+bool simunicorn_start_async(State *state, uint64_t pc, uint64_t step) {
+	return state->start_async(pc, step);
+}
+
+/*
+ * wait up to timeout_ms, forever if negative, for the run started by
+ * simunicorn_start_async to end. returns whether it has, and puts what
+ * simunicorn_start would have returned into result.
+ */
+extern "C"
+bool simunicorn_wait(State *state, int64_t timeout_ms, uc_err *result) {
+	return state->wait_async(timeout_ms, result);
+}
+
+/*
+ * ask the run started by simunicorn_start_async to stop at its next block, with
+ * STOP_NORMAL as if it had run out of steps. safe to call from any thread.
+ */
+extern "C"
+void simunicorn_cancel(State *state) {
+	state->cancel_async();
+}
+
 extern "C"
 mem_update_t *simunicorn_sync(State *state) {
 	return state->sync();
 }
 
+/*
+ * write all dirty ranges and their contents into a caller-owned buffer. returns
+ * the size needed, and writes nothing if capacity falls short of it.
+ */
+extern "C"
+uint64_t simunicorn_sync_into(State *state, uint8_t *buffer, uint64_t capacity) {
+	return state->sync_into(buffer, capacity);
+}
+
+/*
+ * the same, into a buffer owned by the state that stays valid until the next sync
+ */
+extern "C"
+uint8_t *simunicorn_sync_export(State *state, uint64_t *size) {
+	return state->sync_export(size);
+}
+
 extern "C"
 void simunicorn_destroy(mem_update_t * head) {
 	mem_update_t *next;
@@ -1287,6 +5398,18 @@ void simunicorn_set_stops(State *state, uint64_t count, uint64_t *stops)
 	state->set_stops(count, stops);
 }
 
+extern "C"
+void simunicorn_add_stops(State *state, uint64_t count, uint64_t *stops)
+{
+	state->add_stops(count, stops);
+}
+
+extern "C"
+void simunicorn_remove_stops(State *state, uint64_t count, uint64_t *stops)
+{
+	state->remove_stops(count, stops);
+}
+
 extern "C"
 void simunicorn_activate(State *state, uint64_t address, uint64_t length, uint8_t *taint) {
 	// //LOG_D("activate [%#lx, %#lx]", address, address + length);
@@ -1338,19 +5461,18 @@ uint64_t simunicorn_stopping_memory(State *state) {
 extern "C"
 void simunicorn_symbolic_register_data(State *state, uint64_t count, uint64_t *offsets)
 {
-	state->symbolic_registers.clear();
-	for (int i = 0; i < count; i++)
-	{
-		state->symbolic_registers.insert(offsets[i]);
-	}
+	state->set_symbolic_registers(offsets, count);
 }
 
 extern "C"
 uint64_t simunicorn_get_symbolic_registers(State *state, uint64_t *output)
 {
 	int i = 0;
-	for (auto r : state->symbolic_registers)
-	{
+	state->symbolic_registers.for_each([&](uint64_t r) {
+		output[i] = r;
+		i++;
+	});
+	for (uint64_t r : state->untracked_registers) {
 		output[i] = r;
 		i++;
 	}
@@ -1406,7 +5528,7 @@ transmit_record_t *simunicorn_process_transmit(State *state, uint32_t num) {
 
 extern "C"
 bool simunicorn_cache_page(State *state, uint64_t address, uint64_t length, char *bytes, uint64_t permissions) {
-	//LOG_I("caching [%#lx, %#lx]", address, address + length);
+	LOG_D("caching [%#lx, %#lx]", address, address + length);
 
 	auto actual = state->cache_page(address, length, bytes, permissions);
 	if (!state->map_cache(actual.first, actual.second)) {
@@ -1425,6 +5547,238 @@ void simunicorn_clear_page_cache(State *state) {
 	state->clear_page_cache();
 }
 
+/*
+ * Page cache snapshots
+ */
+
+/*
+ * write every page cached under cache_key to a snapshot file at path. the file is
+ * replaced atomically, so processes loading it never see a partial snapshot.
+ */
+extern "C"
+bool simunicorn_save_page_cache(uint64_t cache_key, const char *path) {
+	PageCache *page_cache;
+	{
+		std::lock_guard<std::mutex> guard(global_cache_lock);
+		auto it = global_cache.find(cache_key);
+		if (it == global_cache.end()) {
+			return false;
+		}
+		page_cache = it->second.page_cache;
+	}
+
+	// hold on to the pages so a concurrent wipe can't change what we write
+	std::vector<std::pair<uint64_t, CachedPage>> pages;
+	for (uint64_t address : page_cache->addresses()) {
+		CachedPage page;
+		if (page_cache->get(address, &page)) {
+			pages.push_back(std::make_pair(address, page));
+		}
+	}
+
+	std::string temp_path = std::string(path) + ".tmp";
+	FILE *f = fopen(temp_path.c_str(), "wb");
+	bool success = f != NULL;
+	if (success) {
+		page_cache_snapshot_header_t header = {PAGE_CACHE_SNAPSHOT_MAGIC, PAGE_CACHE_SNAPSHOT_VERSION, pages.size()};
+		success &= fwrite(&header, sizeof(header), 1, f) == 1;
+		for (auto &page : pages) {
+			page_cache_snapshot_entry_t entry = {page.first, page.second.perms};
+			success &= fwrite(&entry, sizeof(entry), 1, f) == 1;
+		}
+		uint64_t written = sizeof(header) + pages.size() * sizeof(page_cache_snapshot_entry_t);
+		std::vector<uint8_t> padding(page_cache_snapshot_data_offset(pages.size()) - written);
+		success &= fwrite(padding.data(), 1, padding.size(), f) == padding.size();
+		for (auto &page : pages) {
+			success &= fwrite(page.second.data->bytes, PAGE_SIZE, 1, f) == 1;
+		}
+		success &= fclose(f) == 0;
+	}
+	for (auto &page : pages) {
+		page_store.put(page.second.data);
+	}
+
+	if (success) {
+#ifdef _WIN32
+		remove(path);
+#endif
+		success = rename(temp_path.c_str(), path) == 0;
+	}
+	if (!success) {
+		remove(temp_path.c_str());
+	}
+	return success;
+}
+
+extern "C"
+bool simunicorn_load_page_cache(State *state, const char *path) {
+	return state->load_page_cache_snapshot(path);
+}
+
+/*
+ * Run snapshots
+ */
+
+/*
+ * record the next run of state into a snapshot at path, for native/replay. see
+ * run_snapshot_header_t.
+ */
+extern "C"
+bool simunicorn_record_run(State *state, const char *path) {
+	return state->record_run(path);
+}
+
+/*
+ * open a new engine, *uc, and set it up as the snapshot at path was, into a new
+ * hooked State ready for simunicorn_start(state, *pc, *step), to be freed with
+ * simunicorn_unload_run. returns NULL if the snapshot can't be read or restored.
+ */
+extern "C"
+State *simunicorn_load_run(const char *path, uc_engine **uc, uint64_t *pc, uint64_t *step) {
+	RunSnapshot snapshot;
+	if (!snapshot.read(path)) {
+		return NULL;
+	}
+	const run_snapshot_header_t &header = snapshot.header;
+	if (uc_open((uc_arch)header.arch, (uc_mode)header.mode, uc) != UC_ERR_OK) {
+		return NULL;
+	}
+
+	bool success = true;
+	for (auto &it : snapshot.pages) {
+		const RunSnapshot::page_t &page = it.second;
+		success &= uc_mem_map(*uc, page.info.address, PAGE_SIZE, page.info.perms) == UC_ERR_OK &&
+			uc_mem_write(*uc, page.info.address, page.bytes.data(), PAGE_SIZE) == UC_ERR_OK;
+	}
+	// after the memory, which the x86 segment registers are loaded from
+	for (auto &reg : snapshot.registers) {
+		uc_reg_write(*uc, reg.id, reg.value);
+	}
+
+	State *state = new State(*uc, header.cache_key);
+	for (auto &it : snapshot.pages) {
+		const RunSnapshot::page_t &page = it.second;
+		if (page.info.flags & RUN_SNAPSHOT_PAGE_TAINT) {
+			state->page_activate(page.info.address, (uint8_t *)page.taint.data());
+		}
+	}
+	for (auto &it : snapshot.cached_pages) {
+		const RunSnapshot::page_t &page = it.second;
+		if (!state->in_cache(page.info.address)) {
+			state->cache_page(page.info.address, PAGE_SIZE, (char *)page.bytes.data(), page.info.perms);
+		}
+		if (page.info.flags & RUN_SNAPSHOT_PAGE_MAPPED) {
+			success &= state->map_cache(page.info.address, PAGE_SIZE);
+		}
+	}
+	if (!success) {
+		delete state;
+		release_mapped_pages(*uc);
+		release_stop_points(*uc);
+		uc_close(*uc);
+		*uc = NULL;
+		return NULL;
+	}
+
+	state->set_stops(snapshot.stops.size(), snapshot.stops.data());
+	state->set_symbolic_registers(snapshot.symbolic_registers.data(), snapshot.symbolic_registers.size());
+	state->vex_guest = (VexArch)header.vex_guest;
+	state->vex_archinfo = header.vex_archinfo;
+	state->track_bbls = header.track_bbls;
+	state->track_stack = header.track_stack;
+	state->transmit_sysno = header.transmit_sysno;
+	state->transmit_bbl_addr = header.transmit_bbl_addr;
+	state->hook();
+	*pc = header.pc;
+	*step = header.step;
+	return state;
+}
+
+/*
+ * deallocate a State from simunicorn_load_run, and close the engine it opened.
+ */
+extern "C"
+void simunicorn_unload_run(State *state) {
+	uc_engine *uc = state->engine();
+	state->unhook();
+	delete state;
+	simunicorn_engine_closed(uc);
+	uc_close(uc);
+}
+
+/*
+ * Block cache file
+ */
+
+/*
+ * persist feasibility results for lifted blocks in the file at path, shared by
+ * every State in the process and by other processes using the same file. blocks
+ * already recorded there are not lifted again. pass NULL to stop using the file.
+ */
+extern "C"
+bool simunicorn_set_block_cache_file(const char *path) {
+	std::shared_ptr<BlockCacheFile> file;
+	if (path != NULL) {
+		file.reset(new BlockCacheFile());
+		if (!file->open(path)) {
+			return false;
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(block_cache_file_lock);
+	block_cache_file = file;
+	return true;
+}
+
+/*
+ * Trace file
+ */
+
+/*
+ * stream the block addresses, stack pointers and executed pages of every run
+ * from now on to a new file at path, in the format of trace_file_header_t and
+ * trace_chunk_header_t. pass NULL to stop; runs already going finish their
+ * traces, and the file is complete once the last of them is done.
+ */
+extern "C"
+bool simunicorn_set_trace_file(const char *path) {
+	std::shared_ptr<TraceSink> sink;
+	if (path != NULL) {
+		sink.reset(new TraceSink());
+		if (!sink->open(path)) {
+			return false;
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(trace_sink_lock);
+	trace_sink = sink;
+	return true;
+}
+
+/*
+ * turn lifting the successors of lifted blocks in the background, during native
+ * runs, on or off. it is off by default.
+ */
+extern "C"
+void simunicorn_set_speculative_lifting(bool enable) {
+	speculative_lifter.set_enabled(enable);
+}
+
+/*
+ * hold the lock native code lifts with, so that a pyvex lift and its use of the
+ * libVEX arena don't run into one on a native thread. python takes it around
+ * every lift, and must not call into this library while holding it.
+ */
+extern "C"
+void simunicorn_lift_lock() {
+	vex_lift_lock.lock();
+}
+
+extern "C"
+void simunicorn_lift_unlock() {
+	vex_lift_lock.unlock();
+}
+
 // Tracking settings
 extern "C"
 void simunicorn_set_tracking(State *state, bool track_bbls, bool track_stack) {
@@ -0,0 +1,179 @@
+/*
+ * The C interface of sim_unicorn.cpp, for the programs built alongside it
+ * (bench.cpp, replay.cpp). angr calls the same functions through ctypes, in
+ * angr/state_plugins/unicorn_engine.py, which keeps its own copy of the types
+ * below and has to be changed with them.
+ */
+#ifndef SIM_UNICORN_H
+#define SIM_UNICORN_H
+
+#include <unicorn/unicorn.h>
+
+#include <cstdint>
+
+extern "C" {
+#include <libvex.h>
+}
+
+typedef enum stop {
+	STOP_NORMAL=0,
+	STOP_STOPPOINT,
+	STOP_SYMBOLIC_MEM,
+	STOP_SYMBOLIC_REG,
+	STOP_ERROR,
+	STOP_SYSCALL,
+	STOP_EXECNONE,
+	STOP_ZEROPAGE,
+	STOP_NOSTART,
+	STOP_SEGFAULT,
+	STOP_ZERO_DIV,
+	STOP_NODECODE,
+	STOP_HLT,
+} stop_t;
+
+#define STOP_REASONS (STOP_HLT + 1)
+
+static const char *const stop_names[STOP_REASONS] = {
+	"STOP_NORMAL",
+	"STOP_STOPPOINT",
+	"STOP_SYMBOLIC_MEM",
+	"STOP_SYMBOLIC_REG",
+	"STOP_ERROR",
+	"STOP_SYSCALL",
+	"STOP_EXECNONE",
+	"STOP_ZEROPAGE",
+	"STOP_NOSTART",
+	"STOP_SEGFAULT",
+	"STOP_ZERO_DIV",
+	"STOP_NODECODE",
+	"STOP_HLT",
+};
+
+typedef enum trace_mode {
+	TRACE_FULL = 0, // every entry, as is
+	TRACE_RING,     // only the most recent entries
+	TRACE_COMPRESSED, // every entry, delta and varint encoded
+} trace_mode_t;
+
+/*
+ * what a State did, to find out where the time goes. counted from the State's
+ * creation.
+ */
+typedef struct stats {
+	uint64_t blocks; // blocks entered, including ones rolled back
+	uint64_t mem_reads; // hook_mem_read calls
+	uint64_t mem_writes; // hook_mem_write calls
+	uint64_t taint_lookups; // pages looked up for taint by those
+	uint64_t rollbacks;
+	uint64_t block_cache_hits;
+	uint64_t block_cache_misses;
+	uint64_t speculative_hits; // misses that a speculative lift had covered
+	uint64_t lifts;
+	uint64_t lift_ns; // spent in lift_block
+	uint64_t page_cache_hits; // unmapped accesses served from the page cache
+	uint64_t page_cache_misses; // unmapped accesses left to python
+	uint64_t sync_ranges;
+	uint64_t sync_bytes;
+	uint64_t trace_chunks_dropped; // trace file chunks dropped while its writer was behind
+	uint64_t stops[STOP_REASONS]; // runs, by how they stopped
+} stats_t;
+
+// the counters of stats_t before stops, in order
+static const char *const stats_names[] = {
+	"blocks",
+	"mem_reads",
+	"mem_writes",
+	"taint_lookups",
+	"rollbacks",
+	"block_cache_hits",
+	"block_cache_misses",
+	"speculative_hits",
+	"lifts",
+	"lift_ns",
+	"page_cache_hits",
+	"page_cache_misses",
+	"sync_ranges",
+	"sync_bytes",
+	"trace_chunks_dropped",
+};
+
+class State;
+typedef struct mem_update mem_update_t;
+typedef struct transmit_record transmit_record_t;
+typedef struct profile_block profile_block_t;
+typedef struct batch_run batch_run_t;
+
+extern "C" {
+State *simunicorn_alloc(uc_engine *uc, uint64_t cache_key);
+void simunicorn_dealloc(State *state);
+void simunicorn_engine_closed(uc_engine *uc);
+State *simunicorn_fork(State *parent, uc_engine *child_uc);
+int64_t simunicorn_run_batch(batch_run_t *runs, uint64_t count, uint64_t threads, uint64_t timeout_ms);
+
+void simunicorn_hook(State *state);
+void simunicorn_unhook(State *state);
+uc_err simunicorn_start(State *state, uint64_t pc, uint64_t step);
+void simunicorn_stop(State *state, stop_t reason);
+bool simunicorn_start_async(State *state, uint64_t pc, uint64_t step);
+bool simunicorn_wait(State *state, int64_t timeout_ms, uc_err *result);
+void simunicorn_cancel(State *state);
+uint64_t simunicorn_step(State *state);
+stop_t simunicorn_stop_reason(State *state);
+uint64_t simunicorn_stopping_register(State *state);
+uint64_t simunicorn_stopping_memory(State *state);
+
+mem_update_t *simunicorn_sync(State *state);
+uint64_t simunicorn_sync_into(State *state, uint8_t *buffer, uint64_t capacity);
+uint8_t *simunicorn_sync_export(State *state, uint64_t *size);
+void simunicorn_destroy(mem_update_t *head);
+void simunicorn_activate(State *state, uint64_t address, uint64_t length, uint8_t *taint);
+uint64_t simunicorn_executed_pages(State *state);
+
+void simunicorn_set_stops(State *state, uint64_t count, uint64_t *stops);
+void simunicorn_add_stops(State *state, uint64_t count, uint64_t *stops);
+void simunicorn_remove_stops(State *state, uint64_t count, uint64_t *stops);
+
+void simunicorn_symbolic_register_data(State *state, uint64_t count, uint64_t *offsets);
+uint64_t simunicorn_get_symbolic_registers(State *state, uint64_t *output);
+void simunicorn_enable_symbolic_reg_tracking(State *state, VexArch guest, VexArchInfo archinfo);
+void simunicorn_disable_symbolic_reg_tracking(State *state);
+
+bool simunicorn_is_interrupt_handled(State *state);
+void simunicorn_set_transmit_sysno(State *state, uint32_t sysno, uint64_t bbl_addr);
+transmit_record_t *simunicorn_process_transmit(State *state, uint32_t num);
+uint64_t simunicorn_syscall_count(State *state);
+uint64_t simunicorn_smc_count(State *state);
+
+bool simunicorn_cache_page(State *state, uint64_t address, uint64_t length, char *bytes, uint64_t permissions);
+void simunicorn_uncache_pages_touching_region(State *state, uint64_t address, uint64_t length);
+void simunicorn_clear_page_cache(State *state);
+bool simunicorn_in_cache(State *state, uint64_t address);
+bool simunicorn_save_page_cache(uint64_t cache_key, const char *path);
+bool simunicorn_load_page_cache(State *state, const char *path);
+bool simunicorn_set_block_cache_file(const char *path);
+void simunicorn_set_speculative_lifting(bool enable);
+void simunicorn_lift_lock();
+void simunicorn_lift_unlock();
+
+bool simunicorn_record_run(State *state, const char *path);
+State *simunicorn_load_run(const char *path, uc_engine **uc, uint64_t *pc, uint64_t *step);
+void simunicorn_unload_run(State *state);
+
+void simunicorn_set_tracking(State *state, bool track_bbls, bool track_stack);
+const uint64_t *simunicorn_bbl_addrs(State *state);
+const uint64_t *simunicorn_stack_pointers(State *state);
+uint64_t simunicorn_bbl_addr_count(State *state);
+uint64_t simunicorn_stack_pointer_count(State *state);
+void simunicorn_set_trace_mode(State *state, trace_mode_t mode, uint64_t ring_size);
+uint64_t simunicorn_trace_decode(State *state, bool stack, uint64_t *output, uint64_t max);
+bool simunicorn_set_trace_file(const char *path);
+void simunicorn_set_coverage_map(State *state, uint8_t *map, uint64_t size);
+
+void simunicorn_set_profiling(bool enable);
+void simunicorn_reset_profile();
+uint64_t simunicorn_profile_size();
+uint64_t simunicorn_profile_dump(profile_block_t *output, uint64_t max);
+void simunicorn_get_stats(State *state, stats_t *stats);
+}
+
+#endif
@@ -89,6 +89,8 @@ def _clean_native():
     oglob += glob.glob('native/*.so')
     oglob += glob.glob('native/*.dll')
     oglob += glob.glob('native/*.dylib')
+    oglob += glob.glob('native/bench')
+    oglob += glob.glob('native/replay')
     for fname in oglob:
         os.unlink(fname)
 
@@ -6,9 +6,48 @@ from angr import options as so
 from nose.plugins.attrib import attr
 
 import os
+import contextlib
+import tempfile
 test_location = os.path.join(os.path.dirname(os.path.realpath(__file__)), '..', '..')
 
+def _fauxware():
+    return angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
 
+def _explore_fauxware(p=None, setup=None):
+    """
+    Explore fauxware from its entry with unicorn, after calling setup on the entry state if given.
+
+    :return:    The simulation manager, with every path deadended.
+    """
+    p = _fauxware() if p is None else p
+    s_unicorn = p.factory.entry_state(add_options=so.unicorn)
+    if setup is not None:
+        setup(s_unicorn)
+    pg = p.factory.simulation_manager(s_unicorn)
+    pg.explore()
+    return pg
+
+@contextlib.contextmanager
+def _temp_path():
+    """
+    The path of an empty temporary file, removed afterwards if it still exists.
+    """
+    fd, path = tempfile.mkstemp()
+    os.close(fd)
+    try:
+        yield path
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+
+
+def _stops_mid_block():
+    """
+    Whether runs stop right at a stop point in the middle of a block. On unicorn 1, which can't drop a translation to
+    rerun it with the stop point hooked, they stop at the start of the block instead.
+    """
+    import unicorn
+    return unicorn.uc_version()[0] >= 2
 
 def _remove_addr_from_trace_item(trace_item_str):
     m = re.match(r"(<\S+ \S+) from 0x[0-9a-f]+(:[\s\S]+)", trace_item_str)
@@ -53,12 +92,16 @@ def test_stops():
 
     # this is an address inside main that is not the beginning of a basic block. we should stop here
     stop_in_bb = 0x08048511
-    stop_bb = 0x0804850c # basic block of the above address
     pg_stoppoints = p.factory.simulation_manager(s_stoppoints).run(n=1, extra_stop_points=stop_fake + [stop_in_bb])
     nose.tools.assert_equal(len(pg_stoppoints.active), 1) # path should not branch
     p_stoppoints = pg_stoppoints.one_active
-    nose.tools.assert_equal(p_stoppoints.addr, stop_bb) # should stop at bb before stop_in_bb
-    _compare_trace(p_stoppoints.history.descriptions, ['<Unicorn (STOP_STOPPOINT after 107 steps) from 0x80484b6: 1 sat>'])
+    if _stops_mid_block():
+        nose.tools.assert_equal(p_stoppoints.addr, stop_in_bb) # should stop right at the instruction
+        # the part of the block before stop_in_bb counts as a step
+        _compare_trace(p_stoppoints.history.descriptions, ['<Unicorn (STOP_STOPPOINT after 108 steps) from 0x80484b6: 1 sat>'])
+    else:
+        nose.tools.assert_equal(p_stoppoints.addr, 0x0804850c) # the start of the block stop_in_bb is in
+        _compare_trace(p_stoppoints.history.descriptions, ['<Unicorn (STOP_STOPPOINT after 107 steps) from 0x80484b6: 1 sat>'])
 
     # test STOP_SYMBOLIC
     s_symbolic = p.factory.entry_state(args=['a', 'a'], add_options=so.unicorn)
@@ -85,6 +128,67 @@ def test_stops():
     nose.tools.assert_equal(p_segfault_angr.history.bbl_addrs.hardcopy, p_segfault.history.bbl_addrs.hardcopy)
     nose.tools.assert_equal(pg_segfault_angr.errored[0].error.addr, pg_segfault.errored[0].error.addr)
 
+def test_stops_incremental():
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'uc_stop'))
+    base = p.factory.call_state(p.loader.find_symbol("main").rebased_addr, 1, [], add_options=so.unicorn)
+    stop = 0x0804850c
+
+    # copies of a state share an engine, and runs after the first only send it what changed in the stop points
+    native = angr.state_plugins.unicorn_engine._UC_NATIVE
+    sent = []
+    def record(name):
+        function = getattr(native, name)
+        def send(*args):
+            sent.append(name)
+            return function(*args)
+        setattr(native, name, send)
+        return function
+    originals = { name: record(name) for name in ('set_stops', 'add_stops', 'remove_stops') }
+    try:
+        pg = p.factory.simulation_manager(base.copy()).run(n=1, extra_stop_points=[stop])
+        nose.tools.assert_equal(pg.one_active.addr, stop)
+        nose.tools.assert_equal(sent, ['set_stops'])
+
+        pg = p.factory.simulation_manager(base.copy()).run(n=1)
+        nose.tools.assert_not_in(stop, [s.addr for s in pg.active])
+        nose.tools.assert_equal(sent, ['set_stops', 'remove_stops'])
+
+        pg = p.factory.simulation_manager(base.copy()).run(n=1, extra_stop_points=[stop])
+        nose.tools.assert_equal(pg.one_active.addr, stop)
+        nose.tools.assert_equal(sent, ['set_stops', 'remove_stops', 'add_stops'])
+    finally:
+        for name, function in originals.items():
+            setattr(native, name, function)
+
+def test_stops_thumb():
+    from angr.state_plugins.unicorn_engine import STOP
+
+    code = bytes(bytearray([
+        0x00, 0x20, # 400000: movs r0, #0
+        0x01, 0x30, # 400002: adds r0, #1
+        0x02, 0x30, # 400004: adds r0, #2
+        0x04, 0x30, # 400006: adds r0, #4
+        0xfe, 0xe7, # 400008: b 400008
+    ]))
+    p = angr.load_shellcode(code, 'armel', load_address=0x400000, thumb=True)
+    s = p.factory.blank_state(addr=0x400001, add_options=so.unicorn)
+
+    # the block is run again up to the stop point, which has to stay in thumb mode
+    s.unicorn.setup()
+    s.unicorn.set_stops({0x400006})
+    s.unicorn.set_tracking(track_bbls=True, track_stack=False)
+    s.unicorn.hook()
+    s.unicorn.start()
+    s.unicorn.finish()
+    s.unicorn.destroy()
+
+    nose.tools.assert_equal(s.unicorn.stop_reason, STOP.STOP_STOPPOINT)
+    if _stops_mid_block():
+        nose.tools.assert_equal(s.solver.eval(s.regs.pc) & ~1, 0x400006)
+        nose.tools.assert_equal(s.solver.eval(s.regs.r0), 1 + 2)
+    else:
+        nose.tools.assert_equal(s.solver.eval(s.regs.pc) & ~1, 0x400000)
+
 def run_longinit(arch):
     p = angr.Project(os.path.join(test_location, 'binaries', 'tests', arch, 'longinit'))
     s_unicorn = p.factory.entry_state(add_options=so.unicorn, remove_options={so.SHORT_READS})
@@ -114,6 +218,461 @@ def test_fauxware():
         b'Username: \nPassword: \nWelcome to the admin console, trusted user!\n'
     )))
 
+def test_fauxware_threads():
+    # every copy shares the cache_key of the base state, so all threads hit the same native page and block caches
+    import threading
+
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    base = p.factory.entry_state(add_options=so.unicorn)
+    expected = sorted((
+        b'Username: \nPassword: \nWelcome to the admin console, trusted user!\n',
+        b'Username: \nPassword: \nGo away!',
+        b'Username: \nPassword: \nWelcome to the admin console, trusted user!\n'
+    ))
+
+    results = [ None ] * 8
+    def explore(i):
+        pg = p.factory.simulation_manager(base.copy())
+        pg.explore()
+        results[i] = sorted(pg.mp_deadended.posix.dumps(1).mp_items)
+
+    threads = [ threading.Thread(target=explore, args=(i,)) for i in range(len(results)) ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    for r in results:
+        nose.tools.assert_equal(r, expected)
+
+def test_block_cache_file():
+    from angr.state_plugins.unicorn_engine import set_block_cache_file
+
+    p = _fauxware()
+    def no_cooldowns(s):
+        # so that unicorn keeps running with symbolic registers and has to check blocks
+        s.unicorn.cooldown_symbolic_registers = 0
+        s.unicorn.cooldown_symbolic_memory = 0
+        s.unicorn.cooldown_nonunicorn_blocks = 0
+
+    with _temp_path() as path:
+        os.unlink(path)
+        try:
+            outputs = [ ]
+            sizes = [ ]
+            for _ in range(2):
+                # a fresh file handle each time, like a new process would get
+                nose.tools.assert_true(set_block_cache_file(path))
+                pg = _explore_fauxware(p, no_cooldowns)
+                outputs.append(sorted(pg.mp_deadended.posix.dumps(1).mp_items))
+                sizes.append(os.path.getsize(path))
+        finally:
+            set_block_cache_file(None)
+
+    nose.tools.assert_equal(outputs[0], outputs[1])
+    # the second run found every block in the file and appended nothing
+    nose.tools.assert_greater(sizes[0], 8)
+    nose.tools.assert_equal(sizes[0], sizes[1])
+
+def test_page_cache_snapshot():
+    p = _fauxware()
+    pg = _explore_fauxware(p)
+    expected = sorted(pg.mp_deadended.posix.dumps(1).mp_items)
+
+    with _temp_path() as path:
+        nose.tools.assert_true(pg.deadended[0].unicorn.save_page_cache(path))
+        nose.tools.assert_greater(os.path.getsize(path), 4096)
+
+        # a new cache_key starts out with an empty page cache, filled from the snapshot
+        def use_snapshot(s):
+            s.unicorn.page_cache_snapshot = path
+        pg_snapshot = _explore_fauxware(p, use_snapshot)
+        nose.tools.assert_equal(sorted(pg_snapshot.mp_deadended.posix.dumps(1).mp_items), expected)
+
+        # a corrupt entry makes the load fail, before anything is cached
+        import struct
+        native = angr.state_plugins.unicorn_engine._UC_NATIVE
+        with open(path, 'rb') as f:
+            snapshot = f.read()
+        address, perms = struct.unpack_from('<QQ', snapshot, 16) # the first entry, after the header
+        for entry in ((address + 1, perms), (address, perms | 0x100)):
+            with _temp_path() as corrupt:
+                with open(corrupt, 'wb') as f:
+                    f.write(snapshot[:16] + struct.pack('<QQ', *entry) + snapshot[32:])
+                s = p.factory.entry_state(add_options=so.unicorn)
+                s.unicorn.setup()
+                try:
+                    nose.tools.assert_false(native.load_page_cache(s.unicorn._uc_state, corrupt.encode()))
+                finally:
+                    s.unicorn.destroy()
+
+def test_run_snapshot():
+    import struct
+    from angr.state_plugins.unicorn_engine import replay_snapshot
+
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    directory = tempfile.mkdtemp()
+    path = os.path.join(directory, 'run')
+    try:
+        s_unicorn = p.factory.entry_state(add_options=so.unicorn)
+        s_unicorn.unicorn.dump_snapshot(path)
+        successors = s_unicorn.step()
+        run = successors.all_successors[0]
+
+        # written by the first native run, and only that one: neither the state stepped nor its other copies record
+        nose.tools.assert_is_none(run.unicorn.run_snapshot)
+        nose.tools.assert_false(s_unicorn.unicorn.run_snapshot)
+        with open(path, 'rb') as f:
+            magic, version = struct.unpack('<II', f.read(8))
+        nose.tools.assert_equal(magic, 0x31535253)
+        nose.tools.assert_equal(version, 1)
+        nose.tools.assert_equal(os.listdir(directory), ['run'])
+
+        # the replay runs the same blocks, and stops the same way
+        nose.tools.assert_equal(replay_snapshot(path), (run.unicorn.steps, run.unicorn.stop_reason))
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+        os.rmdir(directory)
+
+def _prepare_unicorn(state):
+    state.unicorn.setup()
+    state.unicorn.set_stops(set())
+    state.unicorn.set_tracking(track_bbls=True, track_stack=False)
+    state.unicorn.hook()
+
+def _run_alone(base):
+    """
+    Run a copy of base with start(), as the reference for runs started some other way.
+    """
+    alone = base.copy()
+    _prepare_unicorn(alone)
+    alone.unicorn.start()
+    alone.unicorn.finish()
+    alone.unicorn.destroy()
+    return alone
+
+def test_run_batch():
+    from angr.state_plugins.unicorn_engine import run_batch, BATCH
+
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    base = p.factory.entry_state(add_options=so.unicorn)
+    base.unicorn.own_engine = True
+
+    alone = _run_alone(base)
+
+    states = [ base.copy() for _ in range(6) ]
+    for state in states:
+        _prepare_unicorn(state)
+    nose.tools.assert_equal(run_batch([ state.unicorn for state in states ], threads=3), [ BATCH.BATCH_FINISHED ] * 6)
+    for state in states:
+        state.unicorn.finish()
+        state.unicorn.destroy()
+        nose.tools.assert_equal(state.unicorn.steps, alone.unicorn.steps)
+        nose.tools.assert_equal(state.unicorn.stop_reason, alone.unicorn.stop_reason)
+        nose.tools.assert_equal(state.addr, alone.addr)
+
+    # another thread can lift with pyvex while the batch lifts natively
+    import threading
+    base.regs.xmm7 = base.solver.BVS('unused', 128) # a symbolic register gets every block lifted and checked
+    alone = _run_alone(base)
+    def lift_all():
+        # collect_data_refs keeps the lifter's cache out of it
+        return [ str(p.factory.default_engine.lift_vex(addr=addr, collect_data_refs=True))
+                 for addr in alone.history.recent_bbl_addrs ]
+    expected = lift_all()
+    lifted = [ ]
+    lifter = threading.Thread(target=lambda: lifted.extend(lift_all()))
+    states = [ base.copy() for _ in range(6) ]
+    for state in states:
+        _prepare_unicorn(state)
+    lifter.start()
+    nose.tools.assert_equal(run_batch([ state.unicorn for state in states ], threads=3), [ BATCH.BATCH_FINISHED ] * 6)
+    lifter.join()
+    nose.tools.assert_equal(lifted, expected)
+    for state in states:
+        state.unicorn.finish()
+        state.unicorn.destroy()
+        nose.tools.assert_equal(state.unicorn.steps, alone.unicorn.steps)
+
+    # states sharing their thread's engine can't run side by side
+    shared = [ p.factory.entry_state(add_options=so.unicorn) for _ in range(2) ]
+    for state in shared:
+        state.unicorn.setup()
+    nose.tools.assert_raises(ValueError, run_batch, [ state.unicorn for state in shared ])
+    for state in shared:
+        state.unicorn.destroy()
+
+def test_fork():
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    parent = p.factory.entry_state(add_options=so.unicorn)
+    parent.unicorn.own_engine = True
+    _prepare_unicorn(parent)
+    parent.unicorn.start(20)
+    parent.unicorn.finish()
+
+    # a copy of the state after the run, set up from the parent's native state
+    child = parent.copy()
+    child.unicorn.setup_from(parent.unicorn)
+    eip = p.arch.uc_regs['eip']
+    nose.tools.assert_equal(child.unicorn.uc.reg_read(eip), parent.unicorn.uc.reg_read(eip))
+
+    # the child's memory is its own
+    sp = parent.solver.eval(parent.regs.sp)
+    before = bytes(parent.unicorn.uc.mem_read(sp, 4))
+    nose.tools.assert_equal(bytes(child.unicorn.uc.mem_read(sp, 4)), before)
+    child.unicorn.uc.mem_write(sp, b'\xcc' * 4)
+    nose.tools.assert_equal(bytes(child.unicorn.uc.mem_read(sp, 4)), b'\xcc' * 4)
+    nose.tools.assert_equal(bytes(parent.unicorn.uc.mem_read(sp, 4)), before)
+
+    child.unicorn.destroy()
+    parent.unicorn.destroy()
+
+def test_start_async():
+    from angr.errors import SimUnicornError
+
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    base = p.factory.entry_state(add_options=so.unicorn)
+    base.unicorn.own_engine = True
+
+    alone = _run_alone(base)
+
+    state = base.copy()
+    _prepare_unicorn(state)
+    run = state.unicorn.start_async()
+    nose.tools.assert_true(run.wait(timeout=60))
+    nose.tools.assert_true(run.poll())
+    state.unicorn.finish()
+    state.unicorn.destroy()
+    nose.tools.assert_equal(state.unicorn.steps, alone.unicorn.steps)
+    nose.tools.assert_equal(state.addr, alone.addr)
+
+    # stopped runs end at a block, and can be picked up from there
+    state = base.copy()
+    _prepare_unicorn(state)
+    run = state.unicorn.start_async()
+    run.stop()
+    run.wait()
+    state.unicorn.finish()
+    state.unicorn.destroy()
+    nose.tools.assert_less_equal(state.unicorn.steps, alone.unicorn.steps)
+
+    # this thread can lift with pyvex while the run lifts natively
+    lifting = base.copy()
+    lifting.regs.xmm7 = lifting.solver.BVS('unused', 128) # a symbolic register gets every block lifted and checked
+    lifting_alone = _run_alone(lifting)
+    def lift_all():
+        # collect_data_refs keeps the lifter's cache out of it
+        return [ str(p.factory.default_engine.lift_vex(addr=addr, collect_data_refs=True))
+                 for addr in lifting_alone.history.recent_bbl_addrs ]
+    expected = lift_all()
+    state = lifting.copy()
+    _prepare_unicorn(state)
+    run = state.unicorn.start_async()
+    lifted = lift_all()
+    nose.tools.assert_true(run.wait(timeout=60))
+    state.unicorn.finish()
+    state.unicorn.destroy()
+    nose.tools.assert_equal(lifted, expected)
+    nose.tools.assert_equal(state.unicorn.steps, lifting_alone.unicorn.steps)
+    nose.tools.assert_equal(state.addr, lifting_alone.addr)
+
+    shared = p.factory.entry_state(add_options=so.unicorn)
+    shared.unicorn.setup()
+    nose.tools.assert_raises(SimUnicornError, shared.unicorn.start_async)
+    shared.unicorn.destroy()
+
+def test_trace_modes():
+    from angr.state_plugins.unicorn_engine import TRACE
+
+    # main loops for over 100 blocks before its first call
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'uc_stop'))
+    base = p.factory.call_state(p.loader.find_symbol("main").rebased_addr, 1, [], add_options=so.unicorn)
+    base.unicorn.own_engine = True
+
+    def run(mode, step):
+        state = base.copy()
+        state.unicorn.trace_mode = mode
+        state.unicorn.trace_ring_size = 8
+        _prepare_unicorn(state)
+        state.unicorn.start(step)
+        state.unicorn.finish()
+        state.unicorn.destroy()
+        return state.unicorn.steps, list(state.history.recent_bbl_addrs)
+
+    # every run rolls back the block it stops in. TRACE_COMPRESSED encodes its oldest entries once 64 are kept,
+    # so around 63 and 95 steps the dropped block is the one that made it encode
+    for step in (10, 62, 63, 64, 94, 95, 96):
+        steps, full = run(TRACE.TRACE_FULL, step)
+        nose.tools.assert_equal(len(full), steps)
+        nose.tools.assert_equal(run(TRACE.TRACE_COMPRESSED, step), (steps, full))
+        ring_steps, ring = run(TRACE.TRACE_RING, step)
+        nose.tools.assert_equal(ring_steps, steps)
+        nose.tools.assert_equal(ring, full[-len(ring):])
+        nose.tools.assert_greater_equal(len(ring), min(steps, 7))
+
+def test_speculative_lifting():
+    from angr.state_plugins.unicorn_engine import set_speculative_lifting, get_stats, reset_stats
+
+    p = _fauxware()
+    def symbolic_register(s):
+        s.regs.xmm7 = s.solver.BVS('unused', 128) # a symbolic register gets every block lifted and checked
+    def explore():
+        reset_stats()
+        pg = _explore_fauxware(p, symbolic_register)
+        return sorted(d.history.bbl_addrs.hardcopy for d in pg.deadended), get_stats()
+
+    paths, stats = explore()
+    set_speculative_lifting(True)
+    try:
+        speculative_paths, speculative_stats = explore()
+    finally:
+        set_speculative_lifting(False)
+
+    nose.tools.assert_equal(speculative_paths, paths)
+    nose.tools.assert_greater(stats['lifts'], 0)
+    nose.tools.assert_equal(stats['speculative_hits'], 0)
+    # each block missing from the cache was either lifted on the spot or found lifted ahead of time
+    nose.tools.assert_equal(speculative_stats['lifts'] + speculative_stats['speculative_hits'],
+                            speculative_stats['block_cache_misses'])
+
+def test_trace_file():
+    from angr.state_plugins.unicorn_engine import set_trace_file, read_trace_file, TRACE_EVENT
+
+    with _temp_path() as path:
+        try:
+            nose.tools.assert_true(set_trace_file(path))
+            pg = _explore_fauxware()
+        finally:
+            set_trace_file(None)
+
+        blocks = [ value for _, kind, value in read_trace_file(path) if kind == TRACE_EVENT.TRACE_EVENT_BLOCK ]
+    # every block unicorn ran made it to history as well
+    history_blocks = set()
+    for s in pg.deadended:
+        history_blocks.update(s.history.bbl_addrs)
+    nose.tools.assert_greater(len(blocks), 0)
+    nose.tools.assert_true(set(blocks).issubset(history_blocks))
+
+def test_coverage_map():
+    p = _fauxware()
+    coverage = bytearray(0x10000)
+    def count_coverage(s):
+        s.unicorn.coverage_map = coverage
+    _explore_fauxware(p, count_coverage)
+    edges = sum(1 for count in coverage if count)
+    nose.tools.assert_greater(edges, 10)
+
+    # the map is never cleared, and the same paths again hit no new edges
+    hit = [ i for i, count in enumerate(coverage) if count ]
+    _explore_fauxware(p, count_coverage)
+    nose.tools.assert_equal([ i for i, count in enumerate(coverage) if count ], hit)
+
+def test_profile():
+    from angr.state_plugins.unicorn_engine import set_profiling, reset_profile, get_profile, write_profile
+
+    p = _fauxware()
+    try:
+        reset_profile()
+        set_profiling(True)
+        _explore_fauxware(p)
+        set_profiling(False)
+
+        profile = get_profile()
+        nose.tools.assert_greater(len(profile), 0)
+        nose.tools.assert_true(any(counts['instructions'] > counts['executions'] for counts in profile.values()))
+        # every run ended somewhere
+        nose.tools.assert_greater(sum(sum(counts['stops'].values()) for counts in profile.values()), 0)
+
+        with _temp_path() as path:
+            write_profile(path, project=p)
+            with open(path) as f:
+                lines = f.read().splitlines()
+        nose.tools.assert_greater(len(lines), 0)
+        for line in lines:
+            frames, count = line.rsplit(' ', 1)
+            nose.tools.assert_greater(int(count), 0)
+            nose.tools.assert_true(frames.split(';')[-1].startswith('0x'))
+    finally:
+        set_profiling(False)
+        reset_profile()
+
+def test_stats():
+    from angr.state_plugins.unicorn_engine import get_stats, reset_stats
+
+    reset_stats()
+    _explore_fauxware()
+
+    stats = get_stats()
+    nose.tools.assert_greater(stats['blocks'], 0)
+    nose.tools.assert_greater(stats['mem_reads'] + stats['mem_writes'], 0)
+    # every run stopped once, and rolled back at least its last block
+    runs = sum(stats['stops'].values())
+    nose.tools.assert_greater(runs, 0)
+    nose.tools.assert_greater_equal(stats['rollbacks'], runs)
+
+    reset_stats()
+    nose.tools.assert_equal(get_stats(), { })
+
+def test_stats_nodecode():
+    from angr.state_plugins.unicorn_engine import STOP, set_profiling, reset_profile, get_profile
+
+    code = bytes(bytearray([
+        0xb8, 0x01, 0x00, 0x00, 0x00, # 400000: mov eax, 1
+        0x0f, 0x0b,                   # 400005: ud2
+    ]))
+    p = angr.load_shellcode(code, 'x86', load_address=0x400000)
+    s = p.factory.blank_state(addr=0x400000, add_options=so.unicorn)
+    _prepare_unicorn(s)
+    try:
+        reset_profile()
+        set_profiling(True)
+        s.unicorn.start()
+        set_profiling(False)
+        s.unicorn.finish()
+        s.unicorn.destroy()
+
+        # the run is counted under the reason it reports, in the block it ended in
+        nose.tools.assert_equal(s.unicorn.stop_reason, STOP.STOP_NODECODE)
+        nose.tools.assert_equal(s.unicorn.stats['stops'], { 'STOP_NODECODE': 1 })
+        nose.tools.assert_equal(get_profile()[0x400000]['stops'], { 'STOP_NODECODE': 1 })
+    finally:
+        set_profiling(False)
+        reset_profile()
+
+def test_self_modifying_code():
+    from angr.state_plugins.unicorn_engine import STOP
+
+    # a loop that bumps the immediate of "add ebx, 1" each time around, after running it
+    code = bytes(bytearray([
+        0xb9, 0x03, 0x00, 0x00, 0x00,       # 400000: mov ecx, 3
+        0xeb, 0x0b,                         # 400005: jmp 400012
+        0xfe, 0x05, 0x14, 0x00, 0x40, 0x00, # 400007: inc byte ptr [400014]
+        0x49,                               # 40000d: dec ecx
+        0x75, 0xf5,                         # 40000e: jnz 400005
+        0x90, 0x90,                         # 400010: nop; nop
+        0x83, 0xc3, 0x01,                   # 400012: add ebx, 1
+        0xeb, 0xf0,                         # 400015: jmp 400007
+    ]))
+    p = angr.load_shellcode(code, 'x86', load_address=0x400000)
+    s = p.factory.blank_state(addr=0x400000, add_options=so.unicorn)
+    s.regs.ebx = 0
+    s.regs.edx = s.solver.BVS('unused', 32) # a symbolic register gets every block lifted and checked
+
+    s.unicorn.setup()
+    s.unicorn.set_stops({0x400010})
+    s.unicorn.set_tracking(track_bbls=True, track_stack=False)
+    s.unicorn.hook()
+    s.unicorn.start()
+    s.unicorn.finish()
+    s.unicorn.destroy()
+
+    nose.tools.assert_equal(s.unicorn.stop_reason, STOP.STOP_STOPPOINT)
+    nose.tools.assert_equal(s.solver.eval(s.regs.ebx), 1 + 2 + 3)
+    nose.tools.assert_equal(s.unicorn.smc_count, 3)
+    # each write dropped the blocks on the page, so the loop was lifted again every time around
+    nose.tools.assert_greater(s.unicorn.stats['lifts'], len(set(s.history.recent_bbl_addrs)))
+
 def test_fauxware_aggressive():
     p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
     s_unicorn = p.factory.entry_state(